@@ -30,6 +30,7 @@ struct option options[] = {
   { "create", 1, NULL, 'c' },
   { "show", 0, NULL, 's' },
   { "log", 1, NULL, 'l' },
+  { "map", 1, NULL, 'm' },
   { "opt", 0, NULL, 'O' },
   { "lib", 1, NULL, 'L' },
   { "help", 0, NULL, 'h' },
@@ -56,6 +57,7 @@ typedef struct {
   unsigned xref_to;
   unsigned duplicate:1;
   int line, incl_level;
+  char *file;
   struct {
     unsigned char *p;
     uint64_t u;
@@ -94,6 +96,7 @@ int optimize_code4(FILE *lf);
 int optimize_code5(FILE *lf);
 int optimize_code6(FILE *lf);
 void log_code(FILE *lf, int style);
+int write_map(char *name);
 int decompile(unsigned char *data, unsigned size);
 
 int config_ok = 0;
@@ -120,6 +123,7 @@ struct {
   unsigned show:1;
   char *file;
   char *log_file;
+  char *map_file;
   char *lib_path[2];
 } opt = { lib_path: { NULL, "/usr/share/gfxboot" } };
 
@@ -129,7 +133,7 @@ int main(int argc, char **argv)
 
   opterr = 0;
 
-  while((i = getopt_long(argc, argv, "c:sfhL:l:O:v", options, NULL)) != -1) {
+  while((i = getopt_long(argc, argv, "c:sfhL:l:m:O:v", options, NULL)) != -1) {
     switch(i) {
       case 'c':
         opt.file = optarg;
@@ -143,6 +147,10 @@ int main(int argc, char **argv)
         opt.log_file = optarg;
         break;
 
+      case 'm':
+        opt.map_file = optarg;
+        break;
+
       case 'L':
         opt.lib_path[0] = optarg;
         break;
@@ -165,6 +173,7 @@ int main(int argc, char **argv)
 
   if(opt.file && argc <= 1) {
     if(parse_config(argc ? *argv : "-", opt.log_file)) return 1;
+    if(opt.map_file && write_map(opt.map_file)) return 1;
     return write_data(opt.file);
   }
 
@@ -186,6 +195,7 @@ void help()
     "Options:\n"
     "  -c, --create FILE       Compile SOURCE to FILE.\n"
     "  -l, --log LOGFILE       Write compile log to LOGFILE.\n"
+    "  -m, --map MAPFILE       Write code offset to source line map to MAPFILE.\n"
     "  -s, --show              Decompile SOURCE.\n"
     "  -L, --lib PATH          Set include file search path to PATH.\n"
     "  -O, --opt LEVEL         Optimization level (0 - 3).\n"
@@ -990,6 +1000,7 @@ int parse_config(char *name, char *log_file)
     c = new_code();
     c->line = line;
     c->incl_level = incl_level;
+    c->file = cfg[incl_level].name;
 
     if(*word == '"') {
       c->type = t_string;
@@ -1167,6 +1178,41 @@ int parse_config(char *name, char *log_file)
 }
 
 
+/*
+ * Write source map: one 'OFFSET FILE:LINE' line per code offset where the
+ * source location changes.
+ *
+ * The map is read by the 'profile' debug command.
+ */
+int write_map(char *name)
+{
+  FILE *f;
+  unsigned u;
+  int line = 0;
+  char *file = NULL;
+
+  f = strcmp(name, "-") ? fopen(name, "w") : stdout;
+
+  if(!f) {
+    perror(name);
+    return 1;
+  }
+
+  for(u = 0; u < code_size; u++) {
+    code_t *c = code + u;
+    if(c->type == t_skip || !c->size || !c->line || !c->file) continue;
+    if(c->line == line && file && !strcmp(c->file, file)) continue;
+    line = c->line;
+    file = c->file;
+    fprintf(f, "0x%x %s:%d\n", c->ofs, file, line);
+  }
+
+  fclose(f);
+
+  return 0;
+}
+
+
 /*
  * Remove deleted dictionary entries.
  */
@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
+
+/*
+ * Asset pack layout (all numbers are 32 bit little-endian):
+ *
+ *   0: magic (PACK_MAGIC)
+ *   4: number of entries
+ *   8: index: per entry name offset, data offset, data size
+ *      (sorted by name)
+ *   0-terminated names
+ *   file data, each aligned to PACK_ALIGN bytes
+ *
+ * The pack is loaded into a memory pool object, which is only 4 byte
+ * aligned - so larger alignment in the file would not carry over.
+ *
+ * All offsets are relative to the start of the pack. See gfx_pack_init()
+ * in gfxboot_lib.c.
+ */
+#define PACK_MAGIC	0x4b415047
+#define PACK_ALIGN	4
+
+typedef struct {
+  char *name;
+  char *path;
+  unsigned char *data;
+  unsigned size;
+  unsigned name_ofs;
+  unsigned data_ofs;
+} entry_t;
+
+struct option options[] = {
+  { "create", 1, NULL, 'c' },
+  { "show", 0, NULL, 's' },
+  { "verbose", 0, NULL, 'v' },
+  { "help", 0, NULL, 'h' },
+  { }
+};
+
+void help(void);
+int read_file(entry_t *entry);
+int cmp_entry(const void *p1, const void *p2);
+void put_le32(unsigned char *buf, unsigned val);
+unsigned get_le32(unsigned char *buf);
+int write_pack(char *name, int argc, char **argv);
+int show_pack(char *name);
+
+struct {
+  unsigned verbose;
+  unsigned show:1;
+  char *file;
+} opt;
+
+int main(int argc, char **argv)
+{
+  int i;
+
+  opterr = 0;
+
+  while((i = getopt_long(argc, argv, "c:shv", options, NULL)) != -1) {
+    switch(i) {
+      case 'c':
+        opt.file = optarg;
+        break;
+
+      case 's':
+        opt.show = 1;
+        break;
+
+      case 'v':
+        opt.verbose++;
+        break;
+
+      default:
+        help();
+        return 0;
+    }
+  }
+
+  argc -= optind; argv += optind;
+
+  if(opt.file && argc) {
+    return write_pack(opt.file, argc, argv);
+  }
+
+  if(opt.show && argc == 1) {
+    return show_pack(*argv);
+  }
+
+  help();
+
+  return 1;
+}
+
+
+void help()
+{
+  fprintf(stderr, "%s",
+    "Usage: gfxboot-pack [OPTIONS] FILES\n"
+    "Create/list gfxboot2 asset pack.\n"
+    "Files are stored under their base name; gfxboot2 looks up all files\n"
+    "it reads in the pack before trying the file system.\n"
+    "Options:\n"
+    "  -c, --create PACK       Create PACK from FILES.\n"
+    "  -s, --show              List content of pack FILE.\n"
+    "  -v, --verbose           Show what is being done.\n"
+    "  -h, --help              Show this help text.\n"
+  );
+}
+
+
+int read_file(entry_t *entry)
+{
+  FILE *f;
+  long size;
+
+  if(!(f = fopen(entry->path, "r"))) {
+    perror(entry->path);
+    return 1;
+  }
+
+  if(fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+    perror(entry->path);
+    fclose(f);
+    return 1;
+  }
+
+  if(size > 0x7fffffff) {
+    fprintf(stderr, "%s: file too large\n", entry->path);
+    fclose(f);
+    return 1;
+  }
+
+  entry->size = (unsigned) size;
+  entry->data = malloc(entry->size + 1);
+
+  if(!entry->data || fread(entry->data, 1, entry->size, f) != entry->size) {
+    fprintf(stderr, "%s: read error\n", entry->path);
+    fclose(f);
+    return 1;
+  }
+
+  fclose(f);
+
+  return 0;
+}
+
+
+int cmp_entry(const void *p1, const void *p2)
+{
+  return strcmp(((const entry_t *) p1)->name, ((const entry_t *) p2)->name);
+}
+
+
+void put_le32(unsigned char *buf, unsigned val)
+{
+  buf[0] = (unsigned char) val;
+  buf[1] = (unsigned char) (val >> 8);
+  buf[2] = (unsigned char) (val >> 16);
+  buf[3] = (unsigned char) (val >> 24);
+}
+
+
+unsigned get_le32(unsigned char *buf)
+{
+  return buf[0] + ((unsigned) buf[1] << 8) + ((unsigned) buf[2] << 16) + ((unsigned) buf[3] << 24);
+}
+
+
+int write_pack(char *name, int argc, char **argv)
+{
+  entry_t *entries;
+  unsigned u, cnt = (unsigned) argc;
+  uint64_t ofs;
+  unsigned char *pack;
+  FILE *f;
+
+  entries = calloc(cnt, sizeof *entries);
+  if(!entries) return 1;
+
+  for(u = 0; u < cnt; u++) {
+    entries[u].path = argv[u];
+    entries[u].name = strrchr(argv[u], '/') ? strrchr(argv[u], '/') + 1 : argv[u];
+    if(!*entries[u].name) {
+      fprintf(stderr, "%s: invalid file name\n", argv[u]);
+      return 1;
+    }
+    if(read_file(entries + u)) return 1;
+  }
+
+  // sorted, so gfxboot2 can do a binary search
+  qsort(entries, cnt, sizeof *entries, cmp_entry);
+
+  for(u = 1; u < cnt; u++) {
+    if(!strcmp(entries[u - 1].name, entries[u].name)) {
+      fprintf(stderr, "%s: duplicate file name (%s, %s)\n", entries[u].name, entries[u - 1].path, entries[u].path);
+      return 1;
+    }
+  }
+
+  ofs = 8 + 12 * (uint64_t) cnt;
+
+  for(u = 0; u < cnt; u++) {
+    entries[u].name_ofs = (unsigned) ofs;
+    ofs += strlen(entries[u].name) + 1;
+  }
+
+  for(u = 0; u < cnt; u++) {
+    ofs = (ofs + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1);
+    entries[u].data_ofs = (unsigned) ofs;
+    ofs += entries[u].size;
+  }
+
+  if(ofs > 0x7fffffff) {
+    fprintf(stderr, "%s: pack too large\n", name);
+    return 1;
+  }
+
+  pack = calloc(1, ofs);
+  if(!pack) return 1;
+
+  put_le32(pack, PACK_MAGIC);
+  put_le32(pack + 4, cnt);
+
+  for(u = 0; u < cnt; u++) {
+    put_le32(pack + 8 + 12 * u, entries[u].name_ofs);
+    put_le32(pack + 8 + 12 * u + 4, entries[u].data_ofs);
+    put_le32(pack + 8 + 12 * u + 8, entries[u].size);
+    strcpy((char *) pack + entries[u].name_ofs, entries[u].name);
+    memcpy(pack + entries[u].data_ofs, entries[u].data, entries[u].size);
+    if(opt.verbose) printf("%8u  %s\n", entries[u].size, entries[u].name);
+  }
+
+  if(!(f = fopen(name, "w"))) {
+    perror(name);
+    return 1;
+  }
+
+  if(fwrite(pack, 1, ofs, f) != ofs) {
+    perror(name);
+    fclose(f);
+    return 1;
+  }
+
+  if(fclose(f)) {
+    perror(name);
+    return 1;
+  }
+
+  if(opt.verbose) printf("%s: %u files, %u bytes\n", name, cnt, (unsigned) ofs);
+
+  return 0;
+}
+
+
+int show_pack(char *name)
+{
+  entry_t pack = { path: name };
+  unsigned u, cnt;
+
+  if(read_file(&pack)) return 1;
+
+  if(pack.size < 8 || get_le32(pack.data) != PACK_MAGIC) {
+    fprintf(stderr, "%s: not a gfxboot2 asset pack\n", name);
+    return 1;
+  }
+
+  cnt = get_le32(pack.data + 4);
+
+  if(cnt > (pack.size - 8) / 12) {
+    fprintf(stderr, "%s: broken index\n", name);
+    return 1;
+  }
+
+  // make sure names are terminated
+  pack.data[pack.size] = 0;
+
+  for(u = 0; u < cnt; u++) {
+    unsigned name_ofs = get_le32(pack.data + 8 + 12 * u);
+    unsigned data_ofs = get_le32(pack.data + 8 + 12 * u + 4);
+    unsigned size = get_le32(pack.data + 8 + 12 * u + 8);
+    printf("%8u  %8u  %s\n", data_ofs, size, name_ofs < pack.size ? (char *) pack.data + name_ofs : "<broken>");
+  }
+
+  return 0;
+}
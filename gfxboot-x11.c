@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <gfxboot.h>
 
@@ -48,7 +49,10 @@ struct {
   unsigned help:1;
   unsigned x11:1;
   int auto_run;
+  unsigned glyph_cache;
   FILE *debug_file;
+  char *snapshot;
+  unsigned prim_stats:1;
 } opt;
 
 struct option options[] = {
@@ -58,6 +62,9 @@ struct option options[] = {
   { "run", 0, NULL, 1001 },
   { "no-run", 0, NULL, 1002 },
   { "file", 1, NULL, 1 },
+  { "glyph-cache", 1, NULL, 1003 },
+  { "snapshot", 1, NULL, 1004 },
+  { "prim-stats", 0, NULL, 1005 },
   { }
 };
 
@@ -75,6 +82,7 @@ int x11_close_window(void);
 int x11_event_loop(void);
 
 int x11_gfxboot_init(void);
+int x11_gfxboot_snapshot(char *name);
 int x11_gfxboot_process_key(int *key);
 void x11_gfxboot_print_timeout(int timeout, void *data);
 void x11_gfxboot_clear_timeout(void *data);
@@ -89,6 +97,7 @@ int main(int argc, char **argv)
   opterr = 0;
 
   opt.x11 = 1;
+  opt.glyph_cache = GLYPH_CACHE_SIZE;
 
   while((i = getopt_long(argc, argv, "hv", options, NULL)) != -1) {
     switch(i) {
@@ -117,6 +126,19 @@ int main(int argc, char **argv)
         opt.auto_run = -1;
         break;
 
+      case 1003:
+        opt.glyph_cache = (unsigned) strtoul(optarg, NULL, 0);
+        break;
+
+      case 1004:
+        opt.snapshot = optarg;
+        opt.auto_run = 1;
+        break;
+
+      case 1005:
+        opt.prim_stats = 1;
+        break;
+
       default:
         help();
         return i == 'h' ? 0 : 1;
@@ -154,6 +176,11 @@ int main(int argc, char **argv)
 
   if(x11_gfxboot_init()) return 2;
 
+  if(opt.snapshot) {
+    if(opt.x11) x11_close_window();
+    return x11_gfxboot_snapshot(opt.snapshot);
+  }
+
   run_debug_commands(opt.debug_file);
 
   if(opt.x11) {
@@ -162,6 +189,11 @@ int main(int argc, char **argv)
     x11_close_window();
   }
 
+  if(opt.prim_stats) {
+    char cmd[] = "primstats";
+    gfxboot_debug_command(cmd);
+  }
+
   return 0;
 }
 
@@ -180,6 +212,12 @@ void help()
     "      --no-x11          Console mode.\n"
     "      --run             Start code automatically (default in x11 mode).\n"
     "      --no-run          Do not start code automatically (default in console mode).\n"
+    "      --glyph-cache SIZE\n"
+    "                        Glyph cache size per font in bytes (0 = no cache).\n"
+    "      --snapshot FILE   Run code up to the 'snapshot' primitive and save the VM state\n"
+    "                        to FILE. Put FILE as 'gfxboot.snapshot' into DIR to boot from it.\n"
+    "      --prim-stats      Count calls, cpu cycles, and memory allocations per primitive\n"
+    "                        and show them at exit.\n"
     "  -v, --verbose         Show more detailed info.\n"
     "  -h, --help            Show this text.\n"
     "\n"
@@ -476,6 +514,12 @@ int x11_gfxboot_init()
   u &= ((uint64_t) 1 << (gfxboot_data->screen.real.bytes_per_pixel * 8)) - 1;
   gfxboot_data->screen.real.res = mask_to_color_bits(u);
 
+  gfxboot_data->glyph_cache.size = opt.glyph_cache;
+
+  gfxboot_data->vm.snapshot.create = opt.snapshot ? 1 : 0;
+
+  gfxboot_data->vm.debug.prim_stats.enabled = opt.prim_stats;
+
   gfxboot_data->vm.mem.size = GFX_MEMORY_IN_MIB * (1 << 20);
   gfxboot_data->vm.mem.ptr = calloc(1, gfxboot_data->vm.mem.size);
   if(!gfxboot_data->vm.mem.ptr) return 1;
@@ -486,6 +530,52 @@ int x11_gfxboot_init()
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Save heap snapshot to file.
+//
+// Return exit code.
+//
+int x11_gfxboot_snapshot(char *name)
+{
+  void *buf;
+  unsigned size;
+  FILE *f;
+
+  if(!gfxboot_data->vm.snapshot.ready) {
+    fprintf(stderr, "%s: 'snapshot' not reached\n", name);
+    return 3;
+  }
+
+  size = gfxboot_snapshot(NULL, 0);
+  buf = size ? malloc(size) : NULL;
+
+  if(!buf || gfxboot_snapshot(buf, size) != size) {
+    fprintf(stderr, "%s: failed to create snapshot\n", name);
+    free(buf);
+    return 3;
+  }
+
+  if(!(f = fopen(name, "w"))) {
+    perror(name);
+    free(buf);
+    return 3;
+  }
+
+  // fclose() must happen in any case
+  int err = fwrite(buf, 1, size, f) != size;
+  if(fclose(f)) err = 1;
+
+  free(buf);
+
+  if(err) {
+    perror(name);
+    return 3;
+  }
+
+  return 0;
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 int x11_gfxboot_process_key(int *key)
 {
@@ -602,13 +692,6 @@ int gfxboot_snprintf(char *str, unsigned size, const char *format, ...)
 }
 
 
-// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-void gfxboot_sys_free(void *ptr)
-{
-  if(ptr) free(ptr);
-}
-
-
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 unsigned long gfxboot_sys_strlen(const char *s)
 {
@@ -631,15 +714,19 @@ long int gfxboot_sys_strtol(const char *nptr, char **endptr, int base)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-int gfxboot_sys_read_file(char *name, void **buf)
+// Read file into buffer provided by alloc(data, file_size).
+//
+// alloc() is not called for empty files.
+//
+// Return file size or -1.
+//
+int gfxboot_sys_read_file(char *name, read_alloc_function_t alloc, void *data)
 {
   int size = -1;
   char *tmp = NULL;
   struct stat sbuf;
   int fd, len;
 
-  *buf = NULL;
-
   if(!name) return size;
 
   fd = open(name, O_RDONLY);
@@ -652,7 +739,8 @@ int gfxboot_sys_read_file(char *name, void **buf)
     }
 
     if(size > 0) {
-      *buf = tmp = malloc((size_t) size);
+      tmp = alloc(data, (unsigned) size);
+      if(!tmp) size = -1;
       while(size > 0) {
         len = read(fd, tmp, (size_t) size);
         if(len <= 0) break;
@@ -663,9 +751,7 @@ int gfxboot_sys_read_file(char *name, void **buf)
 
     close(fd);
 
-    if(size > 0) {
-      *buf = NULL;
-      free(tmp);
+    if(size != 0) {
       size = -1;
     }
     else {
@@ -712,6 +798,50 @@ int gfxboot_getkey()
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Run func(data, 0) ... func(data, count - 1), spread over all CPUs.
+//
+typedef struct {
+  parallel_function_t func;
+  void *data;
+  unsigned count;
+  unsigned next;
+} parallel_t;
+
+static void *parallel_worker(void *arg)
+{
+  parallel_t *p = arg;
+  unsigned idx;
+
+  while((idx = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->count) {
+    p->func(p->data, idx);
+  }
+
+  return NULL;
+}
+
+void gfxboot_sys_parallel(parallel_function_t func, void *data, unsigned count)
+{
+  parallel_t p = { .func = func, .data = data, .count = count };
+  pthread_t threads[64];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned u, n = cpus > 1 ? (unsigned) cpus : 1;
+
+  if(n > count) n = count;
+  if(n > sizeof threads / sizeof *threads) n = sizeof threads / sizeof *threads;
+
+  // calling thread is worker 0
+  for(u = 1; u < n; u++) {
+    if(pthread_create(threads + u, NULL, parallel_worker, &p)) break;
+  }
+  n = u;
+
+  parallel_worker(&p);
+
+  for(u = 1; u < n; u++) pthread_join(threads[u], NULL);
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 void x11_gfxboot_data_free()
 {
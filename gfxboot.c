@@ -6,33 +6,17 @@
 
 static uint64_t gfx_decode_number(const void *data, unsigned len);
 static unsigned decode_raw_instr(uint8_t *data, decoded_instr_t *instr);
-
-static inline uint64_t tsc(void)
-{
-#if defined (__x86_64__)
-  uint32_t eax, edx;
-
-  asm volatile (
-    "rdtsc\n"
-    : "=a" (eax), "=d" (edx)
-  );
-
-  return ((uint64_t) edx << 32) + eax;
-#elif defined (__i386__)
-  uint64_t tsc;
-
-  asm volatile (
-    "rdtsc"
-    : "=A" (tsc)
-  );
-
-  return tsc;
-#else
-  #error "OOPS"
-  return 0;
-#endif
-}
-
+static void gfx_program_predecode(obj_id_t code_id);
+static predecoded_code_t *predecoded_code(uint8_t **blob);
+static unsigned predecoded_slot(predecoded_code_t *pcode, unsigned ip);
+static int predecoded_slot_at(predecoded_code_t *pcode, unsigned slot, unsigned ip);
+static int gfx_program_enter_code(context_t *ctx, predecoded_code_t *pcode);
+static inline int decode_instr(decoded_instr_t *instr, predecoded_code_t *pcode, uint8_t *blob, int trace);
+static void trace_instr(decoded_instr_t *instr, unsigned ip, uint8_t *data);
+static obj_id_t name_new(decoded_instr_t *instr, uint8_t sub_type);
+static inline void exec_instr(decoded_instr_t *instr);
+static int gfx_program_debug_active(unsigned steps_set);
+static int run_predecoded(predecoded_code_t *pcode, uint8_t *blob, unsigned cmd_count);
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 uint64_t gfx_decode_number(const void *data, unsigned len)
@@ -93,10 +77,309 @@ unsigned gfx_program_init(obj_id_t program)
 
   gfxboot_data->vm.program.context = ctx_id;
 
+  gfx_program_predecode(program);
+
+  return 1;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Decode all instructions in code blob in advance.
+//
+// This includes the instructions inside code blocks ('{ ... }'), so code
+// objects referencing parts of the blob can use the pre-decoded
+// instructions, too. Instructions are stored in code blob order.
+//
+// Cross references are resolved and the next instruction after a code block
+// is looked up, so the interpreter can follow the instruction indices
+// without looking at the code blob again.
+//
+// Names (words, references, strings) are interned into symbols: all
+// instructions with the same name point to the same bytes in the code blob
+// and get the same symbol id. Dictionary keys from code are compared by
+// symbol id, see gfx_program_sym().
+//
+// Stores result in vm.program.code. If the blob can't be fully decoded,
+// nothing is stored and instructions are decoded while running.
+//
+void gfx_program_predecode(obj_id_t code_id)
+{
+  decoded_instr_t instr;
+  unsigned u, ip, inst_size, slots, caches, names;
+
+  gfx_obj_ref_dec(gfxboot_data->vm.program.code);
+  gfxboot_data->vm.program.code = 0;
+
+  data_t *mem = gfx_obj_mem_ptr(code_id);
+
+  if(!mem || mem->ref_id || !mem->size) return;
+
+  unsigned size = mem->size;
+
+  // first pass: verify code and count instructions
+  for(ip = slots = caches = names = 0; ip < size; slots++) {
+    inst_size = decode_raw_instr(mem->ptr + ip, &instr);
+    if(ip + inst_size > size) return;
+    // xrefs are counted, too, as they might resolve to a t_word
+    if(instr.type == t_word || instr.type == t_get || instr.type == t_set || instr.type == t_xref) caches++;
+    // names: t_string, t_word, t_ref, t_get, t_set
+    if((instr.type >= t_string && instr.type <= t_set) || instr.type == t_xref) names++;
+    // descend into code blocks
+    ip = instr.type == t_code ? (unsigned) (instr.arg2 - (uint8_t *) mem->ptr) : ip + inst_size;
+  }
+
+  obj_id_t pcode_id = gfx_obj_mem_new(
+    sizeof (predecoded_code_t) +
+    slots * sizeof (predecoded_instr_t) +
+    caches * sizeof (hash_cache_t),
+    0
+  );
+
+  // symbol table for interning: open addressing, slot + 1 of first instruction with that name
+  unsigned sym_mask = 0xf;
+  while(sym_mask < 2 * names) sym_mask = (sym_mask << 1) + 1;
+  obj_id_t sym_id = gfx_obj_mem_new((sym_mask + 1) * sizeof (uint32_t), 0);
+
+  data_t *pcode_mem = gfx_obj_mem_ptr(pcode_id);
+  data_t *sym_mem = gfx_obj_mem_ptr(sym_id);
+
+  if(!pcode_mem || !sym_mem) {
+    gfx_obj_ref_dec(pcode_id);
+    gfx_obj_ref_dec(sym_id);
+    return;
+  }
+
+  // object list might have been reallocated
+  mem = gfx_obj_mem_ptr(code_id);
+
+  predecoded_code_t *pcode = pcode_mem->ptr;
+  uint32_t *sym = sym_mem->ptr;
+
+  pcode->code_id = code_id;
+  pcode->size = size;
+  pcode->slots = slots;
+  pcode->caches = caches;
+
+  // second pass: store decoded instructions
+  for(ip = slots = caches = 0; ip < size; slots++) {
+    predecoded_instr_t *pi = pcode->instr + slots;
+    inst_size = decode_raw_instr(mem->ptr + ip, &instr);
+    pi->ip = ip;
+    pi->size = inst_size;
+    // code blocks are skipped; the next instruction is looked up below
+    pi->next = instr.type == t_code ? 0 : slots + 1;
+
+    unsigned next_ip = instr.type == t_code ? (unsigned) (instr.arg2 - (uint8_t *) mem->ptr) : ip + inst_size;
+
+    if(instr.type == t_xref) {
+      // the referenced instruction must be inside the code blob
+      unsigned xref_ip = ip - (unsigned) instr.arg1;
+      if(
+        instr.arg1 <= 0 ||
+        instr.arg1 > (int64_t) ip ||
+        xref_ip + decode_raw_instr(mem->ptr + xref_ip, &instr) > size
+      ) {
+        pcode->slots = 0;
+        break;
+      }
+    }
+
+    if(instr.type == t_word || instr.type == t_get || instr.type == t_set) pi->cache = ++caches;
+
+    pi->type = instr.type;
+    pi->arg1 = instr.arg1;
+    pi->arg2 = instr.arg2 ? (uint32_t) (instr.arg2 - (uint8_t *) mem->ptr) : 0;
+
+    if(instr.type >= t_string && instr.type <= t_set && pi->arg2) {
+      data_t name = { .ptr = instr.arg2, .size = (unsigned) instr.arg1 };
+      unsigned u = gfx_obj_hash_key(&name) & sym_mask;
+      for(; sym[u]; u = (u + 1) & sym_mask) {
+        predecoded_instr_t *pi_sym = pcode->instr + sym[u] - 1;
+        if(
+          pi_sym->arg1 == pi->arg1 &&
+          !gfx_memcmp((uint8_t *) mem->ptr + pi_sym->arg2, instr.arg2, name.size)
+        ) {
+          pi->arg2 = pi_sym->arg2;
+          break;
+        }
+      }
+      if(!sym[u]) sym[u] = slots + 1;
+      pi->sym = pi->arg2 + 1;
+    }
+
+    ip = next_ip;
+  }
+
+  gfx_obj_ref_dec(sym_id);
+
+  // third pass: find instruction after each code block
+  for(u = 0; u < pcode->slots; u++) {
+    predecoded_instr_t *pi = pcode->instr + u;
+    if(!pi->next) {
+      pi->next = predecoded_slot(pcode, pi->ip + pi->size);
+      if(!predecoded_slot_at(pcode, pi->next, pi->ip + pi->size)) pcode->slots = 0;
+    }
+  }
+
+  if(!pcode->slots) {
+    gfx_obj_ref_dec(pcode_id);
+    return;
+  }
+
+  gfxboot_data->vm.program.code = pcode_id;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get pre-decoded code and the code blob it belongs to.
+//
+// Return 0 if there is no pre-decoded code.
+//
+predecoded_code_t *predecoded_code(uint8_t **blob)
+{
+  data_t *pcode_mem = gfx_obj_mem_ptr(gfxboot_data->vm.program.code);
+
+  if(!pcode_mem) return 0;
+
+  predecoded_code_t *pcode = pcode_mem->ptr;
+  data_t *blob_mem = gfx_obj_mem_ptr(pcode->code_id);
+
+  if(!blob_mem || blob_mem->size != pcode->size) return 0;
+
+  *blob = blob_mem->ptr;
+
+  return pcode;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Find index of first pre-decoded instruction at or after code blob offset ip.
+//
+unsigned predecoded_slot(predecoded_code_t *pcode, unsigned ip)
+{
+  unsigned lo = 0, hi = pcode->slots;
+
+  while(lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if(pcode->instr[mid].ip < ip) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Check if instruction index slot is at code blob offset ip.
+//
+// The index past the last instruction is at the code blob end.
+//
+int predecoded_slot_at(predecoded_code_t *pcode, unsigned slot, unsigned ip)
+{
+  return slot < pcode->slots ? pcode->instr[slot].ip == ip : ip == pcode->size;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Look up pre-decoded instructions for the code of a context.
+//
+// This is done once when a code object is entered (or ip has been changed
+// from outside). The code object is checked against the code blob and the
+// range of its instructions and the current instruction are stored in the
+// context. Afterwards, instructions are run directly from the slots.
+//
+// Return 1 if the code is pre-decoded.
+//
+int gfx_program_enter_code(context_t *ctx, predecoded_code_t *pcode)
+{
+  ctx->slot = ctx->start_slot = ctx->end_slot = 0;
+  ctx->pcode_id = gfxboot_data->vm.program.code;
+
+  if(!pcode) return 0;
+
+  data_t *mem = gfx_obj_mem_ptr(ctx->code_id);
+
+  if(!mem) return 0;
+
+  unsigned ofs = 0;
+
+  if(mem->ref_id) {
+    data_t *blob = mem->ref_id == pcode->code_id ? gfx_obj_mem_ptr(mem->ref_id) : 0;
+    if(!blob || mem->ptr < blob->ptr || mem->ptr + mem->size > blob->ptr + blob->size) return 0;
+    ofs = (unsigned) (mem->ptr - blob->ptr);
+  }
+  else if(ctx->code_id != pcode->code_id) {
+    return 0;
+  }
+
+  if(ctx->ip > mem->size) return 0;
+
+  unsigned start = predecoded_slot(pcode, ofs);
+  unsigned end = predecoded_slot(pcode, ofs + mem->size);
+  unsigned slot = predecoded_slot(pcode, ofs + ctx->ip);
+
+  if(
+    !predecoded_slot_at(pcode, start, ofs) ||
+    !predecoded_slot_at(pcode, end, ofs + mem->size) ||
+    !predecoded_slot_at(pcode, slot, ofs + ctx->ip)
+  ) {
+    return 0;
+  }
+
+  ctx->start_slot = start + 1;
+  ctx->end_slot = end + 1;
+  ctx->slot = slot + 1;
+
   return 1;
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Invalidate all dictionary lookup caches.
+//
+void gfx_program_flush_cache()
+{
+  data_t *pcode_mem = gfx_obj_mem_ptr(gfxboot_data->vm.program.code);
+
+  if(!pcode_mem) return;
+
+  predecoded_code_t *pcode = pcode_mem->ptr;
+  hash_cache_t *cache = (hash_cache_t *) (pcode->instr + pcode->slots);
+
+  for(unsigned u = 0; u < pcode->caches; u++) {
+    cache[u].stamp = 0;
+  }
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get symbol id of interned name.
+//
+// Names in pre-decoded code are interned (see gfx_program_predecode()); the
+// symbol id is the offset of the name in the code blob + 1. Keys with
+// symbol id are the same if and only if their ids are equal.
+//
+// Objects created from names in code are marked with flags.sym.
+//
+// Return 0 if ptr is not an interned name.
+//
+uint32_t gfx_program_sym(obj_t *ptr)
+{
+  if(!ptr || !ptr->flags.sym) return 0;
+
+  uint8_t *blob = 0;
+  predecoded_code_t *pcode = predecoded_code(&blob);
+
+  if(!pcode || (uint8_t *) ptr->data.ptr < blob || (uint8_t *) ptr->data.ptr >= blob + pcode->size) return 0;
+
+  return (uint32_t) ((uint8_t *) ptr->data.ptr - blob) + 1;
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 unsigned decode_raw_instr(uint8_t *data, decoded_instr_t *instr)
 {
@@ -154,6 +437,21 @@ unsigned decode_raw_instr(uint8_t *data, decoded_instr_t *instr)
 // arg2 is optional and may be 0; if arg2 is not 0, arg1 is its length
 //
 int gfx_decode_instr(decoded_instr_t *instr)
+{
+  uint8_t *blob = 0;
+  predecoded_code_t *pcode = predecoded_code(&blob);
+
+  return decode_instr(instr, pcode, blob, 1);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// See gfx_decode_instr().
+//
+// pcode, blob: pre-decoded code, see predecoded_code()
+// trace = 0: skip instruction tracing (fast path in gfx_program_run()).
+//
+int decode_instr(decoded_instr_t *instr, predecoded_code_t *pcode, uint8_t *blob, int trace)
 {
   *instr = (decoded_instr_t) { };
 
@@ -175,6 +473,36 @@ int gfx_decode_instr(decoded_instr_t *instr)
   unsigned ip = instr->ctx->ip;
   instr->ctx->current_ip = ip;
 
+  // the code object has been checked in gfx_program_enter_code()
+  if(
+    pcode &&
+    (
+      (instr->ctx->slot && instr->ctx->pcode_id == gfxboot_data->vm.program.code) ||
+      gfx_program_enter_code(instr->ctx, pcode)
+    )
+  ) {
+    if(instr->ctx->slot >= instr->ctx->end_slot) {
+      // at code end, do nothing
+      if(instr->ctx->slot > instr->ctx->end_slot) GFX_ERROR(err_invalid_code);
+      return 0;
+    }
+
+    predecoded_instr_t *pi = pcode->instr + instr->ctx->slot - 1;
+
+    instr->ctx->ip = ip + pi->size;
+    instr->ctx->slot = pi->next + 1;
+
+    instr->type = pi->type;
+    instr->arg1 = pi->arg1;
+    instr->arg2 = pi->arg2 ? blob + pi->arg2 : 0;
+    if(pi->cache) instr->cache = (hash_cache_t *) (pcode->instr + pcode->slots) + pi->cache - 1;
+    instr->sym = pi->sym;
+
+    if(trace && gfxboot_data->vm.debug.trace.ip) trace_instr(instr, ip, blob + pi->ip - ip);
+
+    return 1;
+  }
+
   obj_t *code_ptr = gfx_obj_ptr(instr->code_id);
 
   if(!code_ptr || code_ptr->base_type != OTYPE_MEM) {
@@ -195,7 +523,7 @@ int gfx_decode_instr(decoded_instr_t *instr)
     return 0;
   }
 
-  unsigned inst_size = decode_raw_instr(data + ip, instr);
+  unsigned next_ip = ip + decode_raw_instr(data + ip, instr);
 
   // for a cross reference, look it up and do the same again
   if(instr->type == t_xref) {
@@ -211,17 +539,7 @@ int gfx_decode_instr(decoded_instr_t *instr)
     decode_raw_instr(data + xref_ip, instr);
   }
 
-  if(gfxboot_data->vm.debug.trace.ip) {
-    gfxboot_log("IP: #%u:0x%x, type %d, ", OBJ_ID2IDX(instr->ctx->code_id), ip, instr->type);
-    if(instr->arg2) {
-      gfxboot_log("%d[%u]\n", (int) (instr->arg2 - data), (unsigned) instr->arg1);
-    }
-    else {
-      gfxboot_log("%lld (0x%llx)\n", (long long) instr->arg1, (long long) instr->arg1);
-    }
-  }
-
-  unsigned next_ip = ip + inst_size;
+  if(trace && gfxboot_data->vm.debug.trace.ip) trace_instr(instr, ip, data);
 
   if(next_ip > size) {
     GFX_ERROR(err_invalid_code);
@@ -235,9 +553,206 @@ int gfx_decode_instr(decoded_instr_t *instr)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Log decoded instruction.
+//
+// ip: instruction offset in code object
+// data: start of code object
+//
+void trace_instr(decoded_instr_t *instr, unsigned ip, uint8_t *data)
+{
+  gfxboot_log("IP: #%u:0x%x, type %d, ", OBJ_ID2IDX(instr->ctx->code_id), ip, instr->type);
+  if(instr->arg2) {
+    gfxboot_log("%d[%u]\n", (int) (instr->arg2 - data), (unsigned) instr->arg1);
+  }
+  else {
+    gfxboot_log("%lld (0x%llx)\n", (long long) instr->arg1, (long long) instr->arg1);
+  }
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Create object for instruction data (arg2), pointing into the code.
+//
+// Interned names are marked as symbols, see gfx_program_sym().
+//
+obj_id_t name_new(decoded_instr_t *instr, uint8_t sub_type)
+{
+  obj_id_t id = gfx_obj_const_mem_nofree_new(instr->arg2, instr->arg1, sub_type, instr->code_id);
+
+  if(instr->sym) {
+    obj_t *ptr = gfx_obj_ptr(id);
+    if(ptr) ptr->flags.sym = 1;
+  }
+
+  return id;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Execute decoded instruction.
+//
+void exec_instr(decoded_instr_t *instr)
+{
+  switch(instr->type) {
+    case t_int:
+    case t_bool:
+      gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfx_obj_num_new(instr->arg1, instr->type), 0);
+      break;
+
+    case t_nil:
+      gfx_obj_array_push(gfxboot_data->vm.program.pstack, 0, 0);
+      break;
+
+    case t_string:
+    case t_ref:
+    case t_code:
+      gfx_obj_array_push(gfxboot_data->vm.program.pstack, name_new(instr, instr->type), 0);
+      break;
+
+    case t_prim:
+      gfx_run_prim(instr->arg1);
+      break;
+
+    case t_word:
+      {
+        data_t key = { .ptr = instr->arg2, .size = instr->arg1 };
+        obj_id_pair_t pair = gfx_lookup_dict_cached(&key, instr->sym, instr->cache);
+        if(!pair.id1) {
+          GFX_ERROR(err_invalid_code);
+        }
+        else {
+          gfx_exec_id(0, pair.id2, 0);
+        }
+      }
+      break;
+
+    case t_get:
+      gfx_prim_get_x(& (data_t) { .ptr = instr->arg2, .size = instr->arg1 }, instr->sym, instr->cache);
+      break;
+
+    case t_set:
+      {
+        obj_id_t key = name_new(instr, t_ref);
+        gfx_prim_put_x(key, instr->cache);
+        gfx_obj_ref_dec(key);
+      }
+      break;
+
+    case t_comment:
+      // do nothing
+      break;
+
+    default:
+      GFX_ERROR(err_invalid_code);
+  }
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Check if gfx_program_run() has to take the slow path.
+//
+// That is, if a step limit, a context to stop at, tracing, or profiling is
+// active.
+//
+int gfx_program_debug_active(unsigned steps_set)
+{
+  return
+    steps_set ||
+    gfxboot_data->vm.program.wait_for_context ||
+    gfxboot_data->vm.debug.trace.ip ||
+    gfxboot_data->vm.debug.trace.pstack ||
+    gfxboot_data->vm.debug.trace.context ||
+    gfxboot_data->vm.debug.trace.time ||
+    gfxboot_data->vm.debug.profile.interval;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Run pre-decoded instructions (fast path in gfx_program_run()).
+//
+// Instructions are taken directly from the slots of the current context.
+// Only primitives, words, and t_get may switch the context, stop the
+// program, or run debug commands; the checks for that are done only after
+// these instructions. Errors are checked after every instruction.
+//
+// Return 1 if the current code is not pre-decoded, else 0 (program has
+// stopped or a debug command has been run).
+//
+int run_predecoded(predecoded_code_t *pcode, uint8_t *blob, unsigned cmd_count)
+{
+  decoded_instr_t instr = { };
+
+  if(!pcode) return 1;
+
+  hash_cache_t *caches = (hash_cache_t *) (pcode->instr + pcode->slots);
+
+  for(;;) {
+    if(gfxboot_data->vm.program.stop || gfxboot_data->vm.error.id) return 0;
+
+    obj_id_t ctx_id = gfxboot_data->vm.program.context;
+    context_t *ctx = gfx_obj_context_ptr(ctx_id);
+
+    if(!ctx) {
+      if(ctx_id) GFX_ERROR(err_internal);
+      return 0;
+    }
+
+    if(
+      !(ctx->slot && ctx->pcode_id == gfxboot_data->vm.program.code) &&
+      !gfx_program_enter_code(ctx, pcode)
+    ) {
+      return 1;
+    }
+
+    instr.ctx = ctx;
+    instr.code_id = ctx->code_id;
+
+    unsigned type;
+
+    do {
+      gfxboot_data->vm.program.steps++;
+
+      ctx->current_ip = ctx->ip;
+
+      if(ctx->slot >= ctx->end_slot) {
+        // at code end, do nothing
+        if(ctx->slot > ctx->end_slot) GFX_ERROR(err_invalid_code);
+        return 0;
+      }
+
+      predecoded_instr_t *pi = pcode->instr + ctx->slot - 1;
+
+      ctx->ip += pi->size;
+      ctx->slot = pi->next + 1;
+
+      type = instr.type = pi->type;
+      instr.arg1 = pi->arg1;
+      instr.arg2 = pi->arg2 ? blob + pi->arg2 : 0;
+      instr.cache = pi->cache ? caches + pi->cache - 1 : 0;
+      instr.sym = pi->sym;
+
+      exec_instr(&instr);
+
+      if(gfxboot_data->vm.error.id) return 0;
+    } while(type != t_prim && type != t_word && type != t_get);
+
+    if(cmd_count != gfxboot_data->vm.debug.cmd_count) return 0;
+  }
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Run program.
+//
+// Without any debug settings active (see gfx_program_debug_active()),
+// pre-decoded instructions are run in a tight loop, see run_predecoded().
+// Debug settings are only changed by debug commands - so the fast path
+// just watches vm.debug.cmd_count and re-checks the settings when it
+// changes.
+//
 void gfx_program_run()
 {
-  uint64_t tsc_start = tsc(), tsc_last = tsc_start;
+  uint64_t tsc_start = gfx_tsc(), tsc_last = tsc_start;
 
   gfxboot_data->vm.program.stop = 0;
 
@@ -248,68 +763,45 @@ void gfx_program_run()
   unsigned steps = gfxboot_data->vm.debug.steps;
   unsigned steps_set = steps ? 1 : 0;
 
-  for(; (!steps_set || steps) && gfx_decode_instr(&instr); steps--) {
-    switch(instr.type) {
-      case t_int:
-      case t_bool:
-        gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfx_obj_num_new(instr.arg1, instr.type), 0);
-        break;
-
-      case t_nil:
-        gfx_obj_array_push(gfxboot_data->vm.program.pstack, 0, 0);
-        break;
-
-      case t_string:
-      case t_ref:
-      case t_code:
-        gfx_obj_array_push(
-          gfxboot_data->vm.program.pstack,
-          gfx_obj_const_mem_nofree_new(instr.arg2, instr.arg1, instr.type, instr.code_id),
-          0
-        );
-        break;
+  unsigned cmd_count = gfxboot_data->vm.debug.cmd_count;
+  uint8_t *blob = 0;
+  predecoded_code_t *pcode = predecoded_code(&blob);
 
-      case t_prim:
-        gfx_run_prim(instr.arg1);
-        break;
+  for(;;) {
+    if(cmd_count != gfxboot_data->vm.debug.cmd_count) {
+      // debug commands may have replaced the pre-decoded code
+      cmd_count = gfxboot_data->vm.debug.cmd_count;
+      pcode = predecoded_code(&blob);
+    }
 
-      case t_word:
-        {
-          data_t key = { .ptr = instr.arg2, .size = instr.arg1 };
-          obj_id_pair_t pair = gfx_lookup_dict(&key);
-          if(!pair.id1) {
-            GFX_ERROR(err_invalid_code);
-          }
-          else {
-            gfx_exec_id(0, pair.id2, 0);
-          }
-        }
-        break;
+    if(!gfx_program_debug_active(steps_set)) {
+      // fast path
+      while(
+        cmd_count == gfxboot_data->vm.debug.cmd_count &&
+        run_predecoded(pcode, blob, cmd_count) &&
+        decode_instr(&instr, pcode, blob, 0)
+      ) {
+        // code that is not pre-decoded
+        exec_instr(&instr);
+      }
+      if(cmd_count == gfxboot_data->vm.debug.cmd_count) break;
+      continue;
+    }
 
-      case t_get:
-        gfx_prim_get_x(& (data_t) { .ptr = instr.arg2, .size = instr.arg1 });
-        break;
+    // slow path
+    if((steps_set && !steps) || !decode_instr(&instr, pcode, blob, 1)) break;
+    steps--;
 
-      case t_set:
-        {
-          obj_id_t key = gfx_obj_const_mem_nofree_new(instr.arg2, instr.arg1, t_ref, instr.code_id);
-          gfx_prim_put_x(key);
-          gfx_obj_ref_dec(key);
-        }
-        break;
+    exec_instr(&instr);
 
-      case t_comment:
-        // do nothing
-        break;
+    gfx_debug_show_trace();
 
-      default:
-        GFX_ERROR(err_invalid_code);
+    if(gfxboot_data->vm.debug.profile.interval && !--gfxboot_data->vm.debug.profile.countdown) {
+      gfx_debug_profile_sample();
     }
 
-    gfx_debug_show_trace();
-
     if(gfxboot_data->vm.debug.trace.time) {
-      uint64_t tmp = tsc();
+      uint64_t tmp = gfx_tsc();
       gfxboot_log("TIME: %llu\n", (unsigned long long) tmp - tsc_last);
       tsc_last = tmp;
     }
@@ -326,34 +818,82 @@ void gfx_program_run()
     }
   }
 
-  gfxboot_data->vm.program.time += tsc() - tsc_start;
+  gfxboot_data->vm.program.time += gfx_tsc() - tsc_start;
 
   // creating a debug console on demand slows down test scripts, so try to avoid that
   if(gfxboot_data->vm.error.id && gfxboot_data->vm.debug.console.show_on_error) {
     gfx_program_debug_on_off(1, 1);
   }
+
+  gfx_screen_flush();
 }
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 obj_id_pair_t gfx_lookup_dict(data_t *key)
+{
+  return gfx_lookup_dict_cached(key, 0, 0);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Look up key in context dictionaries, global dictionary, and primitives.
+//
+// sym: symbol id of key, 0 if none (see gfx_program_sym())
+// cache (optional) is used for all dictionaries searched (see gfx_obj_hash_get_cached()).
+// A primitive is recorded as last cache path element vm.program.prims.
+//
+obj_id_pair_t gfx_lookup_dict_cached(data_t *key, uint32_t sym, hash_cache_t *cache)
 {
   obj_id_pair_t pair = { };
+  unsigned pos = 0;
   
   context_t *context = gfx_obj_context_ptr(gfxboot_data->vm.program.context);
 
   while(context) {
+    // method calls without local dictionary use the object dictionary directly
+    obj_id_t dict_id = context->dict_id ?: context->self_id;
     if(
-      context &&
-      context->dict_id &&
-      (pair = gfx_obj_hash_get(context->dict_id, key)).id1
+      dict_id &&
+      (pair = gfx_obj_hash_get_cached(dict_id, key, sym, cache, &pos)).id1
     ) {
       return pair;
     }
     context = gfx_obj_context_ptr(context->parent_id);
   }
 
-  return gfx_obj_hash_get(gfxboot_data->vm.program.dict, key);
+  pair = gfx_obj_hash_get_cached(gfxboot_data->vm.program.dict, key, sym, cache, &pos);
+
+  if(pair.id1) return pair;
+
+  // not in any dictionary: try primitives
+  obj_id_t prims_id = gfxboot_data->vm.program.prims;
+  unsigned idx;
+
+  if(
+    cache &&
+    cache->stamp &&
+    pos + 1 == cache->len &&
+    cache->path[pos] == prims_id
+  ) {
+    idx = cache->slot;
+  }
+  else {
+    idx = gfx_prim_lookup(key);
+    if(cache) {
+      cache->stamp = 0;
+      if(idx && pos < HASH_CACHE_PATH) {
+        cache->path[pos] = prims_id;
+        cache->stamp = gfxboot_data->vm.hash_stamp;
+        cache->slot = idx;
+        cache->len = pos + 1;
+      }
+    }
+  }
+
+  if(!idx) return (obj_id_pair_t) {};
+
+  return (obj_id_pair_t) { .id1 = gfxboot_data->vm.program.dict, .id2 = gfx_prim_id(idx - 1) };
 }
 
 
@@ -397,7 +937,12 @@ area_t gfx_font_dim(obj_id_t font_id)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-obj_id_t gfx_image_open(obj_id_t image_file)
+// Unpack image file.
+//
+// If width and height are > 0, jpeg images are decoded at the smallest
+// size (1/1, 1/2, 1/4, 1/8) that still covers width x height.
+//
+obj_id_t gfx_image_open(obj_id_t image_file, int width, int height)
 {
   arg_t file = { .id = image_file };
 
@@ -417,15 +962,27 @@ obj_id_t gfx_image_open(obj_id_t image_file)
     if(u) is_jpeg = 1;
   }
 
-  int width = u & 0xffff;
-  int height = (int) (u >> 16);
-
   if(!(is_png || is_jpeg)) {
     GFX_ERROR(err_invalid_data);
     return 0;
   }
 
-  gfxboot_log("is_jpeg = %u, is_png = %u, width = %d, height = %d\n", is_jpeg, is_png, width, height);
+  int scale = 0;
+
+  if(is_jpeg && width > 0 && height > 0) {
+    while(
+      scale < 3 &&
+      (int) (((u & 0xffff) + (2u << scale) - 1) >> (scale + 1)) >= width &&
+      (int) (((u >> 16) + (2u << scale) - 1) >> (scale + 1)) >= height
+    ) {
+      scale++;
+    }
+  }
+
+  width = (int) (((u & 0xffff) + (1u << scale) - 1) >> scale);
+  height = (int) (((u >> 16) + (1u << scale) - 1) >> scale);
+
+  gfxboot_log("is_jpeg = %u, is_png = %u, width = %d, height = %d, scale = %d\n", is_jpeg, is_png, width, height, scale);
 
   arg_t image = { .id = gfx_obj_canvas_new(width, height) };
 
@@ -438,36 +995,60 @@ obj_id_t gfx_image_open(obj_id_t image_file)
   }
 
   if(is_jpeg) {
+    arg_t ctx = { .id = gfx_obj_mem_new(gfx_jpeg_ctx_size(), 0) };
+
+    arg_update(&ctx);
     arg_update(&file);
+    arg_update(&image);
 
     canvas_t *canvas = OBJ_CANVAS_FROM_PTR(image.ptr);
 
-    if(gfx_jpeg_decode(OBJ_MEM_FROM_PTR(file.ptr), (uint8_t *) &canvas->ptr, 0, canvas->geo.width, 0, canvas->geo.height, 32)) {
+    if(!ctx.ptr) {
+      GFX_ERROR(err_no_memory);
       gfx_obj_ref_dec(image.id);
       image.id = 0;
     }
+    else {
+      jpeg_ctx_t *jpeg_ctx = (jpeg_ctx_t *) OBJ_MEM_FROM_PTR(ctx.ptr);
+
+      if(!gfx_jpeg_init(jpeg_ctx, OBJ_MEM_FROM_PTR(file.ptr), OBJ_MEM_SIZE_FROM_PTR(file.ptr), 0, canvas->geo.width, 0, canvas->geo.height, 32, scale)) {
+        gfx_jpeg_run(jpeg_ctx, OBJ_MEM_FROM_PTR(file.ptr), (uint8_t *) &canvas->ptr);
+      }
+
+      if(gfx_jpeg_finish(jpeg_ctx)) {
+        gfx_obj_ref_dec(image.id);
+        image.id = 0;
+      }
+    }
+
+    gfx_obj_ref_dec(ctx.id);
   }
   else if(is_png) {
-    arg_t buf_32k = { .id = gfx_obj_mem_new(0x8000, 0) };
+    arg_t work_buf = { .id = gfx_obj_mem_new(gfx_png_bufsize((unsigned) width), 0) };
 
-    arg_update(&buf_32k);
+    arg_update(&work_buf);
     arg_update(&file);
     arg_update(&image);
 
     canvas_t *canvas = OBJ_CANVAS_FROM_PTR(image.ptr);
 
-    if(gfx_png_decode(
+    if(!work_buf.ptr) {
+      GFX_ERROR(err_no_memory);
+      gfx_obj_ref_dec(image.id);
+      image.id = 0;
+    }
+    else if(gfx_png_decode(
       OBJ_MEM_FROM_PTR(file.ptr),
       OBJ_MEM_SIZE_FROM_PTR(file.ptr),
       (uint8_t *) &canvas->ptr,
       (unsigned) canvas->geo.width * (unsigned) canvas->geo.height * 4,
-      OBJ_MEM_FROM_PTR(buf_32k.ptr)
+      OBJ_MEM_FROM_PTR(work_buf.ptr)
     )) {
       gfx_obj_ref_dec(image.id);
       image.id = 0;
     }
 
-    gfx_obj_ref_dec(buf_32k.id);
+    gfx_obj_ref_dec(work_buf.id);
   }
 
   return image.id;
@@ -51,14 +51,24 @@ typedef uint32_t obj_id_t;
 #define BLUE_BITS		8
 #define COLOR(a, r, g, b)	(((unsigned) (a) << ALPHA_POS) + ((r) << RED_POS) + ((g) << GREEN_POS) + ((b) << BLUE_POS))
 
-#define OBJ_ID_GEN_BITS		8
-#define OBJ_ID_GEN_POS		(32 - OBJ_ID_GEN_BITS)
+// bit 31 of an object id marks immediate values, see OBJ_ID_IMM
+#define OBJ_ID_GEN_BITS		7
+#define OBJ_ID_GEN_POS		(31 - OBJ_ID_GEN_BITS)
 #define OBJ_ID_GEN_MASK		~((1 << OBJ_ID_GEN_POS) - 1)
+#define OBJ_GEN_MAX		((1 << OBJ_ID_GEN_BITS) - 1)
+
+// immediate ints and bools (no olist entry): bit 30 = bool, bits 0-29 = signed value
+#define OBJ_ID_IMM		(1U << 31)
+#define OBJ_ID_IMM_BOOL		(1U << 30)
+#define OBJ_ID_IMM_MIN		(-(1LL << 29))
+#define OBJ_ID_IMM_MAX		((1LL << 29) - 1)
+#define OBJ_ID_IS_IMM(id)	((unsigned) (id) >> 31)
+#define OBJ_ID_IMM_VALUE(id)	((int64_t) ((int32_t) ((unsigned) (id) << 2) >> 2))
 
 #define OBJ_TYPE_MASK		((1 << 8) - 1)
 
 #define OBJ_ID(id, gen)		((unsigned) id + (((unsigned) gen) << OBJ_ID_GEN_POS))
-#define OBJ_ID2GEN(id)		((unsigned) id >> OBJ_ID_GEN_POS)
+#define OBJ_ID2GEN(id)		(((unsigned) id >> OBJ_ID_GEN_POS) & OBJ_GEN_MAX)
 #define OBJ_ID2IDX(id)		((unsigned) id & ~OBJ_ID_GEN_MASK)
 #define OBJ_ID_ASSIGN(a, b)	do { obj_id_t tmp = a; a = gfx_obj_ref_inc(b); gfx_obj_ref_dec(tmp); } while(0)
 
@@ -79,7 +89,7 @@ typedef uint32_t obj_id_t;
 #define OBJ_FONT_SIZE()		(sizeof (font_t))
 #define OBJ_CANVAS_SIZE(w, h)	(sizeof (canvas_t) + (unsigned) (w) * (unsigned) (h) * sizeof *((canvas_t) {0}).ptr)
 #define OBJ_ARRAY_SIZE(n)	(sizeof (array_t) + (n) * sizeof *((array_t) {0}).ptr)
-#define OBJ_HASH_SIZE(n)	(sizeof (hash_t) + (n) * sizeof *((hash_t) {0}).ptr)
+#define OBJ_HASH_SIZE(n)	(sizeof (hash_t) + (n) * (sizeof *((hash_t) {0}).ptr + 3 * sizeof (uint32_t)))
 #define OBJ_CONTEXT_SIZE()	(sizeof (context_t))
 
 #define OBJ_DATA_FROM_PTR(p)		(&(p)->data)
@@ -93,6 +103,11 @@ typedef uint32_t obj_id_t;
 #define OBJ_CONTEXT_FROM_PTR(p)		((context_t *) (p)->data.ptr)
 #define OBJ_VALUE_FROM_PTR(p)		((p)->data.value)
 
+// max number of pending screen update areas, see gfx_screen_add_dirty()
+#define COMPOSE_DIRTY_MAX	16
+// merge update areas if this adds at most that many pixels
+#define COMPOSE_DIRTY_SLACK	1024
+
 #define ADD_AREA(a, b) (a).x += (b).x, (a).y += (b).y, (a).width += (b).width, (a).height += (b).height
 
 #if 0
@@ -169,11 +184,25 @@ typedef struct {
   uint8_t data[];
 } __attribute__ ((packed)) malloc_chunk_t;
 
+// free chunks are kept in segregated lists, one per size class
+// - 4 classes per power of two, starting at 16 bytes
+#define MALLOC_CLASSES		112
+
+// stored in the data area of free chunks
+typedef struct {
+  uint32_t prev;	// offset + 1 of prev free chunk in same size class (0 = none)
+  uint32_t next;	// offset + 1 of next free chunk in same size class (0 = none)
+} __attribute__ ((packed)) malloc_free_t;
+
+// smallest chunk; every free chunk must be able to hold malloc_free_t
+#define MALLOC_MIN_CHUNK	(sizeof (malloc_chunk_t) + sizeof (malloc_free_t))
+
 typedef struct {
   void *ptr;
   void *first_chunk;
-  void *first_free;
+  void *first_free;	// there is no free chunk below this one
   uint32_t size;
+  uint32_t free_list[MALLOC_CLASSES];	// offset + 1 of first free chunk per size class (0 = none)
 } malloc_head_t;
 
 typedef struct {
@@ -184,6 +213,16 @@ typedef struct {
   int pos, size;
 } color_bits_t;
 
+// how to convert virtual screen pixels to real framebuffer, see gfx_screen_init()
+typedef enum {
+  fb_convert_generic,		// any layout, byte by byte
+  fb_convert_mask,		// 32 bit, same color positions as color_t; just clear alpha
+  fb_convert_32,		// 32 bit
+  fb_convert_24,		// 24 bit
+  fb_convert_565,		// 16 bit, 5/6/5 bit rgb
+  fb_convert_16			// 16 bit
+} fb_convert_t;
+
 typedef struct {
   void *ptr;
   obj_id_t id;
@@ -238,6 +277,7 @@ typedef struct {
     uint8_t utf8:1;		// data is utf8 encoded
     uint8_t sticky:1;		// create new hash entries here
     uint8_t hash_is_class:1;	// hash is a class
+    uint8_t sym:1;		// data is an interned name from code, see gfx_program_sym()
   } flags;
 } obj_t;
 
@@ -247,6 +287,19 @@ typedef struct {
   obj_t ptr[];
 } __attribute__ ((packed)) olist_t;
 
+// rendered glyphs, see gfx_font_render_glyph()
+#define GLYPH_CACHE_SIZE	(256 << 10)	// default cache size per font in bytes
+#define GLYPH_CACHE_WAYS	4		// glyphs per cache set
+#define GLYPH_CACHE_MAX_SETS	1024
+
+typedef struct {
+  unsigned c;			// code point
+  color_t fg, bg;		// drawing colors used
+  uint32_t stamp;		// last use (0 = unused)
+  area_t geo;			// glyph offset and advance width
+  int width, height;		// bitmap size
+} glyph_cache_entry_t;
+
 typedef struct {
   unsigned type;
   obj_id_t parent_id;
@@ -261,6 +314,13 @@ typedef struct {
     unsigned offset;
     unsigned size;
   } bitmap, unimap;
+  struct {
+    obj_id_t canvas_id;		// bitmaps; a row of GLYPH_CACHE_WAYS slots per set
+    obj_id_t entries_id;	// glyph_cache_entry_t per slot
+    unsigned sets;		// number of sets, power of 2
+    unsigned gen;		// glyph_cache.gen when last used
+    uint32_t stamp;		// use counter for LRU
+  } cache;			// glyphs rendered with this font and its parent fonts
 } font_t;
 
 typedef struct {
@@ -270,23 +330,56 @@ typedef struct {
 } __attribute__ ((packed)) array_t;
 
 typedef struct key_value_s {
-  obj_id_t key;
+  obj_id_t key;			// 0 = deleted entry
   obj_id_t value;
+  uint32_t hash;		// key hash, see gfx_obj_hash_key()
+  uint32_t sym;			// symbol id of key, see gfx_program_sym(); 0 = none
 } key_value_t;
 
+// Entries are appended to ptr[]; deleted entries leave a gap until the
+// hash is compacted. ptr[] is followed by
+//   - an open-addressing index of 2 * max slots (entry index + 1, 0 = empty
+//     slot) to look up keys
+//   - max entry indices in key order, used to iterate over the hash
+//
+// max is always a power of 2.
+//
+// The key order is only updated when it's needed, see gfx_obj_hash_iterate().
+// While a 'forall' loop runs over the hash, entries keep their position.
 typedef struct {
-  unsigned size;
-  unsigned max;
+  unsigned size;		// number of keys
+  unsigned max;			// max number of entries
   obj_id_t parent_id;
+  uint32_t stamp;		// vm.hash_stamp at last change of keys or parent
+  unsigned used;		// number of entries in ptr[], including deleted ones
+  unsigned ordered;		// key order is up to date
+  unsigned order_size;		// number of entry indices in key order, including deleted entries
+  unsigned iterating;		// number of 'forall' loops running over the hash
   key_value_t ptr[];
 } __attribute__ ((packed)) hash_t;
 
+#define HASH_CACHE_PATH		6
+
+// remembers where a key has been found
+typedef struct {
+  uint32_t stamp;		// vm.hash_stamp when cache was filled, 0 = invalid
+  uint32_t slot;		// key index in last hash of path
+  uint8_t len;			// path length
+  obj_id_t path[HASH_CACHE_PATH];	// non-empty hashes searched, in order; the last one has the key
+} __attribute__ ((packed)) hash_cache_t;
+
 typedef struct {
   unsigned type;
   unsigned ip, current_ip;
+  // pre-decoded instructions of code, see gfx_program_enter_code()
+  uint32_t slot;		// instruction at ip (index + 1); 0 = not looked up
+  uint32_t start_slot;		// first instruction (index + 1)
+  uint32_t end_slot;		// last instruction (index + 2)
+  obj_id_t pcode_id;		// vm.program.code the slots refer to (not ref counted)
   obj_id_t parent_id;
   obj_id_t code_id;
   obj_id_t dict_id;
+  obj_id_t self_id;		// method call: object dictionary; dict_id is created on demand with self_id as parent
   obj_id_t iterate_id;
   int64_t index;
   int64_t max;
@@ -299,15 +392,109 @@ typedef struct {
   uint8_t *arg2;
   unsigned type;
   obj_id_t code_id;
+  hash_cache_t *cache;
+  uint32_t sym;			// symbol id of arg2, see gfx_program_sym(); 0 = none
 } decoded_instr_t;
 
+typedef struct {
+  int64_t arg1;
+  uint32_t arg2;		// offset of instruction data in code blob, 0 if none
+  uint32_t ip;			// offset of instruction in code blob
+  uint32_t size;		// encoded instruction size
+  uint32_t next;		// index of next instruction; code blocks are skipped
+  uint32_t cache;		// dictionary lookup cache index + 1, 0 if none
+  uint32_t sym;			// symbol id of name (t_string - t_set), 0 if none
+  uint8_t type;
+} __attribute__ ((packed)) predecoded_instr_t;
+
+// instructions are stored in code blob order
+//
+// followed by lookup caches: hash_cache_t[caches]
+typedef struct {
+  obj_id_t code_id;		// code blob the instructions belong to (not ref counted)
+  uint32_t size;		// code blob size
+  uint32_t slots;		// number of pre-decoded instructions
+  uint32_t caches;		// number of lookup caches (one per t_word, t_get, t_set instruction)
+  predecoded_instr_t instr[];
+} __attribute__ ((packed)) predecoded_code_t;
+
 typedef struct {
   obj_id_t id1, id2;
 } obj_id_pair_t;
 
+// per primitive counters, see gfx_run_prim()
+typedef struct {
+  uint64_t calls;		// number of calls
+  uint64_t cycles;		// cpu cycles, including nested primitive calls
+  uint64_t allocs;		// gfx_malloc() calls, including nested primitive calls
+} prim_stats_t;
+
+// sampling profiler, see gfx_debug_profile_sample()
+#define PROFILE_ENTRIES		256	// distinct call stacks, power of 2
+#define PROFILE_DEPTH		8	// innermost contexts recorded per sample
+
+typedef struct {
+  uint32_t count;		// samples with this call stack, 0 = unused entry
+  uint32_t depth;		// number of frames
+  uint32_t frames[PROFILE_DEPTH];	// code blob offsets, outermost context first
+} profile_entry_t;
+
+typedef struct {
+  uint32_t samples;		// samples taken
+  uint32_t dropped;		// samples not recorded because the table was full
+  profile_entry_t entry[PROFILE_ENTRIES];
+} profile_t;
+
+// heap snapshot, followed by
+//   - memory pool content: pool_used bytes
+//   - snapshot_reloc_t[relocs]
+//
+// The format is specific to the build (see SNAPSHOT_LAYOUT), snapshots are
+// not meant to be portable.
+#define SNAPSHOT_MAGIC		0x70616e73
+#define SNAPSHOT_LAYOUT		(sizeof (void *) + (sizeof (obj_t) << 8) + (sizeof (context_t) << 16) + (sizeof (malloc_chunk_t) << 24))
+
+// file the program was started with; a snapshot is only valid with the same files
+typedef struct {
+  uint32_t size;		// file size; 0 = no file
+  uint32_t sum;			// FNV-1a over file content, see gfx_obj_hash_key()
+} snapshot_file_t;
+
+typedef struct {
+  uint32_t magic;		// SNAPSHOT_MAGIC
+  uint32_t layout;		// SNAPSHOT_LAYOUT
+  uint32_t prims;		// number of primitives
+  int32_t width, height;	// screen size
+  uint32_t pool_size;		// size of memory pool the snapshot was taken from
+  uint32_t pool_used;		// pool bytes stored in snapshot; the rest was a single free chunk
+  uint32_t last_chunk;		// size of last chunk stored
+  uint32_t olist_ofs;		// pool offset of object list
+  uint32_t relocs;		// number of relocation entries
+  uint32_t hash_stamp;
+  uint32_t glyph_gen;
+  snapshot_file_t main_gc;	// size 0: main.gc was taken from the pack
+  snapshot_file_t pack;
+  struct {
+    obj_id_t olist, gc_list;
+    obj_id_t screen_canvas, console_canvas, canvas, compose, system, pack;
+    obj_id_t pstack, dict, prims, context, wait_for_context, code, array_start, hash_start;
+  } id;
+} snapshot_head_t;
+
+// object data pointing outside the memory pool
+#define SNAPSHOT_RELOC_PRIM_NAME	1	// value: primitive index
+#define SNAPSHOT_RELOC_CONSOLE_FONT	2	// value: offset into console font
+
+typedef struct {
+  uint32_t idx;			// object index
+  uint32_t type;		// SNAPSHOT_RELOC_*
+  uint32_t value;
+} snapshot_reloc_t;
+
 typedef struct {
   struct {
     fb_t real;			// real framebuffer
+    fb_convert_t convert;	// conversion to real framebuffer format
     obj_id_t canvas_id;		// canvas for internal virtual screen
   } screen;
 
@@ -319,10 +506,14 @@ typedef struct {
 
   struct {
     obj_id_t list_id;		// array of canvas ids
+    unsigned dirty_count;	// number of entries in dirty
+    area_t dirty[COMPOSE_DIRTY_MAX];	// screen areas waiting for gfx_screen_flush()
   } compose;
 
   obj_id_t system_id;		// system class; contains e.g. event handler
 
+  obj_id_t pack_id;		// asset pack; gfx_read_file() looks here first
+
   struct {
     int nested;
     int entry;
@@ -341,16 +532,27 @@ typedef struct {
       obj_id_t id;		// id of object list
     } olist;
     obj_id_t gc_list;		// list of objects to garbage collect
+    uint32_t hash_stamp;	// hash modification counter
     struct {
       obj_id_t pstack;		// program data stack
       obj_id_t dict;		// global dictionary
+      obj_id_t prims;		// primitive objects (array), see gfx_prim_id()
       obj_id_t context;		// current program context
       obj_id_t wait_for_context;	// stop if this context is reached
+      obj_id_t code;		// pre-decoded program code
+      obj_id_t array_start_id;	// '[' primitive, marks array start on pstack
+      obj_id_t hash_start_id;	// '(' primitive, marks hash start on pstack
       unsigned stop:1;
       uint64_t time;
       uint64_t steps;
     } program;
     error_t error;
+    struct {
+      unsigned create:1;	// set by host: stop at 'snapshot' primitive, don't load snapshot
+      unsigned ready:1;		// 'snapshot' primitive reached, see gfxboot_snapshot()
+      snapshot_file_t main_gc;	// program files, stored in snapshot
+      snapshot_file_t pack;
+    } snapshot;
     struct {
       struct {
         char buf[256];
@@ -364,6 +566,7 @@ typedef struct {
       unsigned show_pointer:1;
       unsigned log_prompt:1;
       unsigned steps;
+      unsigned cmd_count;	// number of debug commands run, see gfx_program_run()
       struct {
         unsigned ip:1;
         unsigned pstack:1;
@@ -372,18 +575,35 @@ typedef struct {
         unsigned time:1;
         unsigned memcheck:1;
       } trace;
+      struct {
+        unsigned interval;	// take a sample every interval steps, 0 = off
+        unsigned countdown;	// steps until next sample
+        obj_id_t id;		// profile_t
+      } profile;
+      struct {
+        unsigned enabled:1;	// count primitive calls; set by host or 'primstats' debug command
+        obj_id_t id;		// prim_stats_t[], one entry per primitive; created on demand
+        uint64_t allocs;	// gfx_malloc() calls while enabled
+      } prim_stats;
     } debug;
   } vm;
 
   struct {
     unsigned port;
   } serial;
+
+  struct {
+    unsigned size;		// glyph cache size per font in bytes (set by frontend; 0 = no cache)
+    unsigned gen;		// increased when the font fallback chain changes
+  } glyph_cache;
 } gfxboot_data_t;
 
 typedef int (* dump_function_t)(obj_t *ptr, dump_style_t style);
 typedef unsigned (* gc_function_t)(obj_t *ptr);
 typedef int (* contains_function_t)(obj_t *ptr, obj_id_t id);
 typedef unsigned (* iterate_function_t)(obj_t *ptr, unsigned *idx, obj_id_t *id1, obj_id_t *id2);
+typedef void (* parallel_function_t)(void *data, unsigned idx);
+typedef void *(* read_alloc_function_t)(void *data, unsigned size);
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -391,13 +611,43 @@ extern gfxboot_data_t *gfxboot_data;
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-int gfxboot_sys_read_file(char *name, void **buf);
-void gfxboot_sys_free(void *ptr);
+// cpu cycle counter
+//
+static inline uint64_t gfx_tsc(void)
+{
+#if defined (__x86_64__)
+  uint32_t eax, edx;
+
+  asm volatile (
+    "rdtsc\n"
+    : "=a" (eax), "=d" (edx)
+  );
+
+  return ((uint64_t) edx << 32) + eax;
+#elif defined (__i386__)
+  uint64_t tsc;
+
+  asm volatile (
+    "rdtsc"
+    : "=A" (tsc)
+  );
+
+  return tsc;
+#else
+  #error "OOPS"
+  return 0;
+#endif
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+int gfxboot_sys_read_file(char *name, read_alloc_function_t alloc, void *data);
 unsigned long gfxboot_sys_strlen(const char *s);
 int gfxboot_sys_strcmp(const char *s1, const char *s2);
 long int gfxboot_sys_strtol(const char *nptr, char **endptr, int base);
 void gfxboot_screen_update(area_t area);
 int gfxboot_getkey(void);
+void gfxboot_sys_parallel(parallel_function_t func, void *data, unsigned count);
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -415,6 +665,7 @@ int gfxboot_init(int auto_run);
 int gfxboot_process_key(unsigned key);
 void gfxboot_timeout(void);
 void gfxboot_debug_command(char *str);
+unsigned gfxboot_snapshot(void *buf, unsigned size);
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -423,7 +674,10 @@ char *gfx_utf8_enc(unsigned uc);
 int gfx_utf8_dec(char **s, unsigned *len);
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+void gfx_screen_init(void);
 void gfx_screen_compose(area_t area);
+void gfx_screen_add_dirty(area_t area);
+void gfx_screen_flush(void);
 void gfx_console_putc(unsigned c, int update_pos);
 void gfx_console_puts(char *s);
 void gfx_putc(obj_id_t canvas_id, unsigned c, int update_pos);
@@ -440,6 +694,7 @@ void gfx_rect(obj_id_t canvas_id, int x, int y, int width, int height, color_t c
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 int gfx_malloc_init(void);
+int gfx_malloc_relink(void);
 void gfx_malloc_dump(dump_style_t style);
 void *gfx_malloc(uint32_t size, obj_id_t id);
 void gfx_free(void *ptr);
@@ -449,6 +704,7 @@ void gfx_defrag(unsigned max);
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 obj_id_t gfx_read_file(char *name);
+void gfx_pack_init(char *name);
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -528,20 +784,26 @@ hash_t *gfx_obj_hash_ptr_rw(obj_id_t id);
 unsigned gfx_obj_hash_iterate(obj_t *ptr, unsigned *idx, obj_id_t *id1, obj_id_t *id2);
 int gfx_obj_hash_dump(obj_t *ptr, dump_style_t style);
 obj_id_t gfx_obj_hash_set(obj_id_t hash_id, obj_id_t key_id, obj_id_t value_id, int do_ref_cnt);
+obj_id_t gfx_obj_hash_set_cached(obj_id_t hash_id, obj_id_t key_id, obj_id_t value_id, int do_ref_cnt, hash_cache_t *cache);
 obj_id_pair_t gfx_obj_hash_get(obj_id_t hash_id, data_t *key);
+obj_id_pair_t gfx_obj_hash_get_cached(obj_id_t hash_id, data_t *key, uint32_t sym, hash_cache_t *cache, unsigned *pos);
+void gfx_obj_hash_touch(hash_t *hash);
+uint32_t gfx_obj_hash_key(data_t *key);
 void gfx_obj_hash_del(obj_id_t hash_id, obj_id_t key_id, int do_ref_cnt);
 unsigned gfx_obj_hash_gc(obj_t *ptr);
 int gfx_obj_hash_contains(obj_t *ptr, obj_id_t id);
 
 obj_id_t gfx_obj_context_new(uint8_t sub_type);
 context_t *gfx_obj_context_ptr(obj_id_t id);
+obj_id_t gfx_obj_context_dict(obj_id_t id, int create);
+void gfx_obj_context_rewind(context_t *context);
 int gfx_obj_context_dump(obj_t *ptr, dump_style_t style);
 unsigned gfx_obj_context_gc(obj_t *ptr);
 int gfx_obj_context_contains(obj_t *ptr, obj_id_t id);
 
 obj_id_t gfx_obj_num_new(int64_t num, uint8_t subtype);
-int64_t *gfx_obj_num_ptr(obj_id_t id);
-int64_t *gfx_obj_num_subtype_ptr(obj_id_t id, uint8_t subtype);
+obj_t *gfx_obj_num_imm(obj_id_t id, obj_t *buf);
+int gfx_obj_num_value(obj_id_t id, uint8_t subtype, int64_t *val);
 int gfx_obj_num_dump(obj_t *ptr, dump_style_t style);
 
 unsigned gfx_program_init(obj_id_t program);
@@ -553,32 +815,49 @@ int gfx_program_process_key(unsigned key);
 char *gfx_debug_get_ip(void);
 void gfx_debug_cmd(char *str);
 void gfx_debug_show_trace(void);
+void gfx_debug_profile_sample(void);
 void gfx_vm_status_dump(void);
 obj_id_pair_t gfx_lookup_dict(data_t *key);
+obj_id_pair_t gfx_lookup_dict_cached(data_t *key, uint32_t sym, hash_cache_t *cache);
+void gfx_program_flush_cache(void);
+uint32_t gfx_program_sym(obj_t *ptr);
 int gfx_is_code(obj_id_t id);
 area_t gfx_font_dim(obj_id_t font_id);
-obj_id_t gfx_image_open(obj_id_t image_file);
+obj_id_t gfx_image_open(obj_id_t image_file, int width, int height);
 
 const char *gfx_error_msg(error_id_t id);
 void gfx_show_error(void);
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // jpeg
-int gfx_jpeg_decode(uint8_t *jpeg, uint8_t *img, int x_0, int x_1, int y_0, int y_1, int color_bits);
+
+// decoder context, see gfxboot_jpeg.c
+typedef struct jpeg_ctx_s jpeg_ctx_t;
+
+unsigned gfx_jpeg_ctx_size(void);
+int gfx_jpeg_init(jpeg_ctx_t *ctx, uint8_t *jpeg, unsigned len, int x_0, int x_1, int y_0, int y_1, int color_bits, int scale);
+int gfx_jpeg_step(jpeg_ctx_t *ctx, uint8_t *jpeg, uint8_t *img, int rows);
+int gfx_jpeg_run(jpeg_ctx_t *ctx, uint8_t *jpeg, uint8_t *img);
+int gfx_jpeg_finish(jpeg_ctx_t *ctx);
 unsigned gfx_jpeg_getsize(uint8_t *buf);
 
 unsigned gfx_png_getsize(uint8_t *buf, unsigned len);
-unsigned gfx_png_decode(uint8_t *in_buf, unsigned in_len, uint8_t *out_buf, unsigned out_len, uint8_t *window_buf);
+unsigned gfx_png_bufsize(unsigned width);
+unsigned gfx_png_decode(uint8_t *in_buf, unsigned in_len, uint8_t *out_buf, unsigned out_len, uint8_t *work_buf);
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // gfxboot_prim.c
 //
 int gfx_setup_dict(void);
+const char *gfx_prim_name(unsigned idx);
+unsigned gfx_prim_lookup(data_t *key);
+obj_id_t gfx_prim_id(unsigned idx);
 error_id_t gfx_run_prim(unsigned prim);
+void gfx_prim_stats_dump(void);
 void gfx_exec_id(obj_id_t dict, obj_id_t id, int on_stack);
-void gfx_prim_get_x(data_t *key);
-void gfx_prim_put_x(obj_id_t id);
+void gfx_prim_get_x(data_t *key, uint32_t sym, hash_cache_t *cache);
+void gfx_prim_put_x(obj_id_t id, hash_cache_t *cache);
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -589,4 +868,5 @@ typedef struct {
   obj_t *ptr;
 } arg_t;
 
-static void __attribute__((unused)) arg_update(arg_t *arg) { arg->ptr = gfx_obj_ptr(arg->id); }
+// note: immediate values don't move, keep their expanded copy
+static void __attribute__((unused)) arg_update(arg_t *arg) { if(!OBJ_ID_IS_IMM(arg->id)) arg->ptr = gfx_obj_ptr(arg->id); }
@@ -32,6 +32,55 @@ context_t *gfx_obj_context_ptr(obj_id_t id)
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get local dictionary of context.
+//
+// Method calls get their local dictionary only when it's actually needed;
+// until then, words are looked up directly in the object dictionary
+// (self_id). If create is not set, the dictionary is created only for
+// method calls.
+//
+// Return dictionary or 0.
+//
+obj_id_t gfx_obj_context_dict(obj_id_t id, int create)
+{
+  context_t *context = gfx_obj_context_ptr(id);
+
+  if(!context) return 0;
+
+  if(context->dict_id || !(create || context->self_id)) return context->dict_id;
+
+  // careful: gfx_obj_hash_new() may invalidate context pointer
+  obj_id_t dict_id = gfx_obj_hash_new(0);
+  hash_t *hash = gfx_obj_hash_ptr(dict_id);
+  context = gfx_obj_context_ptr(id);
+
+  if(!hash || !context) {
+    gfx_obj_ref_dec(dict_id);
+    return 0;
+  }
+
+  context->dict_id = dict_id;
+
+  if(context->self_id) {
+    hash->parent_id = gfx_obj_ref_inc(context->self_id);
+    gfx_obj_hash_touch(hash);
+  }
+
+  return dict_id;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Run code of context again from the start.
+//
+void gfx_obj_context_rewind(context_t *context)
+{
+  context->ip = 0;
+  context->slot = context->start_slot;
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 int gfx_obj_context_dump(obj_t *ptr, dump_style_t style)
 {
@@ -75,6 +124,7 @@ int gfx_obj_context_dump(obj_t *ptr, dump_style_t style)
     }
 
     if(context->dict_id) gfxboot_log(", dict %s", gfx_obj_id2str(context->dict_id));
+    if(context->self_id) gfxboot_log(", self %s", gfx_obj_id2str(context->self_id));
 
     return 1;
   }
@@ -84,6 +134,7 @@ int gfx_obj_context_dump(obj_t *ptr, dump_style_t style)
     gfxboot_log("    code %s\n", gfx_obj_id2str(context->code_id));
     gfxboot_log("    parent %s\n", gfx_obj_id2str(context->parent_id));
     gfxboot_log("    dict %s\n", gfx_obj_id2str(context->dict_id));
+    gfxboot_log("    self %s\n", gfx_obj_id2str(context->self_id));
     gfxboot_log("    iterate %s\n", gfx_obj_id2str(context->iterate_id));
   }
 
@@ -101,9 +152,15 @@ unsigned gfx_obj_context_gc(obj_t *ptr)
   unsigned more_gc = 0;
 
   if(context && data_size == OBJ_CONTEXT_SIZE()) {
+    if(context->type == t_ctx_forall) {
+      // see gfx_prim_forall()
+      hash_t *hash = gfx_obj_hash_ptr(context->iterate_id);
+      if(hash && hash->iterating) hash->iterating--;
+    }
     more_gc += gfx_obj_ref_dec_delay_gc(context->parent_id);
     more_gc += gfx_obj_ref_dec_delay_gc(context->code_id);
     more_gc += gfx_obj_ref_dec_delay_gc(context->dict_id);
+    more_gc += gfx_obj_ref_dec_delay_gc(context->self_id);
     more_gc += gfx_obj_ref_dec_delay_gc(context->iterate_id);
   }
 
@@ -124,6 +181,7 @@ int gfx_obj_context_contains(obj_t *ptr, obj_id_t id)
       id == context->parent_id ||
       id == context->code_id ||
       id == context->dict_id ||
+      id == context->self_id ||
       id == context->iterate_id
     ) return 1;
   }
@@ -16,6 +16,12 @@ static void debug_cmd_hex(int argc, char **argv);
 static void debug_cmd_find(int argc, char **argv);
 static void debug_cmd_run(int argc, char **argv);
 static void debug_cmd_set(int argc, char **argv);
+static void debug_cmd_profile(int argc, char **argv);
+static void debug_cmd_primstats(int argc, char **argv);
+
+static unsigned profile_code_offset(obj_id_t code_id, unsigned ip);
+static char *profile_source(data_t *map, unsigned ofs);
+static void profile_dump(int folded);
 
 static char *skip_space(char *str);
 static char *skip_nonspace(char *str);
@@ -34,7 +40,9 @@ static struct {
   { "inspect", debug_cmd_dump },
   { "log", debug_cmd_log },
   { "p", debug_cmd_dump },
+  { "primstats", debug_cmd_primstats },
   { "print", debug_cmd_dump },
+  { "profile", debug_cmd_profile },
   { "r", debug_cmd_run },
   { "run", debug_cmd_run },
   { "s", debug_cmd_run },
@@ -91,6 +99,9 @@ void gfx_debug_cmd(char *str)
   int err = 0;
   int starts_with_space = 0;
 
+  // debug settings may change
+  gfxboot_data->vm.debug.cmd_count++;
+
   if(gfxboot_data->vm.debug.log_prompt) gfxboot_log("%s>%s\n", gfx_debug_get_ip(), str);
 
   // log comment
@@ -183,7 +194,7 @@ void gfx_debug_cmd(char *str)
       arg_len--;
       data_t key = { .ptr = arg, .size = arg_len };
       gfxboot_data->vm.program.wait_for_context = gfxboot_data->vm.program.context;
-      gfx_prim_get_x(&key);
+      gfx_prim_get_x(&key, 0, 0);
       gfx_program_run();
     }
     else if(*argv[i] == '=') {
@@ -194,7 +205,7 @@ void gfx_debug_cmd(char *str)
       if(ptr) {
         ptr->flags.ro = 1;
         gfx_memcpy(OBJ_MEM_FROM_PTR(ptr), arg, arg_len);
-        gfx_prim_put_x(id);
+        gfx_prim_put_x(id, 0);
         gfx_obj_ref_dec(id);
       }
     }
@@ -232,6 +243,203 @@ void gfx_debug_show_trace()
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Record current call stack in profile table.
+//
+// Called every vm.debug.profile.interval steps from gfx_program_run().
+// A call stack is the chain of program contexts, each represented by the
+// code blob offset of its current instruction.
+//
+void gfx_debug_profile_sample()
+{
+  gfxboot_data->vm.debug.profile.countdown = gfxboot_data->vm.debug.profile.interval;
+
+  data_t *mem = gfx_obj_mem_ptr(gfxboot_data->vm.debug.profile.id);
+
+  if(!mem || mem->size != sizeof (profile_t)) return;
+
+  profile_t *profile = mem->ptr;
+  uint32_t frames[PROFILE_DEPTH];
+  unsigned u, depth = 0;
+  obj_id_t ctx_id = gfxboot_data->vm.program.context;
+  context_t *context;
+
+  // innermost context first
+  while(depth < PROFILE_DEPTH && (context = gfx_obj_context_ptr(ctx_id))) {
+    frames[PROFILE_DEPTH - ++depth] = profile_code_offset(context->code_id, context->current_ip);
+    ctx_id = context->parent_id;
+  }
+
+  if(!depth) return;
+
+  profile->samples++;
+
+  data_t key = { .ptr = frames + PROFILE_DEPTH - depth, .size = depth * sizeof *frames };
+  uint32_t hash = gfx_obj_hash_key(&key);
+
+  for(u = 0; u < PROFILE_ENTRIES; u++) {
+    profile_entry_t *entry = profile->entry + ((hash + u) & (PROFILE_ENTRIES - 1));
+    if(!entry->count) {
+      entry->depth = depth;
+      gfx_memcpy(entry->frames, key.ptr, key.size);
+    }
+    else if(entry->depth != depth || gfx_memcmp(entry->frames, key.ptr, key.size)) {
+      continue;
+    }
+    entry->count++;
+    return;
+  }
+
+  profile->dropped++;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Convert ip in code object to offset in code blob (cf. gfx_debug_get_ip()).
+//
+unsigned profile_code_offset(obj_id_t code_id, unsigned ip)
+{
+  data_t *code_data = gfx_obj_mem_ptr(code_id);
+
+  if(code_data && code_data->ref_id) {
+    data_t *ref_data = gfx_obj_mem_ptr(code_data->ref_id);
+    if(ref_data && code_data->ptr >= ref_data->ptr) {
+      ip += (unsigned) (code_data->ptr - ref_data->ptr);
+    }
+  }
+
+  return ip;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get source location of code blob offset.
+//
+// map (optional) is the source map written by 'gfxboot-compile --map'; each
+// line is 'OFFSET FILE:LINE', sorted by offset.
+//
+// Return 'FILE:LINE' if found, else the hex offset.
+//
+char *profile_source(data_t *map, unsigned ofs)
+{
+  static char buf[128];
+  char *s, *end, *src = 0;
+  unsigned src_len = 0;
+
+  gfxboot_snprintf(buf, sizeof buf, "0x%x", ofs);
+
+  if(!map) return buf;
+
+  for(s = map->ptr, end = s + map->size; s < end; s++) {
+    unsigned val = 0, digits = 0;
+
+    if(s + 1 < end && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) s += 2;
+
+    for(; s < end; s++, digits++) {
+      unsigned c = (unsigned) *s;
+      if(c >= '0' && c <= '9') c -= '0';
+      else if(c >= 'a' && c <= 'f') c -= 'a' - 10;
+      else if(c >= 'A' && c <= 'F') c -= 'A' - 10;
+      else break;
+      val = (val << 4) + c;
+    }
+
+    if(digits && val > ofs) break;
+
+    while(s < end && *s == ' ') s++;
+    char *start = s;
+    while(s < end && *s != '\n') s++;
+
+    if(digits) {
+      src = start;
+      src_len = (unsigned) (s - start);
+    }
+  }
+
+  if(src) {
+    if(src_len >= sizeof buf) src_len = sizeof buf - 1;
+    gfx_memcpy(buf, src, src_len);
+    buf[src_len] = 0;
+  }
+
+  return buf;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Show profile.
+//
+// folded = 0: flat profile, sample count per instruction, most frequent first.
+// folded = 1: one line per call stack, 'FRAME;FRAME;... COUNT'.
+//
+// Source locations are taken from 'main.map', if it exists.
+//
+void profile_dump(int folded)
+{
+  unsigned u, v, len = 0;
+  uint32_t top[PROFILE_ENTRIES], count[PROFILE_ENTRIES];
+
+  data_t *mem = gfx_obj_mem_ptr(gfxboot_data->vm.debug.profile.id);
+
+  if(!mem || mem->size != sizeof (profile_t)) {
+    gfxboot_log("no profile\n");
+    return;
+  }
+
+  obj_id_t map_id = gfx_read_file("main.map");
+
+  // reading the file may have moved the object list
+  profile_t *profile = gfx_obj_mem_ptr(gfxboot_data->vm.debug.profile.id)->ptr;
+  data_t *map = gfx_obj_mem_ptr(map_id);
+
+  gfxboot_log(
+    "profile: interval = %u, samples = %u, dropped = %u\n",
+    gfxboot_data->vm.debug.profile.interval, profile->samples, profile->dropped
+  );
+
+  for(u = 0; u < PROFILE_ENTRIES; u++) {
+    profile_entry_t *entry = profile->entry + u;
+    if(!entry->count) continue;
+    if(folded) {
+      for(v = 0; v < entry->depth; v++) {
+        gfxboot_log("%s%s", v ? ";" : "", profile_source(map, entry->frames[v]));
+      }
+      gfxboot_log(" %u\n", entry->count);
+    }
+    else {
+      uint32_t ofs = entry->frames[entry->depth - 1];
+      for(v = 0; v < len && top[v] != ofs; v++);
+      if(v == len) {
+        top[len++] = ofs;
+        count[v] = 0;
+      }
+      count[v] += entry->count;
+    }
+  }
+
+  // selection sort, most frequent first
+  for(u = 0; u < len; u++) {
+    unsigned max = u;
+    for(v = u + 1; v < len; v++) {
+      if(count[v] > count[max] || (count[v] == count[max] && top[v] < top[max])) max = v;
+    }
+    uint32_t tmp_top = top[max], tmp_count = count[max];
+    top[max] = top[u];
+    count[max] = count[u];
+    top[u] = tmp_top;
+    count[u] = tmp_count;
+
+    unsigned permille = profile->samples ? (unsigned) ((uint64_t) count[u] * 1000 / profile->samples) : 0;
+    gfxboot_log(
+      "%8u %3u.%u%%  0x%05x  %s\n",
+      count[u], permille / 10, permille % 10, top[u], profile_source(map, top[u])
+    );
+  }
+
+  gfx_obj_ref_dec(map_id);
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 void gfx_program_debug_on_off(unsigned state, unsigned input)
 {
@@ -354,13 +562,13 @@ int gfx_program_process_key(unsigned key)
   gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfx_obj_num_new(key, t_int), 0);
   gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfxboot_data->system_id, 1);
   data_t keyevent = { .ptr = "keyevent", .size = sizeof "keyevent" - 1 };
-  gfx_prim_get_x(&keyevent);
+  gfx_prim_get_x(&keyevent, 0, 0);
   gfx_program_run();
 
   // FIXME: this is action code vs. command line string
   if(!gfxboot_data->vm.debug.console.show) {
-    int64_t *val = gfx_obj_num_subtype_ptr(gfx_obj_array_get(gfxboot_data->vm.program.pstack, -1), t_int);
-    if(val) action = *val;
+    int64_t val;
+    if(gfx_obj_num_value(gfx_obj_array_get(gfxboot_data->vm.program.pstack, -1), t_int, &val)) action = val;
     gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
 
     // gfxboot_log("+++ action = %d\n", action);
@@ -492,6 +700,8 @@ void gfx_status_dump()
   );
   gfxboot_log("  global dict = ");
   gfx_obj_dump(gfxboot_data->vm.program.dict, (dump_style_t) { .inspect = 1 });
+  gfxboot_log("  primitives = ");
+  gfx_obj_dump(gfxboot_data->vm.program.prims, (dump_style_t) { .inspect = 1 });
   gfxboot_log("  stack = ");
   gfx_obj_dump(gfxboot_data->vm.program.pstack, (dump_style_t) { .inspect = 1 });
   gfxboot_log("  context = ");
@@ -609,6 +819,9 @@ void debug_cmd_dump(int argc, char **argv)
     else if(!gfx_strcmp(argv[1], "dict")) {
       id = gfxboot_data->vm.program.dict;
     }
+    else if(!gfx_strcmp(argv[1], "prims")) {
+      id = gfxboot_data->vm.program.prims;
+    }
     else if(!gfx_strcmp(argv[1], "gc")) {
       id = gfxboot_data->vm.gc_list;
     }
@@ -627,6 +840,9 @@ void debug_cmd_dump(int argc, char **argv)
     else if(!gfx_strcmp(argv[1], "system")) {
       id = gfxboot_data->system_id;
     }
+    else if(!gfx_strcmp(argv[1], "pack")) {
+      id = gfxboot_data->pack_id;
+    }
     else if(!gfx_strcmp(argv[1], "ip")) {
       gfxboot_log("ip = %s\n", gfx_debug_get_ip());
       show_id = 0;
@@ -882,11 +1098,21 @@ void debug_cmd_set(int argc, char **argv)
     gfxboot_data->vm.program.context = gfx_obj_ref_inc(id);
     gfx_obj_ref_dec(old);
   }
+  else if(!gfx_strcmp(argv[0], "code")) {
+    obj_id_t old = gfxboot_data->vm.program.code;
+    gfxboot_data->vm.program.code = gfx_obj_ref_inc(id);
+    gfx_obj_ref_dec(old);
+  }
   else if(!gfx_strcmp(argv[0], "dict")) {
     obj_id_t old = gfxboot_data->vm.program.dict;
     gfxboot_data->vm.program.dict = gfx_obj_ref_inc(id);
     gfx_obj_ref_dec(old);
   }
+  else if(!gfx_strcmp(argv[0], "prims")) {
+    obj_id_t old = gfxboot_data->vm.program.prims;
+    gfxboot_data->vm.program.prims = gfx_obj_ref_inc(id);
+    gfx_obj_ref_dec(old);
+  }
   else if(!gfx_strcmp(argv[0], "gc")) {
     obj_id_t old = gfxboot_data->vm.gc_list;
     gfxboot_data->vm.gc_list = gfx_obj_ref_inc(id);
@@ -917,10 +1143,16 @@ void debug_cmd_set(int argc, char **argv)
     gfxboot_data->system_id = gfx_obj_ref_inc(id);
     gfx_obj_ref_dec(old);
   }
+  else if(!gfx_strcmp(argv[0], "pack")) {
+    obj_id_t old = gfxboot_data->pack_id;
+    gfxboot_data->pack_id = gfx_obj_ref_inc(id);
+    gfx_obj_ref_dec(old);
+  }
   else if(!gfx_strcmp(argv[0], "ip")) {
     context_t *code_ctx = gfx_obj_context_ptr(gfxboot_data->vm.program.context);
     if(code_ctx) {
       code_ctx->ip = val;
+      code_ctx->slot = 0;
     }
     gfxboot_log("ip = %s\n", gfx_debug_get_ip());
   }
@@ -930,6 +1162,72 @@ void debug_cmd_set(int argc, char **argv)
   }
 }
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Sampling profiler.
+//
+// profile N       - start new profile, sample every N steps
+// profile off     - stop sampling, keep profile
+// profile clear   - stop sampling and free profile
+// profile [flat]  - show flat profile
+// profile folded  - show call stacks in folded format
+//
+void debug_cmd_profile(int argc, char **argv)
+{
+  if(argc < 2 || !gfx_strcmp(argv[1], "flat")) {
+    profile_dump(0);
+  }
+  else if(!gfx_strcmp(argv[1], "folded")) {
+    profile_dump(1);
+  }
+  else if(!gfx_strcmp(argv[1], "off")) {
+    gfxboot_data->vm.debug.profile.interval = 0;
+  }
+  else if(!gfx_strcmp(argv[1], "clear")) {
+    gfxboot_data->vm.debug.profile.interval = 0;
+    gfx_obj_ref_dec(gfxboot_data->vm.debug.profile.id);
+    gfxboot_data->vm.debug.profile.id = 0;
+  }
+  else if(is_num(argv[1])) {
+    unsigned interval = (unsigned) gfx_strtol(argv[1], 0, 0);
+    if(interval && !gfxboot_data->vm.debug.profile.id) {
+      gfxboot_data->vm.debug.profile.id = gfx_obj_mem_new(sizeof (profile_t), 0);
+    }
+    data_t *mem = gfx_obj_mem_ptr(gfxboot_data->vm.debug.profile.id);
+    if(mem) gfx_memset(mem->ptr, 0, mem->size);
+    gfxboot_data->vm.debug.profile.interval = gfxboot_data->vm.debug.profile.countdown = interval;
+  }
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Primitive statistics (see gfx_run_prim()).
+//
+// primstats on     - start counting
+// primstats off    - stop counting, keep statistics
+// primstats clear  - stop counting and free statistics
+// primstats        - show statistics, most expensive primitive first
+//
+void debug_cmd_primstats(int argc, char **argv)
+{
+  if(argc >= 2) {
+    if(!gfx_strcmp(argv[1], "on")) {
+      gfxboot_data->vm.debug.prim_stats.enabled = 1;
+    }
+    else if(!gfx_strcmp(argv[1], "off")) {
+      gfxboot_data->vm.debug.prim_stats.enabled = 0;
+    }
+    else if(!gfx_strcmp(argv[1], "clear")) {
+      gfxboot_data->vm.debug.prim_stats.enabled = 0;
+      gfx_obj_ref_dec(gfxboot_data->vm.debug.prim_stats.id);
+      gfxboot_data->vm.debug.prim_stats.id = 0;
+    }
+  }
+  else {
+    gfx_prim_stats_dump();
+  }
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 char *skip_space(char *str)
 {
@@ -1,5 +1,8 @@
 #include <gfxboot/gfxboot.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
@@ -10,16 +13,67 @@
 static void gfx_screen_update(obj_id_t canvas_id, area_t area);
 static void gfx_canvas_update(obj_id_t canvas_id, area_t area);
 
-static obj_id_t gfx_font_render_glyph(obj_id_t canvas_id, area_t *geo, unsigned c, unsigned size_only);
+static obj_id_t gfx_font_render_glyph(obj_id_t canvas_id, area_t *geo, area_t *src, unsigned c, unsigned size_only);
+static glyph_cache_entry_t *gfx_font_cache_get(font_t *font, unsigned c, color_t fg, color_t bg, unsigned any_color, area_t *src);
+static obj_id_t gfx_font_cache_add(font_t *font, obj_id_t glyph_id, area_t *geo, unsigned c, color_t fg, color_t bg, area_t *src);
 static obj_id_t gfx_font_render_font1_glyph(obj_id_t canvas_id, font_t *font, area_t *geo, unsigned c, unsigned size_only);
 static obj_id_t gfx_font_render_font2_glyph(obj_id_t canvas_id, font_t *font, area_t *geo, unsigned c, unsigned size_only);
 static unsigned read_unsigned_bits(uint8_t *buf, unsigned *bit_ofs, unsigned bits);
 static int read_signed_bits(uint8_t *buf, unsigned *bit_ofs, unsigned bits);
 
 static color_t gfx_color_merge(color_t dst, color_t src);
+static void gfx_color_merge_span(color_t *dst, color_t *src, unsigned len);
+static void gfx_color_merge_fill(color_t *dst, color_t src, unsigned len);
+#if defined(__SSE2__)
+static __m128i gfx_color_merge_sse2(__m128i dst, __m128i src);
+static unsigned gfx_color_merge_span_avx2(color_t *dst, color_t *src, unsigned len);
+#endif
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Choose how gfx_screen_update() converts pixels for the real framebuffer.
+//
+void gfx_screen_init()
+{
+  fb_t *fb = &gfxboot_data->screen.real;
+
+  int rgb_size = fb->red.size == 8 && fb->green.size == 8 && fb->blue.size == 8;
+
+  fb_convert_t convert = fb_convert_generic;
+
+  switch(fb->bytes_per_pixel) {
+    case 4:
+      convert = fb_convert_32;
+      if(rgb_size && fb->red.pos == RED_POS && fb->green.pos == GREEN_POS && fb->blue.pos == BLUE_POS) {
+        convert = fb_convert_mask;
+      }
+      break;
+
+    case 3:
+      convert = fb_convert_24;
+      break;
+
+    case 2:
+      convert = fb_convert_16;
+      if(
+        fb->red.size == 5 && fb->green.size == 6 && fb->blue.size == 5 &&
+        fb->red.pos == 11 && fb->green.pos == 5 && fb->blue.pos == 0
+      ) {
+        convert = fb_convert_565;
+      }
+      break;
+  }
+
+  gfxboot_data->screen.convert = convert;
+}
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Copy area of virtual screen to real framebuffer.
+//
+// Framebuffer memory can be slow, so write full 32 bit words where possible.
+// Multi-byte pixels are stored in little-endian order.
+//
 void gfx_screen_update(obj_id_t canvas_id, area_t area)
 {
   int i, j;
@@ -57,6 +111,11 @@ void gfx_screen_update(obj_id_t canvas_id, area_t area)
   );
 #endif
 
+#define CONVERT(c)	(((((c) >> rs) & rm) << rp) + ((((c) >> gs) & gm) << gp) + ((((c) >> bs) & bm) << bp))
+#define CONVERT_565(c)	((((c) >> 8) & 0xf800) + (((c) >> 5) & 0x07e0) + (((c) >> 3) & 0x001f))
+#define STORE_32(p, v)	({ uint32_t _v = v; gfx_memcpy(p, &_v, 4); })
+#define STORE_16(p, v)	({ uint16_t _v = (uint16_t) (v); gfx_memcpy(p, &_v, 2); })
+
   r8 = (uint8_t *) gfxboot_data->screen.real.ptr +
     area.y * gfxboot_data->screen.real.bytes_per_line +
     area.x * gfxboot_data->screen.real.bytes_per_pixel;
@@ -64,26 +123,86 @@ void gfx_screen_update(obj_id_t canvas_id, area_t area)
   pixel += area.y * virt_fb->geo.width + area.x;
 
   for(j = 0; j < area.height; j++, r8 += gfxboot_data->screen.real.bytes_per_line, pixel += virt_fb->geo.width) {
-    for(rc8 = r8, i = 0; i < area.width; i++) {
-      c = pixel[i];
-      rc = (((c >> rs) & rm) << rp) + (((c >> gs) & gm) << gp) + (((c >> bs) & bm) << bp);
-      switch(rsize) {
-        case 4:
-          *rc8++ = rc;
-          rc >>= 8;
-        case 3:
-          *rc8++ = rc;
-          rc >>= 8;
-        case 2:
-          *rc8++ = rc;
-          rc >>= 8;
-        case 1:
-          *rc8++ = rc;
-          rc >>= 8;
-      }
+    rc8 = r8;
+    i = 0;
+    switch(gfxboot_data->screen.convert) {
+      case fb_convert_mask:
+        // the framebuffer's reserved byte gets 0, not our alpha value
+        for(; i < area.width; i++, rc8 += 4) {
+          STORE_32(rc8, pixel[i] & ~(((1u << ALPHA_BITS) - 1) << ALPHA_POS));
+        }
+        break;
+
+      case fb_convert_32:
+        for(; i < area.width; i++, rc8 += 4) {
+          c = pixel[i];
+          STORE_32(rc8, CONVERT(c));
+        }
+        break;
+
+      case fb_convert_24:
+        // 4 pixels in 3 words
+        for(; i + 4 <= area.width; i += 4, rc8 += 12) {
+          uint32_t rc0 = CONVERT(pixel[i]);
+          uint32_t rc1 = CONVERT(pixel[i + 1]);
+          uint32_t rc2 = CONVERT(pixel[i + 2]);
+          uint32_t rc3 = CONVERT(pixel[i + 3]);
+          STORE_32(rc8, rc0 + (rc1 << 24));
+          STORE_32(rc8 + 4, (rc1 >> 8) + (rc2 << 16));
+          STORE_32(rc8 + 8, (rc2 >> 16) + (rc3 << 8));
+        }
+        for(; i < area.width; i++) {
+          c = pixel[i];
+          rc = CONVERT(c);
+          *rc8++ = (uint8_t) rc;
+          *rc8++ = (uint8_t) (rc >> 8);
+          *rc8++ = (uint8_t) (rc >> 16);
+        }
+        break;
+
+      case fb_convert_565:
+        // 2 pixels in 1 word
+        for(; i + 2 <= area.width; i += 2, rc8 += 4) {
+          STORE_32(rc8, CONVERT_565(pixel[i]) + (CONVERT_565(pixel[i + 1]) << 16));
+        }
+        if(i < area.width) STORE_16(rc8, CONVERT_565(pixel[i]));
+        break;
+
+      case fb_convert_16:
+        for(; i + 2 <= area.width; i += 2, rc8 += 4) {
+          STORE_32(rc8, CONVERT(pixel[i]) + (CONVERT(pixel[i + 1]) << 16));
+        }
+        if(i < area.width) STORE_16(rc8, CONVERT(pixel[i]));
+        break;
+
+      default:
+        for(; i < area.width; i++) {
+          c = pixel[i];
+          rc = CONVERT(c);
+          switch(rsize) {
+            case 4:
+              *rc8++ = rc;
+              rc >>= 8;
+            case 3:
+              *rc8++ = rc;
+              rc >>= 8;
+            case 2:
+              *rc8++ = rc;
+              rc >>= 8;
+            case 1:
+              *rc8++ = rc;
+              rc >>= 8;
+          }
+        }
+        break;
     }
   }
 
+#undef CONVERT
+#undef CONVERT_565
+#undef STORE_32
+#undef STORE_16
+
   gfxboot_screen_update(area);
 }
 
@@ -112,13 +231,84 @@ void gfx_canvas_update(obj_id_t canvas_id, area_t area)
       canvas_t *canvas = gfx_obj_canvas_ptr(c_id);
       area.x += canvas->geo.x;
       area.y += canvas->geo.y;
-      gfx_screen_compose(area);
+      gfx_screen_add_dirty(area);
       return;
     }
   }
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Remember screen area for gfx_screen_flush().
+//
+// The area is merged with a pending one if the union adds at most
+// COMPOSE_DIRTY_SLACK pixels (overlapping and adjacent areas always merge).
+// If the list is full, the cheapest merge is done regardless.
+//
+void gfx_screen_add_dirty(area_t area)
+{
+  canvas_t *screen = gfx_obj_canvas_ptr(gfxboot_data->screen.canvas_id);
+
+  if(!screen) return;
+
+  gfx_clip(&area, &screen->geo);
+
+  if(area.width <= 0 || area.height <= 0) return;
+
+  area_t *dirty = gfxboot_data->compose.dirty;
+
+  while(1) {
+    unsigned u, count = gfxboot_data->compose.dirty_count;
+    unsigned best = count;
+    int64_t best_cost = 0;
+    area_t best_area = {};
+
+    for(u = 0; u < count; u++) {
+      int x0 = MIN(area.x, dirty[u].x);
+      int y0 = MIN(area.y, dirty[u].y);
+      int x1 = MAX(area.x + area.width, dirty[u].x + dirty[u].width);
+      int y1 = MAX(area.y + area.height, dirty[u].y + dirty[u].height);
+      int64_t cost =
+        (int64_t) (x1 - x0) * (y1 - y0) -
+        (int64_t) area.width * area.height -
+        (int64_t) dirty[u].width * dirty[u].height;
+      if(best == count || cost < best_cost) {
+        best = u;
+        best_cost = cost;
+        best_area = (area_t) { .x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0 };
+      }
+    }
+
+    if(best == count || (best_cost > COMPOSE_DIRTY_SLACK && count < COMPOSE_DIRTY_MAX)) {
+      dirty[count] = area;
+      gfxboot_data->compose.dirty_count = count + 1;
+
+      return;
+    }
+
+    // merged area may now overlap other entries, so try again
+    area = best_area;
+    dirty[best] = dirty[count - 1];
+    gfxboot_data->compose.dirty_count = count - 1;
+  }
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Update all screen areas collected by gfx_screen_add_dirty().
+//
+void gfx_screen_flush()
+{
+  unsigned u, count = gfxboot_data->compose.dirty_count;
+
+  gfxboot_data->compose.dirty_count = 0;
+
+  for(u = 0; u < count; u++) {
+    gfx_screen_compose(gfxboot_data->compose.dirty[u]);
+  }
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 void gfx_screen_compose(area_t area)
 {
@@ -168,13 +358,41 @@ void gfx_screen_compose(area_t area)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-obj_id_t gfx_font_render_glyph(obj_id_t canvas_id, area_t *geo, unsigned c, unsigned size_only)
+// Render glyph for char c using the font and colors of canvas canvas_id.
+//
+// Return canvas holding the glyph bitmap; src (if not 0) is the bitmap
+// area within that canvas. geo is set to glyph offset and advance width.
+//
+// Rendered glyphs are cached in the canvas font, together with the result
+// of the font fallback chain lookup.
+//
+obj_id_t gfx_font_render_glyph(obj_id_t canvas_id, area_t *geo, area_t *src, unsigned c, unsigned size_only)
 {
   font_t *font;
   obj_id_t font_id, glyph_id = 0;
 
+  canvas_t *canvas = gfx_obj_canvas_ptr(canvas_id);
+  if(!canvas) return 0;
+
+  font_t *cache_font = gfx_obj_font_ptr(canvas->font_id);
+  color_t fg = canvas->color;
+  color_t bg = canvas->bg_color;
+  area_t tmp_src;
+
+  if(!src) src = &tmp_src;
+
+  if(cache_font) {
+    glyph_cache_entry_t *entry = gfx_font_cache_get(cache_font, c, fg, bg, size_only, src);
+    if(entry) {
+      *geo = entry->geo;
+      return cache_font->cache.canvas_id;
+    }
+  }
+
+  unsigned orig_c = c;
+
   while(1) {
-    canvas_t *canvas = gfx_obj_canvas_ptr(canvas_id);
+    canvas = gfx_obj_canvas_ptr(canvas_id);
     if(!canvas) return 0;
 
     for(font_id = canvas->font_id; (font = gfx_obj_font_ptr(font_id)); font_id = font->parent_id) {
@@ -187,18 +405,172 @@ obj_id_t gfx_font_render_glyph(obj_id_t canvas_id, area_t *geo, unsigned c, unsi
           glyph_id = gfx_font_render_font2_glyph(canvas_id, font, geo, c, size_only);
           break;
       }
-      if(glyph_id) return glyph_id;
+      if(glyph_id) break;
     }
 
-    if(c == 0xfffd) return 0;
+    if(glyph_id || c == 0xfffd) break;
 
     c = 0xfffd;
   }
 
+  if(!glyph_id || size_only) return glyph_id;
+
+  canvas_t *glyph = gfx_obj_canvas_ptr(glyph_id);
+  if(!glyph) return 0;
+
+  *src = (area_t) { .width = glyph->geo.width, .height = glyph->geo.height };
+
+  if(cache_font) {
+    obj_id_t id = gfx_font_cache_add(cache_font, glyph_id, geo, orig_c, fg, bg, src);
+    if(id) glyph_id = id;
+  }
+
+  return glyph_id;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Look up glyph cache entry.
+//
+// If any_color is set, the entry may have been rendered with different colors.
+// src is set to the bitmap area in the cache canvas.
+//
+glyph_cache_entry_t *gfx_font_cache_get(font_t *font, unsigned c, color_t fg, color_t bg, unsigned any_color, area_t *src)
+{
+  data_t *mem = gfx_obj_mem_ptr(font->cache.entries_id);
+
+  if(!mem) return 0;
+
+  glyph_cache_entry_t *entries = mem->ptr;
+
+  // font chain has changed
+  if(font->cache.gen != gfxboot_data->glyph_cache.gen) {
+    gfx_memset(mem->ptr, 0, mem->size);
+    font->cache.gen = gfxboot_data->glyph_cache.gen;
+
+    return 0;
+  }
+
+  unsigned set = (c * 0x9e3779b1u >> 16) & (font->cache.sets - 1);
+  glyph_cache_entry_t *entry = entries + set * GLYPH_CACHE_WAYS;
+
+  for(unsigned u = 0; u < GLYPH_CACHE_WAYS; u++, entry++) {
+    if(entry->stamp && entry->c == c && (any_color || (entry->fg == fg && entry->bg == bg))) {
+      canvas_t *cache = gfx_obj_canvas_ptr(font->cache.canvas_id);
+      if(!cache) return 0;
+      int slot_width = cache->geo.width / GLYPH_CACHE_WAYS;
+      int slot_height = cache->geo.height / (int) font->cache.sets;
+      *src = (area_t) { .x = (int) u * slot_width, .y = (int) set * slot_height, .width = entry->width, .height = entry->height };
+      if(!any_color) entry->stamp = ++font->cache.stamp;
+
+      return entry;
+    }
+  }
+
   return 0;
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Add rendered glyph to glyph cache.
+//
+// The cache is created on first use; its size is glyph_cache.size bytes.
+// Within a set, the least recently used entry is replaced.
+//
+// Return cache canvas id and set src to the bitmap area in it, or 0 if the
+// glyph could not be cached.
+//
+obj_id_t gfx_font_cache_add(font_t *font, obj_id_t glyph_id, area_t *geo, unsigned c, color_t fg, color_t bg, area_t *src)
+{
+  canvas_t *glyph = gfx_obj_canvas_ptr(glyph_id);
+  canvas_t *default_glyph = gfx_obj_canvas_ptr(font->glyph_id);
+
+  if(!glyph || !default_glyph) return 0;
+
+  int slot_width = default_glyph->max_width;
+  int slot_height = default_glyph->max_height;
+
+  if(!font->cache.canvas_id) {
+    unsigned slot_size = (unsigned) (slot_width * slot_height) * COLOR_BYTES + sizeof (glyph_cache_entry_t);
+    unsigned sets = 1;
+
+    if(!slot_size) return 0;
+
+    while(
+      sets < GLYPH_CACHE_MAX_SETS &&
+      2 * sets * GLYPH_CACHE_WAYS * slot_size <= gfxboot_data->glyph_cache.size
+    ) {
+      sets *= 2;
+    }
+
+    if(sets * GLYPH_CACHE_WAYS * slot_size > gfxboot_data->glyph_cache.size) return 0;
+
+    font->cache.canvas_id = gfx_obj_canvas_new(slot_width * GLYPH_CACHE_WAYS, slot_height * (int) sets);
+    font->cache.entries_id = gfx_obj_mem_new(sets * GLYPH_CACHE_WAYS * sizeof (glyph_cache_entry_t), 0);
+    font->cache.sets = sets;
+    font->cache.gen = gfxboot_data->glyph_cache.gen;
+    font->cache.stamp = 0;
+
+    if(!font->cache.canvas_id || !font->cache.entries_id) {
+      gfx_obj_ref_dec(font->cache.canvas_id);
+      gfx_obj_ref_dec(font->cache.entries_id);
+      font->cache.canvas_id = font->cache.entries_id = 0;
+
+      return 0;
+    }
+
+    // allocating may have moved things
+    glyph = gfx_obj_canvas_ptr(glyph_id);
+  }
+
+  canvas_t *cache = gfx_obj_canvas_ptr(font->cache.canvas_id);
+  data_t *mem = gfx_obj_mem_ptr(font->cache.entries_id);
+
+  if(!glyph || !cache || !mem) return 0;
+
+  // glyph from a parent font might not fit
+  if(src->width > slot_width || src->height > slot_height) return 0;
+
+  if(font->cache.gen != gfxboot_data->glyph_cache.gen) {
+    gfx_memset(mem->ptr, 0, mem->size);
+    font->cache.gen = gfxboot_data->glyph_cache.gen;
+  }
+
+  if(!++font->cache.stamp) {
+    gfx_memset(mem->ptr, 0, mem->size);
+    font->cache.stamp = 1;
+  }
+
+  unsigned set = (c * 0x9e3779b1u >> 16) & (font->cache.sets - 1);
+  glyph_cache_entry_t *entry = (glyph_cache_entry_t *) mem->ptr + set * GLYPH_CACHE_WAYS;
+  unsigned u, way = 0;
+
+  for(u = 1; u < GLYPH_CACHE_WAYS; u++) {
+    if(entry[u].stamp < entry[way].stamp) way = u;
+  }
+
+  entry += way;
+
+  *entry = (glyph_cache_entry_t) {
+    .c = c, .fg = fg, .bg = bg, .stamp = font->cache.stamp,
+    .geo = *geo, .width = src->width, .height = src->height
+  };
+
+  area_t slot = { .x = (int) way * slot_width, .y = (int) set * slot_height, .width = src->width, .height = src->height };
+
+  color_t *src_pixel = glyph->ptr + src->y * glyph->geo.width + src->x;
+  color_t *dst_pixel = cache->ptr + slot.y * cache->geo.width + slot.x;
+
+  for(int i = 0; i < slot.height; i++, src_pixel += glyph->geo.width, dst_pixel += cache->geo.width) {
+    gfx_memcpy(dst_pixel, src_pixel, (unsigned) slot.width * COLOR_BYTES);
+  }
+
+  *src = slot;
+
+  return font->cache.canvas_id;
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 obj_id_t gfx_font_render_font1_glyph(obj_id_t canvas_id, font_t *font, area_t *geo, unsigned c, unsigned size_only)
 {
@@ -516,22 +888,14 @@ void gfx_putc(obj_id_t canvas_id, unsigned c, int update_pos)
 
   if(!canvas) return;
 
-  if((glyph_id = gfx_font_render_glyph(canvas_id, &geo, c, 0))) {
-    canvas_t *glyph = gfx_obj_canvas_ptr(glyph_id);
-    if(!glyph) return;
+  area_t glyph_area;
 
+  if((glyph_id = gfx_font_render_glyph(canvas_id, &geo, &glyph_area, c, 0))) {
     area_t area = {
       .x = canvas->region.x + canvas->cursor.x + geo.x,
       .y = canvas->region.y + canvas->cursor.y + geo.y,
-      .width = glyph->geo.width,
-      .height = glyph->geo.height
-    };
-
-    area_t glyph_area = {
-      .x = 0,
-      .y = 0,
-      .width = glyph->geo.width,
-      .height = glyph->geo.height
+      .width = glyph_area.width,
+      .height = glyph_area.height
     };
 
 #if 1
@@ -616,7 +980,7 @@ area_t gfx_text_dim(obj_id_t canvas_id, char *text, unsigned len)
         break;
 
       default:
-        gfx_font_render_glyph(canvas_id, &geo, (unsigned) c, 1);
+        gfx_font_render_glyph(canvas_id, &geo, 0, (unsigned) c, 1);
         width += geo.width;
         if(width > area.width) area.width = width;
     }
@@ -639,7 +1003,7 @@ area_t gfx_char_dim(obj_id_t canvas_id, unsigned chr)
   area = gfx_font_dim(canvas->font_id);
 
   area_t geo = {};
-  gfx_font_render_glyph(canvas_id, &geo, chr, 1);
+  gfx_font_render_glyph(canvas_id, &geo, 0, chr, 1);
 
   area.width = geo.width;
 
@@ -754,11 +1118,9 @@ void gfx_blt(draw_mode_t mode, obj_id_t dst_id, area_t dst_area, obj_id_t src_id
     }
   }
   else if(mode == dm_merge) {
-    int i, j;
-    for(j = 0; j < dst_area.height; j++, dst_pixel += dst_c->geo.width, src_pixel += src_c->geo.width) {
-      for(i = 0; i < dst_area.width; i++) {
-        dst_pixel[i] = gfx_color_merge(dst_pixel[i], src_pixel[i]);
-      }
+    int i;
+    for(i = 0; i < dst_area.height; i++, dst_pixel += dst_c->geo.width, src_pixel += src_c->geo.width) {
+      gfx_color_merge_span(dst_pixel, src_pixel, (unsigned) dst_area.width);
     }
   }
 
@@ -802,6 +1164,202 @@ color_t gfx_color_merge(color_t dst, color_t src)
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Merge src into dst, len pixels.
+//
+// Same result as calling gfx_color_merge() for each pixel, in order.
+//
+// Without SSE2 (e.g. grub build) this is just a loop over gfx_color_merge().
+//
+void gfx_color_merge_span(color_t *dst, color_t *src, unsigned len)
+{
+  unsigned i = 0;
+
+  // src overlaps a dst area written before: must go pixel by pixel
+  if(src < dst && src + len > dst) {
+    for(; i < len; i++) dst[i] = gfx_color_merge(dst[i], src[i]);
+
+    return;
+  }
+
+#if defined(__SSE2__)
+  const __m128i alpha_mask = _mm_set1_epi32((int) 0xff000000);
+
+  i = gfx_color_merge_span_avx2(dst, src, len);
+
+  for(; i + 4 <= len; i += 4) {
+    __m128i s = _mm_loadu_si128((__m128i *) (src + i));
+    __m128i s_alpha = _mm_and_si128(s, alpha_mask);
+
+    // all transparent
+    if((_mm_movemask_epi8(_mm_cmpeq_epi32(s_alpha, alpha_mask)) & 0x8888) == 0x8888) continue;
+
+    __m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+
+    // all opaque: copy color, keep alpha
+    if((_mm_movemask_epi8(_mm_cmpeq_epi32(s_alpha, _mm_setzero_si128())) & 0x8888) == 0x8888) {
+      d = _mm_or_si128(s, _mm_and_si128(d, alpha_mask));
+    }
+    else {
+      d = gfx_color_merge_sse2(d, s);
+    }
+
+    _mm_storeu_si128((__m128i *) (dst + i), d);
+  }
+#endif
+
+  for(; i < len; i++) dst[i] = gfx_color_merge(dst[i], src[i]);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Merge color src into dst, len pixels.
+//
+void gfx_color_merge_fill(color_t *dst, color_t src, unsigned len)
+{
+  unsigned i = 0;
+  unsigned alpha = src >> ALPHA_POS;
+
+  if(alpha == 0xff) return;
+
+  if(alpha == 0) {
+    for(; i < len; i++) dst[i] = (dst[i] & ((color_t) 0xff << ALPHA_POS)) | src;
+
+    return;
+  }
+
+#if defined(__SSE2__)
+  __m128i s = _mm_set1_epi32((int) src);
+
+  for(; i + 4 <= len; i += 4) {
+    __m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+    _mm_storeu_si128((__m128i *) (dst + i), gfx_color_merge_sse2(d, s));
+  }
+#endif
+
+  for(; i < len; i++) dst[i] = gfx_color_merge(dst[i], src);
+}
+
+
+#if defined(__SSE2__)
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Merge 4 pixels, same result as gfx_color_merge().
+//
+// Color channels are handled as 16 bit values. gfx_color_merge() calculates
+// s + ((d - s + 1) * a >> 8) with a signed 17 bit product. This is done here as
+// s + ((d - s + 257) * (a << 8) >> 16) - a, which fits into unsigned 16 bit.
+//
+__m128i gfx_color_merge_sse2(__m128i dst, __m128i src)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_mask = _mm_set1_epi32((int) 0xff000000);
+  const __m128i byte_mask = _mm_set1_epi16(0xff);
+  const __m128i ofs = _mm_set1_epi16(257);
+
+  __m128i d_lo = _mm_unpacklo_epi8(dst, zero);
+  __m128i d_hi = _mm_unpackhi_epi8(dst, zero);
+  __m128i s_lo = _mm_unpacklo_epi8(src, zero);
+  __m128i s_hi = _mm_unpackhi_epi8(src, zero);
+
+  __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xff), 0xff);
+  __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xff), 0xff);
+
+  d_lo = _mm_sub_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_sub_epi16(d_lo, s_lo), ofs), _mm_slli_epi16(a_lo, 8)), a_lo);
+  d_hi = _mm_sub_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_sub_epi16(d_hi, s_hi), ofs), _mm_slli_epi16(a_hi, 8)), a_hi);
+
+  s_lo = _mm_and_si128(_mm_add_epi16(s_lo, d_lo), byte_mask);
+  s_hi = _mm_and_si128(_mm_add_epi16(s_hi, d_hi), byte_mask);
+
+  __m128i res = _mm_packus_epi16(s_lo, s_hi);
+
+  // keep dst alpha
+  res = _mm_or_si128(_mm_andnot_si128(alpha_mask, res), _mm_and_si128(dst, alpha_mask));
+
+  // src fully transparent: keep dst
+  __m128i transp = _mm_cmpeq_epi32(_mm_and_si128(src, alpha_mask), alpha_mask);
+
+  return _mm_or_si128(_mm_and_si128(transp, dst), _mm_andnot_si128(transp, res));
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// AVX2 variant of gfx_color_merge_sse2(), 8 pixels.
+//
+__attribute__ ((target ("avx2")))
+static inline __m256i gfx_color_merge_avx2(__m256i dst, __m256i src)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha_mask = _mm256_set1_epi32((int) 0xff000000);
+  const __m256i byte_mask = _mm256_set1_epi16(0xff);
+  const __m256i ofs = _mm256_set1_epi16(257);
+
+  __m256i d_lo = _mm256_unpacklo_epi8(dst, zero);
+  __m256i d_hi = _mm256_unpackhi_epi8(dst, zero);
+  __m256i s_lo = _mm256_unpacklo_epi8(src, zero);
+  __m256i s_hi = _mm256_unpackhi_epi8(src, zero);
+
+  __m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xff), 0xff);
+  __m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xff), 0xff);
+
+  d_lo = _mm256_sub_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_sub_epi16(d_lo, s_lo), ofs), _mm256_slli_epi16(a_lo, 8)), a_lo);
+  d_hi = _mm256_sub_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_sub_epi16(d_hi, s_hi), ofs), _mm256_slli_epi16(a_hi, 8)), a_hi);
+
+  s_lo = _mm256_and_si256(_mm256_add_epi16(s_lo, d_lo), byte_mask);
+  s_hi = _mm256_and_si256(_mm256_add_epi16(s_hi, d_hi), byte_mask);
+
+  // unpack and pack both work within 128 bit lanes, so pixel order is kept
+  __m256i res = _mm256_packus_epi16(s_lo, s_hi);
+
+  res = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, res), _mm256_and_si256(dst, alpha_mask));
+
+  __m256i transp = _mm256_cmpeq_epi32(_mm256_and_si256(src, alpha_mask), alpha_mask);
+
+  return _mm256_blendv_epi8(res, dst, transp);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Merge src into dst in blocks of 8 pixels if the cpu supports AVX2.
+//
+// Return number of pixels done.
+//
+__attribute__ ((target ("avx2")))
+unsigned gfx_color_merge_span_avx2(color_t *dst, color_t *src, unsigned len)
+{
+  static int has_avx2 = -1;
+  unsigned i = 0;
+
+  if(has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+
+  if(!has_avx2) return 0;
+
+  const __m256i alpha_mask = _mm256_set1_epi32((int) 0xff000000);
+
+  for(; i + 8 <= len; i += 8) {
+    __m256i s = _mm256_loadu_si256((__m256i *) (src + i));
+    __m256i s_alpha = _mm256_and_si256(s, alpha_mask);
+
+    // all transparent
+    if((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi32(s_alpha, alpha_mask)) == 0xffffffff) continue;
+
+    __m256i d = _mm256_loadu_si256((__m256i *) (dst + i));
+
+    // all opaque: copy color, keep alpha
+    if(_mm256_testz_si256(s_alpha, s_alpha)) {
+      d = _mm256_or_si256(s, _mm256_and_si256(d, alpha_mask));
+    }
+    else {
+      d = gfx_color_merge_avx2(d, s);
+    }
+
+    _mm256_storeu_si256((__m256i *) (dst + i), d);
+  }
+
+  return i;
+}
+#endif
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 int gfx_getpixel(obj_id_t canvas_id, int x, int y, color_t *color)
 {
@@ -983,9 +1541,7 @@ void gfx_rect(obj_id_t canvas_id, int x, int y, int width, int height, color_t c
   }
   else if(mode == dm_merge) {
     for(j = 0; j < area.height; j++, pixel += canvas->geo.width) {
-      for(i = 0; i < area.width; i++) {
-        pixel[i] = gfx_color_merge(pixel[i], c);
-      }
+      gfx_color_merge_fill(pixel, c, (unsigned) area.width);
     }
   }
 
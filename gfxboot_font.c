@@ -63,6 +63,10 @@ int gfx_obj_font_dump(obj_t *ptr, dump_style_t style)
     gfxboot_log("    char index: offset %u, size %u\n", f->unimap.offset, f->unimap.size);
     gfxboot_log("    data_id %s\n", gfx_obj_id2str(f->data_id));
     gfxboot_log("    glyph_id %s\n", gfx_obj_id2str(f->glyph_id));
+    if(f->cache.canvas_id) {
+      gfxboot_log("    glyph cache: %u sets, canvas %s", f->cache.sets, gfx_obj_id2str(f->cache.canvas_id));
+      gfxboot_log(", entries %s\n", gfx_obj_id2str(f->cache.entries_id));
+    }
   }
 
   return 1;
@@ -82,6 +86,8 @@ unsigned gfx_obj_font_gc(obj_t *ptr)
     more_gc += gfx_obj_ref_dec_delay_gc(font->parent_id);
     more_gc += gfx_obj_ref_dec_delay_gc(font->data_id);
     more_gc += gfx_obj_ref_dec_delay_gc(font->glyph_id);
+    more_gc += gfx_obj_ref_dec_delay_gc(font->cache.canvas_id);
+    more_gc += gfx_obj_ref_dec_delay_gc(font->cache.entries_id);
   }
 
   return more_gc;
@@ -98,6 +104,7 @@ int gfx_obj_font_contains(obj_t *ptr, obj_id_t id)
 
   if(font && data_size == OBJ_FONT_SIZE()) {
     if(id == font->parent_id || id == font->data_id || id == font->glyph_id) return 1;
+    if(id == font->cache.canvas_id || id == font->cache.entries_id) return 1;
   }
 
   return 0;
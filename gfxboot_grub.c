@@ -275,6 +275,8 @@ grub_err_t grub_gfxboot_init(int entry, grub_menu_t menu, int nested)
 
   serial_init();
 
+  gfxboot_data->glyph_cache.size = GLYPH_CACHE_SIZE;
+
   gfxboot_data->vm.mem.size = GFX_MEMORY_IN_MIB * (1 << 20);
   gfxboot_data->vm.mem.ptr = grub_zalloc(gfxboot_data->vm.mem.size);
   if(!gfxboot_data->vm.mem.ptr) return grub_errno;
@@ -361,12 +363,17 @@ void grub_gfxboot_clear_timeout(void *data __attribute__ ((unused)))
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-int gfxboot_sys_read_file(char *name, void **buf)
+// Read file into buffer provided by alloc(data, file_size).
+//
+// alloc() is not called for empty files.
+//
+// Return file size or -1.
+//
+int gfxboot_sys_read_file(char *name, read_alloc_function_t alloc, void *data)
 {
   int size = -1;
   char *tmp = NULL;
-
-  *buf = NULL;
+  void *buf;
 
   grub_errno = 0;
 
@@ -399,14 +406,10 @@ int gfxboot_sys_read_file(char *name, void **buf)
       size = 0;
     }
     else if(file->size > 0) {
-      *buf = grub_zalloc(file->size);
-      if(*buf) {
-        size = grub_file_read(file, *buf, file->size);
-        if(size != (int) file->size) {
-          grub_free(*buf);
-          *buf = NULL;
-          size = -1;
-        }
+      buf = alloc(data, file->size);
+      if(buf) {
+        size = grub_file_read(file, buf, file->size);
+        if(size != (int) file->size) size = -1;
       }
     }
 
@@ -421,13 +424,6 @@ int gfxboot_sys_read_file(char *name, void **buf)
 }
 
 
-// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-void gfxboot_sys_free(void *ptr)
-{
-  if(ptr) grub_free(ptr);
-}
-
-
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 unsigned long gfxboot_sys_strlen(const char *s)
 {
@@ -462,6 +458,15 @@ int gfxboot_getkey()
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// No threads in grub: run jobs one after another.
+//
+void gfxboot_sys_parallel(parallel_function_t func, void *data, unsigned count)
+{
+  for(unsigned u = 0; u < count; u++) func(data, u);
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 void grub_gfxboot_data_free()
 {
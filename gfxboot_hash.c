@@ -5,25 +5,71 @@
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // hash
 
-static unsigned find_key(hash_t *hash, data_t *key, int *match);
+static uint32_t *find_slot(hash_t *hash, data_t *key, uint32_t key_hash, uint32_t sym);
+static uint32_t *key_order(hash_t *hash);
+static void reindex(hash_t *hash);
+static void compact(hash_t *hash);
+static int cmp_entry(hash_t *hash, unsigned idx1, unsigned idx2);
+static void sift_down(hash_t *hash, uint32_t *order, unsigned idx, unsigned size);
+static void sort_order(hash_t *hash);
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 obj_id_t gfx_obj_hash_new(unsigned max)
 {
+  unsigned u = 1;
+
   if(!max) max = 0x10;
 
+  // max must be a power of 2
+  while(u < max && u < (1u << 28)) u <<= 1;
+  max = u;
+
   obj_id_t id = gfx_obj_alloc(OTYPE_HASH, OBJ_HASH_SIZE(max));
   hash_t *h = gfx_obj_hash_ptr(id);
 
   if(h) {
     h->max = max;
+    h->ordered = 1;
+    // ensure a re-used hash id doesn't validate old lookup caches
+    gfx_obj_hash_touch(h);
   }
 
   return id;
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Mark hash as changed.
+//
+// Call this when keys are added or removed or the parent changes. It
+// invalidates all lookup caches that have this hash in their path.
+//
+// Replacing the value of an existing key does not require this, as caches
+// store only the key position, not the value.
+//
+void gfx_obj_hash_touch(hash_t *hash)
+{
+  if(!++gfxboot_data->vm.hash_stamp) {
+    // counter wrapped around - reset all stamps and caches
+    olist_t *ol = gfxboot_data->vm.olist.ptr;
+
+    for(unsigned u = 0; u < ol->max; u++) {
+      obj_t *ptr = ol->ptr + u;
+      if(ptr->base_type == OTYPE_HASH && ptr->data.size >= sizeof (hash_t)) {
+        OBJ_HASH_FROM_PTR(ptr)->stamp = 1;
+      }
+    }
+
+    gfx_program_flush_cache();
+
+    gfxboot_data->vm.hash_stamp = 2;
+  }
+
+  hash->stamp = gfxboot_data->vm.hash_stamp;
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 hash_t *gfx_obj_hash_ptr(obj_id_t id)
 {
@@ -52,6 +98,14 @@ hash_t *gfx_obj_hash_ptr_rw(obj_id_t id)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Iterate over hash entries.
+//
+// Entries are returned in key order. Entries deleted while iterating are
+// skipped, keys added while iterating are not returned.
+//
+// The key order is updated when starting, unless a 'forall' loop is still
+// running over the hash. Entries themselves are not modified.
+//
 unsigned gfx_obj_hash_iterate(obj_t *ptr, unsigned *idx, obj_id_t *id1, obj_id_t *id2)
 {
   hash_t *h = ptr->data.ptr;
@@ -61,12 +115,20 @@ unsigned gfx_obj_hash_iterate(obj_t *ptr, unsigned *idx, obj_id_t *id1, obj_id_t
     return *idx = 0;
   }
 
-  if(*idx >= h->size) {
+  if(!*idx && !h->ordered && !h->iterating) sort_order(h);
+
+  uint32_t *order = key_order(h);
+
+  while(*idx < h->order_size && (order[*idx] >= h->used || !h->ptr[order[*idx]].key)) (*idx)++;
+
+  if(*idx >= h->order_size) {
     return 0;
   }
 
-  gfx_obj_ref_inc(*id1 = h->ptr[*idx].key);
-  gfx_obj_ref_inc(*id2 = h->ptr[*idx].value);
+  key_value_t *kv = h->ptr + order[*idx];
+
+  gfx_obj_ref_inc(*id1 = kv->key);
+  gfx_obj_ref_inc(*id2 = kv->value);
   (*idx)++;
 
   return 2;
@@ -79,7 +141,7 @@ int gfx_obj_hash_dump(obj_t *ptr, dump_style_t style)
   if(!ptr) return 1;
 
   hash_t *h = ptr->data.ptr;
-  unsigned u;
+  unsigned u, cnt;
   obj_id_t key, value;
 
   if(ptr->data.size != OBJ_HASH_SIZE(h->max)) {
@@ -102,10 +164,19 @@ int gfx_obj_hash_dump(obj_t *ptr, dump_style_t style)
     return 1;
   }
 
-  for(u = 0; u < h->size && (!style.max || u < style.max); u++) {
-    key = h->ptr[u].key;
+  if(!h->ordered && !h->iterating) sort_order(h);
+
+  // key order is outdated while a 'forall' loop runs - show entries as they are
+  uint32_t *order = h->ordered ? key_order(h) : 0;
+  unsigned entries = order ? h->order_size : h->used;
+
+  for(u = cnt = 0; u < entries && (!style.max || cnt < style.max); u++) {
+    unsigned v = order ? order[u] : u;
+    if(v >= h->used) continue;
+    key = h->ptr[v].key;
     if(!key) continue;
-    value = h->ptr[u].value;
+    cnt++;
+    value = h->ptr[v].value;
     if(style.dump) gfxboot_log("    ");
     gfx_obj_dump(key, (dump_style_t) { .inspect = style.inspect, .no_nl = 1 });
     gfxboot_log(" => ");
@@ -119,9 +190,21 @@ int gfx_obj_hash_dump(obj_t *ptr, dump_style_t style)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 obj_id_t gfx_obj_hash_set(obj_id_t hash_id, obj_id_t key_id, obj_id_t value_id, int do_ref_cnt)
+{
+  return gfx_obj_hash_set_cached(hash_id, key_id, value_id, do_ref_cnt, 0);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Set hash element.
+//
+// cache (optional) remembers the key position for the next call with the
+// same key.
+//
+obj_id_t gfx_obj_hash_set_cached(obj_id_t hash_id, obj_id_t key_id, obj_id_t value_id, int do_ref_cnt, hash_cache_t *cache)
 {
   unsigned u;
-  int match;
+  uint32_t *slot = 0, key_hash = 0, sym = 0;
 
   hash_t *hash = gfx_obj_hash_ptr_rw(hash_id);
   if(!hash) return 0;
@@ -129,24 +212,65 @@ obj_id_t gfx_obj_hash_set(obj_id_t hash_id, obj_id_t key_id, obj_id_t value_id,
   data_t *key = gfx_obj_mem_ptr(key_id);
   if(!key) return 0;
 
-  u = find_key(hash, key, &match);
-  // gfxboot_log("XXX set: key %s, u %d, match %d\n", (char *) key->ptr, (int) u, match);
+  if(
+    cache &&
+    cache->stamp &&
+    cache->len == 1 &&
+    cache->path[0] == hash_id &&
+    hash->stamp <= cache->stamp &&
+    cache->slot < hash->used
+  ) {
+    u = cache->slot;
+  }
+  else {
+    key_hash = gfx_obj_hash_key(key);
+    sym = gfx_program_sym(gfx_obj_ptr(key_id));
+    slot = find_slot(hash, key, key_hash, sym);
+    u = *slot - 1;
+  }
+  // gfxboot_log("XXX set: key %s, u %d, match %d\n", (char *) key->ptr, (int) u, slot && !*slot);
 
-  if(!match) {
-    hash->size++;
-    if(hash->size > hash->max) {
-      unsigned max = hash->max + (hash->max >> 3) + 0x10;
-      hash_id = gfx_obj_realloc(hash_id, OBJ_HASH_SIZE(max));
-      if(!hash_id) return 0;
-      hash = gfx_obj_hash_ptr(hash_id);
-      if(!hash) return 0;
-      hash->max = max;
+  if(slot && !*slot) {
+    gfx_obj_hash_touch(hash);
+
+    if(hash->used == hash->max) {
+      // compacting would move entries under a running 'forall' loop
+      if(!hash->iterating && hash->size < hash->used - (hash->used >> 3)) {
+        // enough deleted entries to make room
+        compact(hash);
+      }
+      else {
+        unsigned max = hash->max << 1;
+        hash_id = gfx_obj_realloc(hash_id, OBJ_HASH_SIZE(max));
+        if(!hash_id) return 0;
+        hash = gfx_obj_hash_ptr(hash_id);
+        if(!hash) return 0;
+        uint32_t *old_order = (uint32_t *) (hash->ptr + hash->max) + 2 * hash->max;
+        hash->max = max;
+        gfx_memcpy(key_order(hash), old_order, hash->order_size * sizeof *old_order);
+        reindex(hash);
+      }
+      slot = find_slot(hash, key, key_hash, sym);
     }
-    if(u + 1 < hash->size) {
-      // gfxboot_log("XXX set: move %d -> %d [%d]\n", (int) u, (int) u + 1, (int) (hash->size - u - 1));
-      gfx_memcpy(hash->ptr + u + 1, hash->ptr + u, (sizeof *hash->ptr) * (hash->size - u - 1));
-      hash->ptr[u].key = 0;
-      hash->ptr[u].value = 0;
+
+    u = hash->used++;
+    *slot = u + 1;
+    hash->size++;
+    hash->ptr[u] = (key_value_t) { .hash = key_hash, .sym = sym };
+
+    // appending in key order keeps the key order valid; a running 'forall'
+    // loop must not see new keys, though
+    if(hash->ordered) {
+      uint32_t *order = key_order(hash);
+      unsigned last = hash->order_size;
+      while(last-- && !hash->ptr[order[last]].key);
+      data_t *last_key = last < hash->order_size ? gfx_obj_mem_ptr(hash->ptr[order[last]].key) : 0;
+      if(hash->iterating || (last_key && gfx_obj_mem_cmp(key, last_key) < 0)) {
+        hash->ordered = 0;
+      }
+      else {
+        order[hash->order_size++] = u;
+      }
     }
   }
 
@@ -172,16 +296,40 @@ obj_id_t gfx_obj_hash_set(obj_id_t hash_id, obj_id_t key_id, obj_id_t value_id,
   hash->ptr[u].key = key_id;
   hash->ptr[u].value = value_id;
 
+  if(cache) {
+    *cache = (hash_cache_t) { .stamp = gfxboot_data->vm.hash_stamp, .slot = u, .len = 1, .path[0] = hash_id };
+  }
+
   return hash_id;
 }
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 obj_id_pair_t gfx_obj_hash_get(obj_id_t hash_id, data_t *key)
+{
+  return gfx_obj_hash_get_cached(hash_id, key, 0, 0, 0);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Look up key in hash and its parents.
+//
+// sym: symbol id of key, 0 if none (see gfx_program_sym())
+//
+// cache (optional) remembers the non-empty hashes searched and where the
+// key was found. Hashes on this path that have not been changed since are
+// not searched again.
+//
+// *pos is the current position in the cache path; this allows to continue
+// the path over several calls (see gfx_lookup_dict_cached()). It must be 0
+// initially.
+//
+obj_id_pair_t gfx_obj_hash_get_cached(obj_id_t hash_id, data_t *key, uint32_t sym, hash_cache_t *cache, unsigned *pos)
 {
   obj_id_t orig_hash_id = hash_id;
-  unsigned u, level = 0, sticky = 0;
-  int match;
+  unsigned u = 0, level = 0, sticky = 0;
+  uint32_t key_hash = 0, *slot;
+  int match = 0, have_hash = 0;
   hash_t *hash;
 
   do {
@@ -208,7 +356,45 @@ obj_id_pair_t gfx_obj_hash_get(obj_id_t hash_id, data_t *key)
 
     hash = OBJ_HASH_FROM_PTR(ptr);
 
-    u = find_key(hash, key, &match);
+    int search = 0;
+
+    if(!cache) {
+      search = 1;
+    }
+    else if(hash->size) {
+      if(
+        cache->stamp &&
+        *pos < cache->len &&
+        cache->path[*pos] == hash_id &&
+        hash->stamp <= cache->stamp
+      ) {
+        // unchanged since last lookup: key is either in last path element or not here
+        if(*pos + 1 == cache->len) {
+          u = cache->slot;
+          match = 1;
+        }
+      }
+      else {
+        // path differs, search and record new path
+        cache->stamp = 0;
+        search = 1;
+        if(*pos < HASH_CACHE_PATH) cache->path[*pos] = hash_id;
+      }
+      (*pos)++;
+    }
+
+    if(search && hash->size) {
+      // key hash is the same for all hashes searched
+      if(!have_hash) {
+        key_hash = gfx_obj_hash_key(key);
+        have_hash = 1;
+      }
+      slot = find_slot(hash, key, key_hash, sym);
+      if(*slot) {
+        u = *slot - 1;
+        match = 1;
+      }
+    }
     // gfxboot_log("XXX get key %s, u %d, match %d\n", (char *) key->ptr, (int) u, match);
 
     hash_id = hash->parent_id;
@@ -217,26 +403,40 @@ obj_id_pair_t gfx_obj_hash_get(obj_id_t hash_id, data_t *key)
 
   if(!match) return (obj_id_pair_t) {};
 
+  if(cache && !cache->stamp && *pos <= HASH_CACHE_PATH) {
+    cache->stamp = gfxboot_data->vm.hash_stamp;
+    cache->slot = u;
+    cache->len = *pos;
+  }
+
   return (obj_id_pair_t) { .id1 = orig_hash_id, .id2 = hash->ptr[u].value };
 }
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Delete hash element.
+//
+// The entry is only marked as deleted; its index slot stays in use until
+// the hash is compacted.
+//
 void gfx_obj_hash_del(obj_id_t hash_id, obj_id_t key_id, int do_ref_cnt)
 {
   unsigned u;
-  int match;
 
   hash_t *hash = gfx_obj_hash_ptr_rw(hash_id);
   if(!hash) return;
 
   data_t *key = gfx_obj_mem_ptr(key_id);
-  if(!key) return;
+  if(!key || !hash->size) return;
+
+  uint32_t *slot = find_slot(hash, key, gfx_obj_hash_key(key), gfx_program_sym(gfx_obj_ptr(key_id)));
+  // gfxboot_log("XXX del key %s, slot %u\n", (char *) key->ptr, *slot);
 
-  u = find_key(hash, key, &match);
-  // gfxboot_log("XXX del key %s, u %d, match %d\n", (char *) key->ptr, (int) u, match);
+  if(*slot) {
+    u = *slot - 1;
+
+    gfx_obj_hash_touch(hash);
 
-  if(match) {
     if(do_ref_cnt) {
       gfx_obj_ref_dec(hash->ptr[u].key);
       gfx_obj_ref_dec(hash->ptr[u].value);
@@ -244,13 +444,16 @@ void gfx_obj_hash_del(obj_id_t hash_id, obj_id_t key_id, int do_ref_cnt)
 
     hash->size--;
 
-    if(u < hash->size) {
-      // gfxboot_log("XXX del: move %d -> %d [%d]\n", (int) u + 1, (int) u, (int) (hash->size - u));
-      gfx_memcpy(hash->ptr + u, hash->ptr + u + 1, (sizeof *hash->ptr) * (hash->size - u));
-    }
+    hash->ptr[u].key = 0;
+    hash->ptr[u].value = 0;
 
-    hash->ptr[hash->size].key = 0;
-    hash->ptr[hash->size].value = 0;
+    if(!hash->size && !hash->iterating) {
+      // empty - start over
+      hash->used = 0;
+      hash->ordered = 1;
+      hash->order_size = 0;
+      reindex(hash);
+    }
   }
 }
 
@@ -266,7 +469,7 @@ unsigned gfx_obj_hash_gc(obj_t *ptr)
 
   if(hash && data_size == OBJ_HASH_SIZE(hash->max)) {
     more_gc += gfx_obj_ref_dec_delay_gc(hash->parent_id);
-    for(idx = 0; idx < hash->size; idx++) {
+    for(idx = 0; idx < hash->used; idx++) {
       more_gc += gfx_obj_ref_dec_delay_gc(hash->ptr[idx].key);
       more_gc += gfx_obj_ref_dec_delay_gc(hash->ptr[idx].value);
     }
@@ -287,7 +490,7 @@ int gfx_obj_hash_contains(obj_t *ptr, obj_id_t id)
 
   if(hash && data_size == OBJ_HASH_SIZE(hash->max)) {
     if(hash->parent_id == id) return 1;
-    for(idx = 0; idx < hash->size; idx++) {
+    for(idx = 0; idx < hash->used; idx++) {
       if(
         id == hash->ptr[idx].key ||
         id == hash->ptr[idx].value
@@ -298,73 +501,174 @@ int gfx_obj_hash_contains(obj_t *ptr, obj_id_t id)
   return 0;
 }
 
-#if 0
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-// linear search
-unsigned find_key(hash_t *hash, data_t *key, int *match)
+// Calculate key hash (FNV-1a).
+//
+uint32_t gfx_obj_hash_key(data_t *key)
 {
-  unsigned u;
-  data_t *hash_key;
+  uint32_t h = 0x811c9dc5;
+  uint8_t *p = key->ptr;
+
+  for(unsigned u = 0; u < key->size; u++) {
+    h = (h ^ p[u]) * 0x01000193;
+  }
+
+  return h;
+}
+
 
-  *match = 0;
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Find index slot for key.
+//
+// Keys that are both symbols (sym != 0) are compared by symbol id; only
+// other keys (built at runtime) need a full compare.
+//
+// Return pointer to slot. If the key is not in the hash, the slot is empty
+// (0) and can be used to add the key.
+//
+uint32_t *find_slot(hash_t *hash, data_t *key, uint32_t key_hash, uint32_t sym)
+{
+  uint32_t *index = (uint32_t *) (hash->ptr + hash->max);
+  unsigned mask = (hash->max << 1) - 1;
+  unsigned u = key_hash & mask;
 
-  for(u = 0; u < hash->size; u++) {
-    hash_key = gfx_obj_mem_ptr(hash->ptr[u].key);
+  // at most half of the slots are used, so there's always an empty one
+  for(;; u = (u + 1) & mask) {
+    if(!index[u]) return index + u;
+
+    key_value_t *kv = hash->ptr + index[u] - 1;
+
+    if(sym && kv->sym) {
+      if(kv->sym == sym && kv->key) return index + u;
+      continue;
+    }
+
+    if(kv->hash != key_hash || !kv->key) continue;
+
+    data_t *hash_key = gfx_obj_mem_ptr(kv->key);
     if(!hash_key) continue;
-    int i = gfx_obj_mem_cmp(key, hash_key);
-    if(i > 0) continue;
-    if(i == 0) *match = 1;
-    break;
+
+    if(!gfx_obj_mem_cmp(key, hash_key)) return index + u;
   }
+}
 
-  return u;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get entry indices in key order; they follow the index.
+//
+uint32_t *key_order(hash_t *hash)
+{
+  return (uint32_t *) (hash->ptr + hash->max) + 2 * hash->max;
 }
 
-#else
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-// binary search
-unsigned find_key(hash_t *hash, data_t *key, int *match)
+// Rebuild index from entries.
+//
+void reindex(hash_t *hash)
 {
-  unsigned u_start, u_end, u;
-  data_t *hash_key;
+  uint32_t *index = (uint32_t *) (hash->ptr + hash->max);
+  unsigned mask = (hash->max << 1) - 1;
 
-  *match = 0;
+  gfx_memset(index, 0, (hash->max << 1) * sizeof *index);
 
-  u_start = u = 0;
-  u_end = hash->size;
+  for(unsigned u = 0; u < hash->used; u++) {
+    if(!hash->ptr[u].key) continue;
+    unsigned v = hash->ptr[u].hash & mask;
+    while(index[v]) v = (v + 1) & mask;
+    index[v] = u + 1;
+  }
+}
 
-  while(u_end > u_start) {
-    u = (u_end + u_start) / 2;
 
-    hash_key = gfx_obj_mem_ptr(hash->ptr[u].key);
-    if(!hash_key) return 0;
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Remove deleted entries.
+//
+// Entry positions change - this invalidates lookup caches and the key
+// order. Must not be done while a 'forall' loop runs over the hash.
+//
+void compact(hash_t *hash)
+{
+  unsigned u, v;
 
-    int i = gfx_obj_mem_cmp(key, hash_key);
+  for(u = v = 0; u < hash->used; u++) {
+    if(hash->ptr[u].key) hash->ptr[v++] = hash->ptr[u];
+  }
 
-    if(i == 0) {
-      *match = 1;
-      break;
-    }
+  for(u = v; u < hash->used; u++) {
+    hash->ptr[u] = (key_value_t) { };
+  }
 
-    if(u_end == u_start + 1) {
-      if(i > 0) u++;
-      break;
-    }
+  hash->used = v;
+  hash->ordered = 0;
 
-    if(i > 0) {
-      if(u_end == u + 1) {
-        if(i > 0) u++;
-        break;
-      }
-      u_start = u;
-    }
-    else {
-      u_end = u;
-    }
+  reindex(hash);
+
+  gfx_obj_hash_touch(hash);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Compare keys of two entries.
+//
+int cmp_entry(hash_t *hash, unsigned idx1, unsigned idx2)
+{
+  data_t *key1 = gfx_obj_mem_ptr(hash->ptr[idx1].key);
+  data_t *key2 = gfx_obj_mem_ptr(hash->ptr[idx2].key);
+
+  if(!key1 || !key2) return 0;
+
+  return gfx_obj_mem_cmp(key1, key2);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Heap sort helper: move order[idx] down the heap.
+//
+void sift_down(hash_t *hash, uint32_t *order, unsigned idx, unsigned size)
+{
+  unsigned child;
+
+  while((child = 2 * idx + 1) < size) {
+    if(child + 1 < size && cmp_entry(hash, order[child], order[child + 1]) < 0) child++;
+    if(cmp_entry(hash, order[idx], order[child]) >= 0) break;
+
+    uint32_t tmp = order[idx];
+    order[idx] = order[child];
+    order[child] = tmp;
+
+    idx = child;
+  }
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Update key order.
+//
+// Only the entry indices are sorted; entries keep their position, so
+// lookup caches stay valid.
+//
+void sort_order(hash_t *hash)
+{
+  uint32_t *order = key_order(hash);
+  unsigned u, size = 0;
+
+  for(u = 0; u < hash->used; u++) {
+    if(hash->ptr[u].key) order[size++] = u;
+  }
+
+  for(u = size / 2; u-- > 0;) {
+    sift_down(hash, order, u, size);
+  }
+
+  for(u = size; u-- > 1;) {
+    uint32_t tmp = order[0];
+    order[0] = order[u];
+    order[u] = tmp;
+    sift_down(hash, order, 0, u);
   }
 
-  return u;
+  hash->order_size = size;
+  hash->ordered = 1;
 }
-#endif
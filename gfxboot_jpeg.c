@@ -3,6 +3,10 @@
 
 #include "gfxboot.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #define ERR_NO_SOI 1
 #define ERR_NOT_8BIT 2
 #define ERR_HEIGHT_MISMATCH 3
@@ -18,6 +22,7 @@
 #define ERR_NO_EOI 13
 #define ERR_BAD_TABLES 14
 #define ERR_DEPTH_MISMATCH 15
+#define ERR_INCOMPLETE 16
 
 #define ISHIFT 11
 
@@ -34,10 +39,11 @@
 #define M_EOF		0x80
 
 struct in {
-	unsigned int bits;
+	uint64_t bits;		/* bit reservoir, 'left' valid bits at the bottom */
 	int left;
 	int marker;
 	void *data;
+	unsigned char *end;	/* end of image data */
 };
 
 /*********************************/
@@ -63,7 +69,7 @@ struct scan {
 
 /*********************************/
 
-#define DECBITS 8		/* seems to be the optimum */
+#define DECBITS 10		/* covers most AC codes including their value */
 
 struct dec_hufftbl {
 	int maxcode[17];
@@ -75,13 +81,18 @@ struct dec_hufftbl {
 struct jpeg_decdata {
 	int dcts[6 * 64 + 16];
 	int out[64 * 6];
-	int dquant[3][64];
 };
 
 static void decode_mcus __P((struct in *, int *, int, struct scan *, int *));
 static void dec_makehuff __P((struct dec_hufftbl *, int *, unsigned char *));
 
 static void setinput __P((struct in *));
+
+struct jpeg_state;
+static void dec_initstate(jpeg_ctx_t *jc, struct jpeg_state *st);
+static void dec_restart(jpeg_ctx_t *jc, struct jpeg_state *st);
+static void dec_mcus(jpeg_ctx_t *jc, struct jpeg_state *st, uint8_t *pic, int m0, int m1);
+static void dec_job(void *data, unsigned idx);
 /*********************************/
 
 #undef PREC
@@ -89,6 +100,11 @@ static void setinput __P((struct in *));
 
 static void idctqtab __P((unsigned char *, PREC *));
 static void idct __P((int *, int *, PREC *, PREC, int));
+static void idct_scaled __P((int *, int *, PREC *, PREC, int, int));
+#if defined(__SSE2__)
+static void idct_sse2(int *in, int *out, PREC *quant, PREC off);
+static int idct_avx2(int *in, int *out, PREC *quant, PREC off);
+#endif
 static void scaleidctqtab __P((PREC *, PREC));
 
 /*********************************/
@@ -96,7 +112,10 @@ static void scaleidctqtab __P((PREC *, PREC));
 static void initcol __P((PREC[][64]));
 
 static void col221111(int *out, unsigned char *pic, int width, int bits);
-static unsigned char tmp_img[16*16*4];		/* 16 x 16, 32 bit color */
+static void col221111_scaled(int *out, unsigned char *pic, int width, int n, int bits);
+#if defined(__SSE2__)
+static void col221111_32_sse2(int *out, unsigned char *pic, int width);
+#endif
 
 /*********************************/
 
@@ -111,9 +130,6 @@ static unsigned char tmp_img[16*16*4];		/* 16 x 16, 32 bit color */
 #define M_EOI	0xd9
 #define M_COM	0xfe
 
-static unsigned char *datap;
-static struct jpeg_decdata decdata;
-
 static void memset(void *p, int c, int n)
 {
   unsigned char *x = p;
@@ -122,18 +138,22 @@ static void memset(void *p, int c, int n)
 }
 
 
-static int getbyte(void)
+static int getbyte(struct in *in)
 {
-	return *datap++;
+	unsigned char *p = in->data;
+
+	in->data = p + 1;
+
+	return *p;
 }
 
-static int getword(void)
+static int getword(struct in *in)
 {
-	int c1, c2;
-	c1 = *datap;
-	c2 = datap[1];
-	datap += 2;
-	return c1 << 8 | c2;
+	unsigned char *p = in->data;
+
+	in->data = p + 2;
+
+	return p[0] << 8 | p[1];
 }
 
 struct comp {
@@ -149,29 +169,72 @@ struct jpginfo {
 	int dri;		/* restart interval */
 };
 
-static struct jpginfo info;
-static struct comp comps[MAXCOMP];
-
-static struct scan dscans[MAXCOMP];
-
-static unsigned char quant[4][64];
+/*
+ * Entropy decoding state.
+ *
+ * One per sequence of MCUs decoded in order; independent segments (see
+ * gfx_jpeg_run()) each get their own.
+ */
+struct jpeg_state {
+	struct in in;
+	struct scan dscans[MAXCOMP];
+	struct jpeg_decdata decdata;
+	unsigned char tmp_img[16*16*4];		/* 16 x 16, 32 bit color */
+	int todo;		/* MCUs until next restart marker */
+};
 
-static struct dec_hufftbl dhuff[4];
+/* max number of segment groups decoded in parallel */
+#define JPEG_JOBS 64
 
-#define dec_huffdc (dhuff + 0)
-#define dec_huffac (dhuff + 2)
+/*
+ * Decoder context.
+ *
+ * Everything needed to decode one image. Pointers to the image data and
+ * the output buffer are passed to each gfx_jpeg_step() call, so both may
+ * move between calls.
+ */
+struct jpeg_ctx_s {
+	struct in in;
+	struct jpginfo info;
+	struct comp comps[MAXCOMP];
+	struct scan dscans[MAXCOMP];
+	unsigned char quant[4][64];
+	struct dec_hufftbl dhuff[4];
+	PREC dquant[3][64];
+	struct jpeg_state st;
+
+	unsigned data_ofs;	/* input position, relative to image data */
+	unsigned data_len;	/* image data size */
+
+	/* gfx_jpeg_run(): job j starts at MCU j * job_mcus, input offset job_ofs[j] */
+	unsigned job_ofs[JPEG_JOBS];
+	int job_mcus;
+	uint8_t *job_buf, *job_pic;
+
+	int x0, x1, y0, y1;	/* output area */
+	int color_bits;
+	int scale;
+	int mcu_shift;		/* MCU size in output pixels: 1 << mcu_shift */
+	int n;			/* samples per 8x8 block */
+	int mcusx, mcusy;
+	int mx0, mx1, my0, my1;	/* MCUs in output area, inclusive */
+	int my;			/* next MCU row */
+	int err;
+};
 
-static struct in in;
+#define dec_huffdc(jc) ((jc)->dhuff + 0)
+#define dec_huffac(jc) ((jc)->dhuff + 2)
 
-static int readtables(int till)
+static int readtables(jpeg_ctx_t *jc, int till)
 {
+	struct in *in = &jc->in;
 	int m, l, i, j, lq, pq, tq;
 	int tc, th, tt;
 
 	for (;;) {
-		if (getbyte() != 0xff)
+		if (getbyte(in) != 0xff)
 			return -1;
-		if ((m = getbyte()) == till)
+		if ((m = getbyte(in)) == till)
 			break;
 
 		switch (m) {
@@ -179,9 +242,9 @@ static int readtables(int till)
 			return 0;
 
 		case M_DQT:
-			lq = getword();
+			lq = getword(in);
 			while (lq > 2) {
-				pq = getbyte();
+				pq = getbyte(in);
 				tq = pq & 15;
 				if (tq > 3)
 					return -1;
@@ -189,224 +252,472 @@ static int readtables(int till)
 				if (pq != 0)
 					return -1;
 				for (i = 0; i < 64; i++)
-					quant[tq][i] = getbyte();
+					jc->quant[tq][i] = getbyte(in);
 				lq -= 64 + 1;
 			}
 			break;
 
 		case M_DHT:
-			l = getword();
+			l = getword(in);
 			while (l > 2) {
 				int hufflen[16], k;
 				unsigned char huffvals[256];
 
-				tc = getbyte();
+				tc = getbyte(in);
 				th = tc & 15;
 				tc >>= 4;
 				tt = tc * 2 + th;
 				if (tc > 1 || th > 1)
 					return -1;
 				for (i = 0; i < 16; i++)
-					hufflen[i] = getbyte();
+					hufflen[i] = getbyte(in);
 				l -= 1 + 16;
 				k = 0;
 				for (i = 0; i < 16; i++) {
 					for (j = 0; j < hufflen[i]; j++)
-						huffvals[k++] = getbyte();
+						huffvals[k++] = getbyte(in);
 					l -= hufflen[i];
 				}
-				dec_makehuff(dhuff + tt, hufflen,
+				dec_makehuff(jc->dhuff + tt, hufflen,
 					     huffvals);
 			}
 			break;
 
 		case M_DRI:
-			l = getword();
-			info.dri = getword();
+			l = getword(in);
+			jc->info.dri = getword(in);
 			break;
 
 		default:
-			l = getword();
+			l = getword(in);
 			while (l-- > 2)
-				getbyte();
+				getbyte(in);
 			break;
 		}
 	}
 	return 0;
 }
 
-static void dec_initscans(void)
+static void dec_initscans(jpeg_ctx_t *jc, struct jpeg_state *st)
 {
 	int i;
 
-	for (i = 0; i < info.ns; i++)
-		dscans[i].dc = 0;
+	for (i = 0; i < jc->info.ns; i++)
+		st->dscans[i].dc = 0;
+}
+
+/*
+ * Size of decoder context.
+ */
+unsigned gfx_jpeg_ctx_size(void)
+{
+	return sizeof (jpeg_ctx_t);
 }
 
-int gfx_jpeg_decode(uint8_t *buf, uint8_t *pic, int x0, int x1, int y0, int y1, int color_bits)
+/*
+ * Set up decoder context jc to decode image area x0..x1, y0..y1
+ * (exclusive).
+ *
+ * buf, len: JPEG image data.
+ *
+ * scale: decode image at size 1 / 2^scale (scale = 0..3); the area
+ * coordinates refer to the scaled image.
+ *
+ * Scaled images use reduced IDCTs (4x4, 2x2, DC only) and never
+ * produce the full size image.
+ *
+ * Return 0 or error code.
+ */
+int gfx_jpeg_init(jpeg_ctx_t *jc, uint8_t *buf, unsigned len, int x0, int x1, int y0, int y1, int color_bits, int scale)
 {
+	struct in *in = &jc->in;
 	int i, j, m, tac, tdc;
-	int mcusx, mcusy, mx, my;
-	int max[6];
 	int width, height;
-	int mx0, mx1, my0, my1;
-
-	datap = buf;
-	if (getbyte() != 0xff)
-		return ERR_NO_SOI;
-	if (getbyte() != M_SOI)
-		return ERR_NO_SOI;
-	if (readtables(M_SOF0))
-		return ERR_BAD_TABLES;
-        if(info.dri) return ERR_WRONG_MARKER;
-
-	getword();
-	i = getbyte();
+
+	memset(jc, 0, sizeof *jc);
+
+	jc->x0 = x0;
+	jc->x1 = x1;
+	jc->y0 = y0;
+	jc->y1 = y1;
+	jc->color_bits = color_bits;
+	jc->scale = scale;
+
+	in->data = buf;
+	in->end = buf + len;
+	jc->data_len = len;
+
+	if (scale < 0 || scale > 3)
+		return jc->err = ERR_BAD_WIDTH_OR_HEIGHT;
+
+	/* MCU size in output pixels; n: samples per 8x8 block */
+	jc->mcu_shift = 4 - scale;
+	jc->n = 8 >> scale;
+
+	if (getbyte(in) != 0xff)
+		return jc->err = ERR_NO_SOI;
+	if (getbyte(in) != M_SOI)
+		return jc->err = ERR_NO_SOI;
+	if (readtables(jc, M_SOF0))
+		return jc->err = ERR_BAD_TABLES;
+
+	getword(in);
+	i = getbyte(in);
 	if (i != 8)
-		return ERR_NOT_8BIT;
+		return jc->err = ERR_NOT_8BIT;
 
-	height = getword();
-	width =  getword();
+	height = getword(in);
+	width =  getword(in);
 
-	info.nc = getbyte();
-	if (info.nc > MAXCOMP)
-		return ERR_TOO_MANY_COMPPS;
-	for (i = 0; i < info.nc; i++) {
+	jc->info.nc = getbyte(in);
+	if (jc->info.nc > MAXCOMP)
+		return jc->err = ERR_TOO_MANY_COMPPS;
+	for (i = 0; i < jc->info.nc; i++) {
 		int h, v;
-		comps[i].cid = getbyte();
-		comps[i].hv = getbyte();
-		v = comps[i].hv & 15;
-		h = comps[i].hv >> 4;
-		comps[i].tq = getbyte();
+		jc->comps[i].cid = getbyte(in);
+		jc->comps[i].hv = getbyte(in);
+		v = jc->comps[i].hv & 15;
+		h = jc->comps[i].hv >> 4;
+		jc->comps[i].tq = getbyte(in);
 		if (h > 3 || v > 3)
-			return ERR_ILLEGAL_HV;
-		if (comps[i].tq > 3)
-			return ERR_QUANT_TABLE_SELECTOR;
+			return jc->err = ERR_ILLEGAL_HV;
+		if (jc->comps[i].tq > 3)
+			return jc->err = ERR_QUANT_TABLE_SELECTOR;
 	}
-	if (readtables(M_SOS))
-		return ERR_BAD_TABLES;
-	getword();
-	info.ns = getbyte();
-	if (info.ns != 3)
-		return ERR_NOT_YCBCR_221111;
+	if (readtables(jc, M_SOS))
+		return jc->err = ERR_BAD_TABLES;
+	getword(in);
+	jc->info.ns = getbyte(in);
+	if (jc->info.ns != 3)
+		return jc->err = ERR_NOT_YCBCR_221111;
 	for (i = 0; i < 3; i++) {
-		dscans[i].cid = getbyte();
-		tdc = getbyte();
+		jc->dscans[i].cid = getbyte(in);
+		tdc = getbyte(in);
 		tac = tdc & 15;
 		tdc >>= 4;
 		if (tdc > 1 || tac > 1)
-			return ERR_QUANT_TABLE_SELECTOR;
-		for (j = 0; j < info.nc; j++)
-			if (comps[j].cid == dscans[i].cid)
+			return jc->err = ERR_QUANT_TABLE_SELECTOR;
+		for (j = 0; j < jc->info.nc; j++)
+			if (jc->comps[j].cid == jc->dscans[i].cid)
 				break;
-		if (j == info.nc)
-			return ERR_UNKNOWN_CID_IN_SCAN;
-		dscans[i].hv = comps[j].hv;
-		dscans[i].tq = comps[j].tq;
-		dscans[i].hudc.dhuff = dec_huffdc + tdc;
-		dscans[i].huac.dhuff = dec_huffac + tac;
+		if (j == jc->info.nc)
+			return jc->err = ERR_UNKNOWN_CID_IN_SCAN;
+		jc->dscans[i].hv = jc->comps[j].hv;
+		jc->dscans[i].tq = jc->comps[j].tq;
+		jc->dscans[i].hudc.dhuff = dec_huffdc(jc) + tdc;
+		jc->dscans[i].huac.dhuff = dec_huffac(jc) + tac;
 	}
 	
-	i = getbyte();
-	j = getbyte();
-	m = getbyte();
+	i = getbyte(in);
+	j = getbyte(in);
+	m = getbyte(in);
 	
 	if (i != 0 || j != 63 || m != 0)
-		return ERR_NOT_SEQUENTIAL_DCT;
+		return jc->err = ERR_NOT_SEQUENTIAL_DCT;
 	
-	if (dscans[0].cid != 1 || dscans[1].cid != 2 || dscans[2].cid != 3)
-		return ERR_NOT_YCBCR_221111;
+	if (jc->dscans[0].cid != 1 || jc->dscans[1].cid != 2 || jc->dscans[2].cid != 3)
+		return jc->err = ERR_NOT_YCBCR_221111;
 
-	if (dscans[0].hv != 0x22 || dscans[1].hv != 0x11 || dscans[2].hv != 0x11)
-		return ERR_NOT_YCBCR_221111;
+	if (jc->dscans[0].hv != 0x22 || jc->dscans[1].hv != 0x11 || jc->dscans[2].hv != 0x11)
+		return jc->err = ERR_NOT_YCBCR_221111;
 
-	mcusx = (width + 15) >> 4;
-	mcusy = (height + 15) >> 4;
+	jc->mcusx = (width + 15) >> 4;
+	jc->mcusy = (height + 15) >> 4;
 
-	mx0 = x0 >> 4;
-	my0 = y0 >> 4;
+	jc->mx0 = x0 >> jc->mcu_shift;
+	jc->my0 = y0 >> jc->mcu_shift;
 
 	/* inclusive! */
-	mx1 = ((x1 + 15) >> 4) - 1;
-	my1 = ((y1 + 15) >> 4) - 1;
-
-        if(my1 < mcusy) mcusy = my1 + 1;
-
-	idctqtab(quant[dscans[0].tq], decdata.dquant[0]);
-	idctqtab(quant[dscans[1].tq], decdata.dquant[1]);
-	idctqtab(quant[dscans[2].tq], decdata.dquant[2]);
-	initcol(decdata.dquant);
-	setinput(&in);
-
-	dec_initscans();
-
-	dscans[0].next = 6 - 4;
-	dscans[1].next = 6 - 4 - 1;
-	dscans[2].next = 6 - 4 - 1 - 1;	/* 411 encoding */
-	for (my = 0; my < mcusy; my++) {
-		for (mx = 0; mx < mcusx; mx++) {
-			decode_mcus(&in, decdata.dcts, 6, dscans, max);
-
-			if(
-			  my >= my0 && my <= my1 &&
-			  mx >= mx0 && mx <= mx1
-			) {
-				int i0, i1, j0, j1, yofs;
-
-				idct(decdata.dcts,       decdata.out,       decdata.dquant[0], IFIX(128.5), max[0]);
-				idct(decdata.dcts +  64, decdata.out +  64, decdata.dquant[0], IFIX(128.5), max[1]);
-				idct(decdata.dcts + 128, decdata.out + 128, decdata.dquant[0], IFIX(128.5), max[2]);
-				idct(decdata.dcts + 192, decdata.out + 192, decdata.dquant[0], IFIX(128.5), max[3]);
-				idct(decdata.dcts + 256, decdata.out + 256, decdata.dquant[1], IFIX(0.5),   max[4]);
-				idct(decdata.dcts + 320, decdata.out + 320, decdata.dquant[2], IFIX(0.5),   max[5]);
-
-                                // color_bits * 2: actually 16 * (color_bits / 8)
-                                col221111(decdata.out, tmp_img, color_bits * 2, color_bits);
-
-                                j0 = my == my0 ? y0 - 16 * my : 0;
-                                j1 = my == my1 ? y1 - 16 * my : 16;
-                                for(j = j0; j < j1; j++) {
-                                  yofs = (16 * my - y0 + j) * (x1 - x0);
-                                  i0 = mx == mx0 ? x0 - 16 * mx : 0;
-                                  i1 = mx == mx1 ? x1 - 16 * mx : 16;
-
-                                  switch(color_bits) {
-                                    case 8:
-                                      for(i = i0; i < i1; i++) {
-                                        *((unsigned char *) pic + 16 * mx - x0 + i + yofs) =
-                                        *((unsigned char *) tmp_img + 16 * j + i);
-                                      }
-                                      break;
-
-                                    case 16:
-                                      for(i = i0; i < i1; i++) {
-                                        *((unsigned short *) pic + 16 * mx - x0 + i + yofs) =
-                                        *((unsigned short *) tmp_img + 16 * j + i);
-                                      }
-                                      break;
-
-                                    case 32:
-                                      for(i = i0; i < i1; i++) {
-                                        *((unsigned *) pic + 16 * mx - x0 + i + yofs) =
-                                        *((unsigned *) tmp_img + 16 * j + i);
-                                      }
-                                      break;
-                                  }
-                                }
+	jc->mx1 = ((x1 + (1 << jc->mcu_shift) - 1) >> jc->mcu_shift) - 1;
+	jc->my1 = ((y1 + (1 << jc->mcu_shift) - 1) >> jc->mcu_shift) - 1;
+
+        if(jc->my1 < jc->mcusy) jc->mcusy = jc->my1 + 1;
+
+	idctqtab(jc->quant[jc->dscans[0].tq], jc->dquant[0]);
+	idctqtab(jc->quant[jc->dscans[1].tq], jc->dquant[1]);
+	idctqtab(jc->quant[jc->dscans[2].tq], jc->dquant[2]);
+	initcol(jc->dquant);
+	setinput(in);
+
+	jc->dscans[0].next = 6 - 4;
+	jc->dscans[1].next = 6 - 4 - 1;
+	jc->dscans[2].next = 6 - 4 - 1 - 1;	/* 411 encoding */
+
+	jc->data_ofs = (unsigned char *) in->data - buf;
+
+	dec_initstate(jc, &jc->st);
+
+	return 0;
+}
+
+/*
+ * Prepare entropy decoding state for a new segment.
+ */
+static void dec_initstate(jpeg_ctx_t *jc, struct jpeg_state *st)
+{
+	int i;
+
+	setinput(&st->in);
+	for (i = 0; i < MAXCOMP; i++)
+		st->dscans[i] = jc->dscans[i];
+	dec_initscans(jc, st);
+	st->todo = jc->info.dri;
+}
+
+/*
+ * Skip to the next restart marker and reset the decoder.
+ *
+ * A missing marker is ignored.
+ */
+static void dec_restart(jpeg_ctx_t *jc, struct jpeg_state *st)
+{
+	unsigned char *p = st->in.data;
+
+	/* fillbits() never reads past a marker: usually p points to it */
+	while (p + 1 < st->in.end && !(p[0] == 0xff && p[1] != 0 && p[1] != 0xff))
+		p++;
+	if (p + 1 < st->in.end && (p[1] & 0xf8) == M_RST0)
+		p += 2;
+
+	setinput(&st->in);
+	st->in.data = p;
+	dec_initscans(jc, st);
+	st->todo = jc->info.dri;
+}
+
+/*
+ * Decode MCUs m0 .. m1 - 1 (in raster order) into pic.
+ */
+static void dec_mcus(jpeg_ctx_t *jc, struct jpeg_state *st, uint8_t *pic, int m0, int m1)
+{
+	struct jpeg_decdata *decdata = &st->decdata;
+	unsigned char *tmp_img = st->tmp_img;
+	int i, j, m, mx, my;
+	int max[6];
+	int x0 = jc->x0, x1 = jc->x1, y0 = jc->y0, y1 = jc->y1;
+	int mx0 = jc->mx0, mx1 = jc->mx1, my0 = jc->my0, my1 = jc->my1;
+	int mcu_size = 1 << jc->mcu_shift;
+	int color_bits = jc->color_bits;
+	int bpp = color_bits >> 3;
+
+	for (m = m0; m < m1; m++) {
+		if (jc->info.dri) {
+			if (st->todo == 0)
+				dec_restart(jc, st);
+			st->todo--;
+		}
+
+		mx = m % jc->mcusx;
+		my = m / jc->mcusx;
+
+		decode_mcus(&st->in, decdata->dcts, 6, st->dscans, max);
+
+		if(
+		  my >= my0 && my <= my1 &&
+		  mx >= mx0 && mx <= mx1
+		) {
+			int i0, i1, j0, j1, yofs;
+			unsigned char *dst = tmp_img;
+			int width = mcu_size * bpp;
+
+			j0 = my == my0 ? y0 - mcu_size * my : 0;
+			j1 = my == my1 ? y1 - mcu_size * my : mcu_size;
+			i0 = mx == mx0 ? x0 - mcu_size * mx : 0;
+			i1 = mx == mx1 ? x1 - mcu_size * mx : mcu_size;
+
+			/* MCU completely inside output area: convert directly into pic */
+			if (j0 == 0 && j1 == mcu_size && i0 == 0 && i1 == mcu_size) {
+				width = (x1 - x0) * bpp;
+				dst = pic + (mcu_size * my - y0) * width + (mcu_size * mx - x0) * bpp;
+			}
+
+			if (jc->scale == 0) {
+				idct(decdata->dcts,       decdata->out,       jc->dquant[0], IFIX(128.5), max[0]);
+				idct(decdata->dcts +  64, decdata->out +  64, jc->dquant[0], IFIX(128.5), max[1]);
+				idct(decdata->dcts + 128, decdata->out + 128, jc->dquant[0], IFIX(128.5), max[2]);
+				idct(decdata->dcts + 192, decdata->out + 192, jc->dquant[0], IFIX(128.5), max[3]);
+				idct(decdata->dcts + 256, decdata->out + 256, jc->dquant[1], IFIX(0.5),   max[4]);
+				idct(decdata->dcts + 320, decdata->out + 320, jc->dquant[2], IFIX(0.5),   max[5]);
+
+#if defined(__SSE2__)
+				if (color_bits == 32)
+					col221111_32_sse2(decdata->out, dst, width);
+				else
+#endif
+				col221111(decdata->out, dst, width, color_bits);
+			} else {
+				for (i = 0; i < 6; i++)
+					idct_scaled(decdata->dcts + 64 * i, decdata->out + 64 * i,
+						    jc->dquant[i < 4 ? 0 : i - 3],
+						    i < 4 ? IFIX(128.5) : IFIX(0.5), max[i], jc->n);
+
+				col221111_scaled(decdata->out, dst, width, jc->n, color_bits);
 			}
+
+			if (dst != tmp_img)
+				continue;
+
+                        for(j = j0; j < j1; j++) {
+                          yofs = (mcu_size * my - y0 + j) * (x1 - x0);
+
+                          switch(color_bits) {
+                            case 8:
+                              for(i = i0; i < i1; i++) {
+                                *((unsigned char *) pic + mcu_size * mx - x0 + i + yofs) =
+                                *((unsigned char *) tmp_img + mcu_size * j + i);
+                              }
+                              break;
+
+                            case 16:
+                              for(i = i0; i < i1; i++) {
+                                *((unsigned short *) pic + mcu_size * mx - x0 + i + yofs) =
+                                *((unsigned short *) tmp_img + mcu_size * j + i);
+                              }
+                              break;
+
+                            case 32:
+                              for(i = i0; i < i1; i++) {
+                                *((unsigned *) pic + mcu_size * mx - x0 + i + yofs) =
+                                *((unsigned *) tmp_img + mcu_size * j + i);
+                              }
+                              break;
+                          }
+                        }
 		}
 	}
-	
+}
+
+/*
+ * Decode up to 'rows' MCU rows into pic.
+ *
+ * buf and pic are the image data passed to gfx_jpeg_init() and the output
+ * buffer.
+ *
+ * Return number of MCU rows still to decode (0 = done), or -1 on error
+ * (see gfx_jpeg_finish()).
+ */
+int gfx_jpeg_step(jpeg_ctx_t *jc, uint8_t *buf, uint8_t *pic, int rows)
+{
+	int my;
+
+	if (jc->err)
+		return -1;
+
+	my = jc->my + rows;
+	if (my > jc->mcusy)
+		my = jc->mcusy;
+
+	jc->st.in.data = buf + jc->data_ofs;
+	jc->st.in.end = buf + jc->data_len;
+
+	dec_mcus(jc, &jc->st, pic, jc->my * jc->mcusx, my * jc->mcusx);
+
+	jc->my = my;
+	jc->data_ofs = (unsigned char *) jc->st.in.data - buf;
+
+	return jc->mcusy - my;
+}
+
+/*
+ * Decode the remaining image into pic.
+ *
+ * If the image has restart markers and decoding has not started yet,
+ * the restart intervals are grouped into up to JPEG_JOBS jobs that are
+ * run via gfxboot_sys_parallel(). Else this is just gfx_jpeg_step()
+ * for all rows.
+ *
+ * Return value as for gfx_jpeg_step().
+ */
+int gfx_jpeg_run(jpeg_ctx_t *jc, uint8_t *buf, uint8_t *pic)
+{
+	unsigned char *p, *end;
+	int mcus, segs, jobs, seg_per_job, rst, j;
+
+	if (jc->err)
+		return -1;
+
+	mcus = jc->mcusx * jc->mcusy;
+	segs = jc->info.dri ? (mcus + jc->info.dri - 1) / jc->info.dri : 0;
+
+	if (jc->my || segs < 2)
+		return gfx_jpeg_step(jc, buf, pic, jc->mcusy);
+
+	jobs = segs < JPEG_JOBS ? segs : JPEG_JOBS;
+	seg_per_job = (segs + jobs - 1) / jobs;
+	jobs = (segs + seg_per_job - 1) / seg_per_job;
+
+	/* find job start offsets: after every seg_per_job-th restart marker */
+	jc->job_ofs[0] = jc->data_ofs;
+	p = buf + jc->data_ofs;
+	end = buf + jc->data_len;
+	for (j = 1, rst = 0; j < jobs && p + 1 < end; p++) {
+		if (p[0] == 0xff && (p[1] & 0xf8) == M_RST0) {
+			if (++rst == j * seg_per_job)
+				jc->job_ofs[j++] = p + 2 - buf;
+			p++;
+		}
+	}
+
+	/* markers missing: leave it to gfx_jpeg_step() */
+	if (j < jobs)
+		return gfx_jpeg_step(jc, buf, pic, jc->mcusy);
+
+	jc->job_mcus = seg_per_job * jc->info.dri;
+	jc->job_buf = buf;
+	jc->job_pic = pic;
+
+	gfxboot_sys_parallel(dec_job, jc, jobs);
+
+	jc->job_buf = jc->job_pic = 0;
+	jc->my = jc->mcusy;
+	jc->data_ofs = jc->data_len;
+
 	return 0;
 }
 
+/*
+ * Decode job 'idx' (see gfx_jpeg_run()).
+ *
+ * Jobs may run concurrently: the context is only read, all decoding state
+ * is local.
+ */
+static void dec_job(void *data, unsigned idx)
+{
+	jpeg_ctx_t *jc = data;
+	struct jpeg_state st;
+	int m0 = idx * jc->job_mcus, m1 = m0 + jc->job_mcus;
+
+	if (m1 > jc->mcusx * jc->mcusy)
+		m1 = jc->mcusx * jc->mcusy;
+
+	dec_initstate(jc, &st);
+	st.in.data = jc->job_buf + jc->job_ofs[idx];
+	st.in.end = jc->job_buf + jc->data_len;
+
+	dec_mcus(jc, &st, jc->job_pic, m0, m1);
+}
+
+/*
+ * Finish decoding.
+ *
+ * Return 0 if the image has been decoded completely, else error code.
+ */
+int gfx_jpeg_finish(jpeg_ctx_t *jc)
+{
+	if (jc->err)
+		return jc->err;
+
+	return jc->my < jc->mcusy ? ERR_INCOMPLETE : 0;
+}
+
+
 /****************************************************************/
 /**************       huffman decoder             ***************/
 /****************************************************************/
 
-static int fillbits __P((struct in *, int, unsigned int));
+static int fillbits __P((struct in *, int, uint64_t));
 static int dec_rec2
-__P((struct in *, struct dec_hufftbl *, int *, int, int));
+__P((struct in *, struct dec_hufftbl *, int *, int));
 
 static void setinput(in)
 struct in *in;
@@ -416,34 +727,66 @@ struct in *in;
 	in->marker = 0;
 }
 
+/*
+ * Refill bit reservoir to at least 32 bits.
+ *
+ * Usually loads 8 bytes at once; byte stuffing, markers, and the end of
+ * the data are handled byte by byte. After a marker (or the end of the
+ * data) zero bits are supplied.
+ */
 static int fillbits(in, le, bi)
 struct in *in;
 int le;
-unsigned int bi;
+uint64_t bi;
 {
-	int b, m;
+	unsigned char *p = in->data;
+	uint64_t v, x;
+	int b, k;
 
 	if (in->marker) {
-		if (le <= 16)
-			in->bits = bi << 16, le += 16;
+		if (le <= 32)
+			in->bits = bi << 32, le += 32;
 		return le;
 	}
-	while (le <= 24) {
-		b = getbyte();
-		if (b == 0xff && (m = getbyte()) != 0) {
-			in->marker = m;
-			if (le <= 16)
-				bi = bi << 16, le += 16;
+
+	/* fast path: no 0xff in the next k bytes */
+	k = (63 - le) >> 3;
+	if (in->end - p >= 8) {
+		__builtin_memcpy(&v, p, 8);
+		v = __builtin_bswap64(v) >> (64 - 8 * k);
+		x = ~v;
+		if (!((x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull)) {
+			in->data = p + k;
+			in->bits = bi << (8 * k) | v;
+			return le + 8 * k;
+		}
+	}
+
+	while (le <= 56) {
+		if (p >= in->end) {
+			in->marker = M_EOF;
 			break;
 		}
+		b = *p++;
+		if (b == 0xff) {
+			if (p >= in->end || *p != 0) {
+				in->marker = p < in->end ? *p : M_EOF;
+				p--;
+				break;
+			}
+			p++;
+		}
 		bi = bi << 8 | b;
 		le += 8;
 	}
+	if (in->marker && le <= 32)
+		bi = bi << 32, le += 32;
+	in->data = p;
 	in->bits = bi;		/* tmp... 2 return values needed */
 	return le;
 }
 
-#define LEBI_DCL	int le, bi
+#define LEBI_DCL	int le; uint64_t bi
 #define LEBI_GET(in)	(le = in->left, bi = in->bits)
 #define LEBI_PUT(in)	(in->left = le, in->bits = bi)
 
@@ -458,29 +801,27 @@ unsigned int bi;
 )
 
 
-static int dec_rec2(in, hu, runp, c, i)
+/*
+ * Slow path for codes longer than DECBITS.
+ */
+static int dec_rec2(in, hu, runp, c)
 struct in *in;
 struct dec_hufftbl *hu;
 int *runp;
-int c, i;
+int c;
 {
+	int i;
 	LEBI_DCL;
 
 	LEBI_GET(in);
-	if (i) {
-		UNGETBITS(in, i & 127);
-		*runp = i >> 8 & 15;
-		i >>= 16;
-	} else {
-		for (i = DECBITS; (c = ((c << 1) | GETBITS(in, 1))) >= (hu->maxcode[i]); i++);
-		if (i >= 16) {
-			in->marker = M_BADHUFF;
-			return 0;
-		}
-		i = hu->vals[hu->valptr[i] + c - hu->maxcode[i - 1] * 2];
-		*runp = i >> 4;
-		i &= 15;
+	for (i = DECBITS; (c = ((c << 1) | GETBITS(in, 1))) >= (hu->maxcode[i]); i++);
+	if (i >= 16) {
+		in->marker = M_BADHUFF;
+		return 0;
 	}
+	i = hu->vals[hu->valptr[i] + c - hu->maxcode[i - 1] * 2];
+	*runp = i >> 4;
+	i &= 15;
 	if (i == 0) {		/* sigh, 0xf0 is 11 bit */
 		LEBI_PUT(in);
 		return 0;
@@ -488,12 +829,19 @@ int c, i;
 	/* receive part */
 	c = GETBITS(in, i);
 	if (c < (1 << (i - 1)))
-		c += (-1 << i) + 1;
+		c -= (1 << i) - 1;
 	LEBI_PUT(in);
 	return c;
 }
 
-#define DEC_REC(in, hu, r, i)	 (	\
+/*
+ * Decode one value (run in r, s is a temporary).
+ *
+ * With at least 32 bits in the reservoir a table hit (code up to DECBITS,
+ * value up to 11 bits) needs no further refill.
+ */
+#define DEC_REC(in, hu, r, i, s) (	\
+  (le < 32 ? le = fillbits(in, le, bi), bi = in->bits : 0),	\
   r = GETBITS(in, DECBITS),		\
   i = hu->llvals[r],			\
   i & 128 ?				\
@@ -502,10 +850,18 @@ int c, i;
       r = i >> 8 & 15,			\
       i >> 16				\
     )					\
+  : i ?					\
+    (					\
+      UNGETBITS(in, i & 127),		\
+      r = i >> 8 & 15,			\
+      s = i >> 16,			\
+      i = bi >> (le -= s) & ((1 << s) - 1),	\
+      i < (1 << (s - 1)) ? i - (1 << s) + 1 : i	\
+    )					\
   :					\
     (					\
       LEBI_PUT(in),			\
-      i = dec_rec2(in, hu, &r, r, i),	\
+      i = dec_rec2(in, hu, &r, r),	\
       LEBI_GET(in),			\
       i					\
     )					\
@@ -519,19 +875,19 @@ struct scan *sc;
 int *maxp;
 {
 	struct dec_hufftbl *hu;
-	int i, r, t;
+	int i, r, s, t;
 	LEBI_DCL;
 
 	memset(dct, 0, n * 64 * sizeof(*dct));
 	LEBI_GET(in);
 	while (n-- > 0) {
 		hu = sc->hudc.dhuff;
-		*dct++ = (sc->dc += DEC_REC(in, hu, r, t));
+		*dct++ = (sc->dc += DEC_REC(in, hu, r, t, s));
 
 		hu = sc->huac.dhuff;
 		i = 63;
 		while (i > 0) {
-			t = DEC_REC(in, hu, r, t);
+			t = DEC_REC(in, hu, r, t, s);
 			if (t == 0 && r == 0) {
 				dct += i;
 				break;
@@ -673,6 +1029,11 @@ int max;
 			out[i] = ITOINT(t0);
 		return;
 	}
+#if defined(__SSE2__)
+	if (!idct_avx2(in, out, quant, off))
+		idct_sse2(in, out, quant, off);
+	return;
+#endif
 	zig2p = zig2;
 	tmpp = tmp;
 	for (i = 0; i < 8; i++) {
@@ -725,6 +1086,319 @@ int max;
 	}
 }
 
+#if defined(__SSE2__)
+/*
+ * Vectorized idct().
+ *
+ * Same arithmetic as the scalar version (32 bit, ISHIFT fixed point), so
+ * the results are identical. Each vector holds one row of the block; the
+ * columns are handled by transposing.
+ *
+ * Coefficient order for the first pass: zig2 with rows and columns
+ * swapped and the rows in t0 .. t7 order.
+ */
+static unsigned char zig2t[64] = {
+	0, 14, 5, 27, 15, 1, 28, 6,
+	10, 39, 23, 52, 45, 19, 54, 32,
+	3, 25, 12, 41, 30, 8, 43, 17,
+	21, 50, 37, 59, 56, 34, 61, 47,
+	20, 46, 33, 55, 51, 22, 60, 38,
+	2, 16, 7, 29, 26, 4, 42, 13,
+	35, 57, 48, 62, 58, 36, 63, 49,
+	9, 31, 18, 44, 40, 11, 53, 24
+};
+
+/* IDCT on v[0] .. v[7]; needs V_TYPE, V_ADD, V_SUB, V_MUL */
+#define V_XPP(a, b) (t = V_ADD(v[a], v[b]), v[b] = V_SUB(v[a], v[b]), v[a] = t)
+#define V_XMP(a, b) (t = V_SUB(v[a], v[b]), v[b] = V_ADD(v[a], v[b]), v[a] = t)
+
+#define IDCT_VEC(v)					\
+do {							\
+  V_TYPE t;						\
+  V_XPP(0, 1);						\
+  V_XMP(2, 3);						\
+  v[2] = V_SUB(V_MUL(v[2], IC4), v[3]);			\
+  V_XPP(0, 3);						\
+  V_XPP(1, 2);						\
+  V_XMP(4, 7);						\
+  V_XPP(5, 6);						\
+  V_XMP(5, 7);						\
+  v[5] = V_MUL(v[5], IC4);				\
+  t = V_MUL(V_ADD(v[4], v[6]), S22);			\
+  v[4] = V_ADD(V_MUL(v[4], C22 - S22), t);		\
+  v[6] = V_SUB(V_MUL(v[6], C22 + S22), t);		\
+  v[6] = V_SUB(v[6], v[7]);				\
+  v[5] = V_SUB(v[5], v[6]);				\
+  v[4] = V_SUB(v[4], v[5]);				\
+  V_XPP(0, 7);						\
+  V_XPP(1, 6);						\
+  V_XPP(2, 5);						\
+  V_XPP(3, 4);						\
+} while(0)
+
+static inline __m128i idct_mul_sse2(__m128i a, int c)
+{
+  __m128i b = _mm_set1_epi32(c);
+
+#if defined(__SSE4_1__)
+  a = _mm_mullo_epi32(a, b);
+#else
+  __m128i p02 = _mm_mul_epu32(a, b);
+  __m128i p13 = _mm_mul_epu32(_mm_srli_epi64(a, 32), b);
+
+  a = _mm_unpacklo_epi32(_mm_shuffle_epi32(p02, 0x08), _mm_shuffle_epi32(p13, 0x08));
+#endif
+
+  return _mm_srai_epi32(a, ISHIFT);
+}
+
+/* transpose 8x8 matrix, stored as src[row * 2 + half] */
+static inline void idct_transpose_sse2(__m128i *dst, __m128i *src)
+{
+  int i, j;
+
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < 2; j++) {
+      __m128i a = src[(4 * i + 0) * 2 + j];
+      __m128i b = src[(4 * i + 1) * 2 + j];
+      __m128i c = src[(4 * i + 2) * 2 + j];
+      __m128i d = src[(4 * i + 3) * 2 + j];
+      __m128i t0 = _mm_unpacklo_epi32(a, b);
+      __m128i t1 = _mm_unpacklo_epi32(c, d);
+      __m128i t2 = _mm_unpackhi_epi32(a, b);
+      __m128i t3 = _mm_unpackhi_epi32(c, d);
+
+      dst[(4 * j + 0) * 2 + i] = _mm_unpacklo_epi64(t0, t1);
+      dst[(4 * j + 1) * 2 + i] = _mm_unpackhi_epi64(t0, t1);
+      dst[(4 * j + 2) * 2 + i] = _mm_unpacklo_epi64(t2, t3);
+      dst[(4 * j + 3) * 2 + i] = _mm_unpackhi_epi64(t2, t3);
+    }
+  }
+}
+
+static void idct_sse2(int *in, int *out, PREC *quant, PREC off)
+{
+  __m128i m[16], m_t[16], v[8];
+  int *d = (int *) m;
+  int i, j;
+
+  for (i = 0; i < 64; i++) {
+    j = zig2t[i];
+    d[i] = in[j] * quant[j];
+  }
+  d[0] += off;
+
+#define V_TYPE		__m128i
+#define V_ADD(a, b)	_mm_add_epi32(a, b)
+#define V_SUB(a, b)	_mm_sub_epi32(a, b)
+#define V_MUL(a, c)	idct_mul_sse2(a, c)
+
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < 8; i++) v[i] = m[i * 2 + j];
+    IDCT_VEC(v);
+    for (i = 0; i < 8; i++) m[i * 2 + j] = v[i];
+  }
+
+  idct_transpose_sse2(m_t, m);
+
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < 8; i++) v[i] = m_t[i * 2 + j];
+    IDCT_VEC(v);
+    for (i = 0; i < 8; i++) m_t[i * 2 + j] = _mm_srai_epi32(v[i], ISHIFT);
+  }
+
+  idct_transpose_sse2(m, m_t);
+
+  for (i = 0; i < 16; i++) _mm_storeu_si128((__m128i *) out + i, m[i]);
+
+#undef V_TYPE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+}
+
+__attribute__ ((target ("avx2")))
+static inline void idct_transpose_avx2(__m256i *r)
+{
+  __m256i t[8], u[8];
+  int i;
+
+  for (i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+  }
+
+  for (i = 0; i < 8; i += 4) {
+    u[i + 0] = _mm256_unpacklo_epi64(t[i + 0], t[i + 2]);
+    u[i + 1] = _mm256_unpackhi_epi64(t[i + 0], t[i + 2]);
+    u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+    u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+  }
+
+  for (i = 0; i < 4; i++) {
+    r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+    r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+  }
+}
+
+/*
+ * Same as idct_sse2(), a full row per vector.
+ *
+ * Return 0 if the CPU has no AVX2.
+ */
+__attribute__ ((target ("avx2")))
+static int idct_avx2(int *in, int *out, PREC *quant, PREC off)
+{
+  static int has_avx2 = -1;
+  __m256i v[8];
+  int d[64] __attribute__ ((aligned (32)));
+  int i, j;
+
+  // may run in several threads (see gfx_jpeg_run())
+  int avx2 = __atomic_load_n(&has_avx2, __ATOMIC_RELAXED);
+
+  if (avx2 < 0) {
+    avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    __atomic_store_n(&has_avx2, avx2, __ATOMIC_RELAXED);
+  }
+
+  if (!avx2) return 0;
+
+  for (i = 0; i < 64; i++) {
+    j = zig2t[i];
+    d[i] = in[j] * quant[j];
+  }
+  d[0] += off;
+
+#define V_TYPE		__m256i
+#define V_ADD(a, b)	_mm256_add_epi32(a, b)
+#define V_SUB(a, b)	_mm256_sub_epi32(a, b)
+#define V_MUL(a, c)	_mm256_srai_epi32(_mm256_mullo_epi32(a, _mm256_set1_epi32(c)), ISHIFT)
+
+  for (i = 0; i < 8; i++) v[i] = _mm256_load_si256((__m256i *) d + i);
+  IDCT_VEC(v);
+  idct_transpose_avx2(v);
+  IDCT_VEC(v);
+  for (i = 0; i < 8; i++) v[i] = _mm256_srai_epi32(v[i], ISHIFT);
+  idct_transpose_avx2(v);
+  for (i = 0; i < 8; i++) _mm256_storeu_si256((__m256i *) out + i, v[i]);
+
+#undef V_TYPE
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+
+  return 1;
+}
+
+#undef IDCT_VEC
+#undef V_XPP
+#undef V_XMP
+#endif
+
+/*
+ * Reduced IDCT weights.
+ *
+ * Averaging 2 (4) neighbouring samples of the 8 point IDCT is approximated
+ * by evaluating it between them, which is an n point IDCT over the first
+ * n coefficients. The AAN scale factors already applied to the quantization
+ * table (see idctqtab()) are divided out again.
+ *
+ * weight(u, k) = cos((2k + 1) * u * pi / 2n) / cos(u * pi / 16)
+ *
+ * For k and n - 1 - k the weights differ only in sign for odd u.
+ */
+#define W4_10 ((PREC)IFIX(0.941979403))
+#define W4_11 ((PREC)IFIX(0.390180644))
+#define W4_20 ((PREC)IFIX(0.765366865))
+#define W4_30 ((PREC)IFIX(0.460249451))
+#define W4_31 ((PREC)IFIX(-1.111140466))
+#define W2_10 ((PREC)IFIX(0.720959822))
+
+#define IDCT4(t0, t1, t2, t3)		\
+(					\
+  t = IMULT(t2, W4_20),			\
+  t2 = t0 - t,				\
+  t0 += t,				\
+  t = IMULT(t1, W4_10) + IMULT(t3, W4_30),	\
+  t3 = IMULT(t1, W4_11) + IMULT(t3, W4_31),	\
+  t1 = t2 + t3,				\
+  t2 -= t3,				\
+  t3 = t0 - t,				\
+  t0 += t				\
+)
+
+#define IDCT2(t0, t1)		\
+(				\
+  t = IMULT(t1, W2_10),		\
+  t1 = t0 - t,			\
+  t0 += t			\
+)
+
+static unsigned char zig[64];
+
+/*
+ * n x n IDCT (n = 4, 2, 1) for scaled decoding.
+ *
+ * out is stored with a row length of n.
+ */
+static void idct_scaled(int *in, int *out, PREC *quant, PREC off, int max, int n)
+{
+  PREC tmp[16], t, t0, t1, t2, t3;
+  int i;
+
+#define Q(i, j) (in[zig[(i) * 8 + (j)]] * quant[zig[(i) * 8 + (j)]])
+
+  if(max == 1 || n == 1) {
+    t = ITOINT(off + in[0] * quant[0]);
+    for(i = 0; i < n * n; i++) out[i] = t;
+    return;
+  }
+
+  if(n == 2) {
+    for(i = 0; i < 2; i++) {
+      t0 = Q(i, 0);
+      t1 = Q(i, 1);
+      IDCT2(t0, t1);
+      tmp[i * 2 + 0] = t0;
+      tmp[i * 2 + 1] = t1;
+    }
+    for(i = 0; i < 2; i++) {
+      t0 = tmp[i] + off;
+      t1 = tmp[2 + i];
+      IDCT2(t0, t1);
+      out[i] = ITOINT(t0);
+      out[2 + i] = ITOINT(t1);
+    }
+    return;
+  }
+
+  for(i = 0; i < 4; i++) {
+    t0 = Q(i, 0);
+    t1 = Q(i, 1);
+    t2 = Q(i, 2);
+    t3 = Q(i, 3);
+    IDCT4(t0, t1, t2, t3);
+    tmp[i * 4 + 0] = t0;
+    tmp[i * 4 + 1] = t1;
+    tmp[i * 4 + 2] = t2;
+    tmp[i * 4 + 3] = t3;
+  }
+  for(i = 0; i < 4; i++) {
+    t0 = tmp[i] + off;
+    t1 = tmp[4 + i];
+    t2 = tmp[8 + i];
+    t3 = tmp[12 + i];
+    IDCT4(t0, t1, t2, t3);
+    out[i] = ITOINT(t0);
+    out[4 + i] = ITOINT(t1);
+    out[8 + i] = ITOINT(t2);
+    out[12 + i] = ITOINT(t3);
+  }
+
+#undef Q
+}
+
 static unsigned char zig[64] = {
 	0, 1, 5, 6, 14, 15, 27, 28,
 	2, 4, 7, 13, 16, 26, 29, 42,
@@ -822,7 +1496,8 @@ PREC q[][64];
   y = outy[(yin) * 8 + xin],			\
   STORECLAMP(p[(xout) * 4 + 0], y + cb),	\
   STORECLAMP(p[(xout) * 4 + 1], y - cg),	\
-  STORECLAMP(p[(xout) * 4 + 2], y + cr)		\
+  STORECLAMP(p[(xout) * 4 + 2], y + cr),	\
+  p[(xout) * 4 + 3] = 0				\
 )
 
 #define PIC221111x(xin, xin_4, xin_3)			\
@@ -933,18 +1608,134 @@ static void col221111(int *out, unsigned char *pic, int width, int bits)
 }
 
 
+/*
+ * Color conversion for scaled decoding.
+ *
+ * The MCU is 2n x 2n pixels: four n x n luminance blocks and one n x n
+ * block for each chroma component (see idct_scaled()).
+ *
+ * width: bytes per output line.
+ */
+static void col221111_scaled(int *out, unsigned char *pic, int width, int n, int bits)
+{
+  static const unsigned dither[4] = { 3 * 0x55, 0 * 0x55, 1 * 0x55, 2 * 0x55 };
+  int x, y, i, cb, cr, cg, l, *outy, *outc;
+  unsigned char *p;
+
+  for(y = 0; y < 2 * n; y++) {
+    outy = out + (y >= n ? 128 : 0) + (y & (n - 1)) * n;
+    outc = out + 64 * 4 + (y >> 1) * n;
+    for(x = 0; x < 2 * n; x++) {
+      i = x & (n - 1);
+      l = (x >= n ? outy[64 + i] : outy[i]);
+      cb = outc[x >> 1];
+      cr = outc[64 + (x >> 1)];
+      cg = (50 * cb + 130 * cr + 128) >> 8;
+
+      switch(bits) {
+        case 8:
+          pic[x] = store_8(CLAMP(l + cr), CLAMP(l - cg), CLAMP(l + cb), dither[(y & 1) * 2 + (x & 1)]);
+          break;
+
+        case 16:
+          ((unsigned short *) pic)[x] = store_16(CLAMP(l + cr), CLAMP(l - cg), CLAMP(l + cb), dither[(y & 1) * 2 + (x & 1)]);
+          break;
+
+        case 32:
+          p = pic + x * 4;
+          STORECLAMP(p[0], l + cb);
+          STORECLAMP(p[1], l - cg);
+          STORECLAMP(p[2], l + cr);
+          p[3] = 0;
+          break;
+      }
+    }
+    pic += width;
+  }
+}
+
+
+#if defined(__SSE2__)
+/*
+ * Vectorized col221111() for 32 bit color.
+ *
+ * Sums are calculated with 32 bits and clamped by the saturating packs, so
+ * the result is the same as with col221111().
+ */
+static void col221111_32_sse2(int *out, unsigned char *pic, int width)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(128);
+  int i, j, k;
+
+  for(i = 0; i < 8; i++) {
+    int *outc = out + 64 * 4 + i * 8;
+    __m128i cb[2], cr[2], cg[2];
+
+    for(k = 0; k < 2; k++) {
+      cb[k] = _mm_loadu_si128((__m128i *) (outc + 4 * k));
+      cr[k] = _mm_loadu_si128((__m128i *) (outc + 64 + 4 * k));
+      // cg = (50 * cb + 130 * cr + 128) >> 8
+      cg[k] = _mm_add_epi32(
+        _mm_add_epi32(_mm_slli_epi32(cb[k], 5), _mm_slli_epi32(cb[k], 4)),
+        _mm_add_epi32(_mm_slli_epi32(cb[k], 1), _mm_slli_epi32(cr[k], 7))
+      );
+      cg[k] = _mm_add_epi32(cg[k], _mm_add_epi32(_mm_slli_epi32(cr[k], 1), round));
+      cg[k] = _mm_srai_epi32(cg[k], 8);
+    }
+
+    for(j = 0; j < 2; j++) {
+      int *outy = out + (i >= 4 ? 128 : 0) + ((2 * i + j) & 7) * 8;
+      unsigned char *p = pic + (2 * i + j) * width;
+
+      // 8 pixels per step: left block, then right block
+      for(k = 0; k < 2; k++) {
+        __m128i y0 = _mm_loadu_si128((__m128i *) (outy + 64 * k));
+        __m128i y1 = _mm_loadu_si128((__m128i *) (outy + 64 * k + 4));
+        __m128i cb0 = _mm_unpacklo_epi32(cb[k], cb[k]), cb1 = _mm_unpackhi_epi32(cb[k], cb[k]);
+        __m128i cr0 = _mm_unpacklo_epi32(cr[k], cr[k]), cr1 = _mm_unpackhi_epi32(cr[k], cr[k]);
+        __m128i cg0 = _mm_unpacklo_epi32(cg[k], cg[k]), cg1 = _mm_unpackhi_epi32(cg[k], cg[k]);
+        __m128i b = _mm_packs_epi32(_mm_add_epi32(y0, cb0), _mm_add_epi32(y1, cb1));
+        __m128i g = _mm_packs_epi32(_mm_sub_epi32(y0, cg0), _mm_sub_epi32(y1, cg1));
+        __m128i r = _mm_packs_epi32(_mm_add_epi32(y0, cr0), _mm_add_epi32(y1, cr1));
+        __m128i bg0 = _mm_unpacklo_epi16(b, g), bg1 = _mm_unpackhi_epi16(b, g);
+        __m128i r0 = _mm_unpacklo_epi16(r, zero), r1 = _mm_unpackhi_epi16(r, zero);
+
+        _mm_storeu_si128((__m128i *) (p + 32 * k),
+          _mm_packus_epi16(_mm_unpacklo_epi32(bg0, r0), _mm_unpackhi_epi32(bg0, r0))
+        );
+        _mm_storeu_si128((__m128i *) (p + 32 * k + 16),
+          _mm_packus_epi16(_mm_unpacklo_epi32(bg1, r1), _mm_unpackhi_epi32(bg1, r1))
+        );
+      }
+    }
+  }
+}
+#endif
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 unsigned gfx_jpeg_getsize(uint8_t *buf)
 {
+  struct in in = { .data = buf };
   unsigned u;
+  int m;
+
+  if(getbyte(&in) != 0xff || getbyte(&in) != M_SOI) return 0;
+
+  // skip everything up to the frame header
+  for(;;) {
+    if(getbyte(&in) != 0xff) return 0;
+    m = getbyte(&in);
+    if(m == M_SOF0 || m == 0xc2) break;
+    u = getword(&in);
+    in.data = (unsigned char *) in.data + u - 2;
+  }
 
-  datap = buf;
-  getbyte(); getbyte(); 
-  if(readtables(M_SOF0)) return 0;
-  getword(); getbyte();
+  getword(&in); getbyte(&in);
 
-  u = getword() << 16;
-  u += getword();
+  u = getword(&in) << 16;
+  u += getword(&in);
 
   return u;
 }
@@ -1,5 +1,9 @@
 #include <gfxboot/gfxboot.h>
 
+static void *gfx_read_file_alloc(void *data, unsigned size);
+static int gfx_pack_verify(data_t *mem);
+static obj_id_t gfx_pack_lookup(char *name);
+
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
@@ -203,23 +207,26 @@ int gfx_utf8_dec(char **s, unsigned *len)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Read file, from the asset pack or via the host.
+//
+// Files from the pack point into the pack itself and are read-only; files
+// read via the host are writable.
+//
 obj_id_t gfx_read_file(char *name)
 {
-  obj_id_t id = 0;
-  void *buf = 0;
-
-  int size = gfxboot_sys_read_file(name, &buf);
+  obj_id_t id = gfx_pack_lookup(name);
 
-  if(size >= 0 && buf) {
-    id = gfx_obj_mem_new((unsigned) size, 0);
+  if(id) {
+    gfxboot_log("read(%s): id = #%08x (pack)\n", name, id);
 
-    if(size) {
-      data_t *mem = gfx_obj_mem_ptr(id);
+    return id;
+  }
 
-      if(mem) gfx_memcpy(mem->ptr, buf, (unsigned) size);
+  int size = gfxboot_sys_read_file(name, gfx_read_file_alloc, &id);
 
-      gfxboot_sys_free(buf);
-    }
+  if(size <= 0 && id) {
+    gfx_obj_ref_dec(id);
+    id = 0;
   }
 
   gfxboot_log("read(%s): id = #%08x\n", name, id);
@@ -228,6 +235,141 @@ obj_id_t gfx_read_file(char *name)
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Allocate memory object for gfx_read_file(); the host reads the file
+// directly into it.
+//
+// data: points to object id
+//
+static void *gfx_read_file_alloc(void *data, unsigned size)
+{
+  obj_id_t *id = data;
+
+  *id = gfx_obj_mem_new(size, 0);
+
+  data_t *mem = gfx_obj_mem_ptr(*id);
+
+  return mem ? mem->ptr : 0;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Asset pack layout (all numbers are 32 bit little-endian):
+//
+//   0: magic (0x4b415047)
+//   4: number of entries
+//   8: index: per entry name offset, data offset, data size
+//      (sorted by name)
+//   0-terminated names
+//   file data (each aligned to 4 bytes, like memory pool objects)
+//
+// All offsets are relative to the start of the pack. Packs are created
+// with gfxboot-pack.
+//
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Load asset pack.
+//
+// Files in the pack are served by gfx_read_file() without accessing the
+// file system. It's fine if the pack does not exist.
+//
+void gfx_pack_init(char *name)
+{
+  obj_id_t id = gfx_read_file(name);
+  obj_t *ptr = gfx_obj_ptr(id);
+
+  if(ptr && ptr->base_type == OTYPE_MEM && gfx_pack_verify(&ptr->data)) {
+    // files handed out by gfx_read_file() point into the pack
+    ptr->flags.ro = 1;
+    OBJ_ID_ASSIGN(gfxboot_data->pack_id, id);
+    gfxboot_log("pack(%s): %u files\n", name, gfx_read_le32(ptr->data.ptr + 4));
+  }
+  else if(id) {
+    gfxboot_log("pack(%s): invalid format\n", name);
+  }
+
+  gfx_obj_ref_dec(id);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Check asset pack index.
+//
+// Return 1 if ok, else 0.
+//
+static int gfx_pack_verify(data_t *mem)
+{
+  uint8_t *pack = mem->ptr;
+  unsigned u, cnt;
+  char *prev_name = 0;
+
+  if(mem->size < 8 || gfx_read_le32(pack) != 0x4b415047) return 0;
+
+  cnt = gfx_read_le32(pack + 4);
+
+  if(cnt > (mem->size - 8) / 12) return 0;
+
+  for(u = 0; u < cnt; u++) {
+    uint8_t *entry = pack + 8 + 12 * u;
+    unsigned name_ofs = gfx_read_le32(entry);
+    unsigned data_ofs = gfx_read_le32(entry + 4);
+    unsigned data_size = gfx_read_le32(entry + 8);
+
+    if(name_ofs >= mem->size || data_ofs > mem->size || data_size > mem->size - data_ofs) return 0;
+
+    // name must be 0-terminated inside the pack
+    char *name = (char *) pack + name_ofs;
+    char *s = name, *end = (char *) pack + mem->size;
+    while(s < end && *s) s++;
+    if(s == end) return 0;
+
+    // gfx_pack_lookup() relies on the index being sorted
+    if(prev_name && gfx_strcmp(prev_name, name) >= 0) return 0;
+    prev_name = name;
+  }
+
+  return 1;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Look up file in asset pack.
+//
+// Return read-only memory object referencing the file data in the pack or
+// 0 if the file is not in the pack.
+//
+static obj_id_t gfx_pack_lookup(char *name)
+{
+  data_t *mem = gfx_obj_mem_ptr(gfxboot_data->pack_id);
+
+  if(!mem || !name) return 0;
+
+  uint8_t *pack = mem->ptr;
+  unsigned lo = 0, hi = gfx_read_le32(pack + 4);
+
+  while(lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    uint8_t *entry = pack + 8 + 12 * mid;
+    int cmp = gfx_strcmp(name, (char *) pack + gfx_read_le32(entry));
+
+    if(cmp == 0) {
+      return gfx_obj_const_mem_nofree_new(
+        pack + gfx_read_le32(entry + 4), gfx_read_le32(entry + 8), 0, gfxboot_data->pack_id
+      );
+    }
+
+    if(cmp < 0) {
+      hi = mid;
+    }
+    else {
+      lo = mid + 1;
+    }
+  }
+
+  return 0;
+}
+
+
 #if INCLUDE_DIV64
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 static uint64_t __udivmoddi4(uint64_t num, uint64_t den, int mod) __attribute__((noinline));
@@ -2,6 +2,19 @@
 
 static uint8_t _console_font[4947];
 
+// scratch buffer for gfx_snapshot_file_check()
+typedef struct {
+  uint8_t *ptr;
+  unsigned max;
+  unsigned size;		// file size
+} snapshot_scratch_t;
+
+static int gfx_snapshot_load(char *name);
+static void *gfx_snapshot_alloc(void *data, unsigned size);
+static snapshot_file_t gfx_snapshot_file(data_t *mem);
+static int gfx_snapshot_file_check(char *name, snapshot_file_t *file, uint8_t *scratch, unsigned scratch_size);
+static void *gfx_snapshot_scratch_alloc(void *data, unsigned size);
+
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 int gfxboot_init(int auto_run)
@@ -12,6 +25,16 @@ int gfxboot_init(int auto_run)
 
   if(gfx_malloc_init()) return 1;
 
+  // continue from heap snapshot, if there is one
+  if(!gfxboot_data->vm.snapshot.create && gfx_snapshot_load("gfxboot.snapshot")) {
+    gfx_screen_init();
+    gfx_screen_add_dirty((area_t) { .width = gfxboot_data->screen.real.width, .height = gfxboot_data->screen.real.height });
+    goto run;
+  }
+
+  // gfx_snapshot_load() may have left some garbage
+  if(gfx_malloc_init()) return 1;
+
   if(gfx_obj_init()) return 1;
 
   gfx_vm_status_dump();
@@ -27,6 +50,8 @@ int gfxboot_init(int auto_run)
   // font structure itself holds ref to data
   gfx_obj_ref_dec(console_font_data_id);
 
+  gfx_screen_init();
+
   // create virtual screen, used for drawing
   gfxboot_data->screen.canvas_id = gfx_obj_canvas_new(gfxboot_data->screen.real.width, gfxboot_data->screen.real.height);
   canvas_t *canvas = gfx_obj_canvas_ptr(gfxboot_data->screen.canvas_id);
@@ -66,6 +91,12 @@ int gfxboot_init(int auto_run)
 
   if(!gfx_setup_dict()) return 1;
 
+  // load asset pack, if any
+  gfx_pack_init("gfxboot.pack");
+
+  data_t *pack = gfx_obj_mem_ptr(gfxboot_data->pack_id);
+  if(pack) gfxboot_data->vm.snapshot.pack = gfx_snapshot_file(pack);
+
   // load main program
   obj_id_t pfile_id = gfx_read_file("main.gc");
   obj_t *pfile_ptr = gfx_obj_ptr(pfile_id);
@@ -78,6 +109,13 @@ int gfxboot_init(int auto_run)
     return 1;
   }
 
+  // main.gc from the pack is covered by the pack checksum
+  data_t *pfile = OBJ_DATA_FROM_PTR(pfile_ptr);
+  pack = gfx_obj_mem_ptr(gfxboot_data->pack_id);
+  if(!pack || pfile->ptr < pack->ptr || pfile->ptr >= pack->ptr + pack->size) {
+    gfxboot_data->vm.snapshot.main_gc = gfx_snapshot_file(pfile);
+  }
+
   if(!gfx_program_init(pfile_id)) {
     gfxboot_log("failed to setup program\n");
     return 1;
@@ -93,12 +131,15 @@ int gfxboot_init(int auto_run)
 
   // gfxboot_data->vm.debug.trace_ip = 1;
 
+run:
   if(auto_run) {
     gfxboot_data->vm.debug.console.show_on_error = 1;
     gfx_program_run();
   }
   gfx_show_error();
 
+  gfx_screen_flush();
+
   // gfx_obj_dump(OBJ_ID(0, 1), (dump_style_t) { .dump = 1 });
 
   return 0;
@@ -111,6 +152,348 @@ int gfxboot_init(int auto_run)
 void gfxboot_debug_command(char *str)
 {
   if(str) gfx_debug_cmd(str);
+
+  gfx_screen_flush();
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Create heap snapshot.
+//
+// The snapshot is a copy of the memory pool (with pointers turned into
+// offsets) plus the VM state kept outside the pool. gfxboot_init() loads
+// it instead of running the program setup and continues after the
+// 'snapshot' primitive.
+//
+// buf: snapshot buffer
+// size: buffer size
+//
+// return: snapshot size; if it is larger than size, nothing is written; 0 = failed
+//
+unsigned gfxboot_snapshot(void *buf, unsigned size)
+{
+  malloc_head_t *head = &gfxboot_data->vm.mem;
+  void *mem_start = head->first_chunk;
+  void *mem_end = mem_start + head->size;
+  olist_t *ol = gfxboot_data->vm.olist.ptr;
+  malloc_chunk_t *chunk = 0;
+  unsigned idx, relocs = 0;
+
+  if(!mem_start || !ol) return 0;
+
+  snapshot_head_t sh = {
+    .magic = SNAPSHOT_MAGIC,
+    .layout = SNAPSHOT_LAYOUT,
+    .width = gfxboot_data->screen.real.width,
+    .height = gfxboot_data->screen.real.height,
+    .pool_size = head->size,
+    .olist_ofs = (uint32_t) ((void *) ol - mem_start),
+    .hash_stamp = gfxboot_data->vm.hash_stamp,
+    .glyph_gen = gfxboot_data->glyph_cache.gen,
+    .main_gc = gfxboot_data->vm.snapshot.main_gc,
+    .pack = gfxboot_data->vm.snapshot.pack,
+    .id = {
+      .olist = gfxboot_data->vm.olist.id,
+      .gc_list = gfxboot_data->vm.gc_list,
+      .screen_canvas = gfxboot_data->screen.canvas_id,
+      .console_canvas = gfxboot_data->console.canvas_id,
+      .canvas = gfxboot_data->canvas_id,
+      .compose = gfxboot_data->compose.list_id,
+      .system = gfxboot_data->system_id,
+      .pack = gfxboot_data->pack_id,
+      .pstack = gfxboot_data->vm.program.pstack,
+      .dict = gfxboot_data->vm.program.dict,
+      .prims = gfxboot_data->vm.program.prims,
+      .context = gfxboot_data->vm.program.context,
+      .wait_for_context = gfxboot_data->vm.program.wait_for_context,
+      .code = gfxboot_data->vm.program.code,
+      .array_start = gfxboot_data->vm.program.array_start_id,
+      .hash_start = gfxboot_data->vm.program.hash_start_id,
+    },
+  };
+
+  while(gfx_prim_name(sh.prims)) sh.prims++;
+
+  // a trailing free chunk is not stored
+  for(void *mem = mem_start; mem < mem_end; mem += chunk->next) {
+    chunk = mem;
+    if(chunk->next < sizeof (malloc_chunk_t)) return 0;
+  }
+
+  if(chunk->id == 0) {
+    sh.pool_used = (uint32_t) ((void *) chunk - mem_start);
+    sh.last_chunk = chunk->prev;
+  }
+  else {
+    sh.pool_used = head->size;
+    sh.last_chunk = chunk->next;
+  }
+
+  // all pointers outside the pool must be to known static data
+  for(idx = 0; idx < ol->max; idx++) {
+    obj_t *ptr = ol->ptr + idx;
+    if(ptr->base_type == OTYPE_NONE || !ptr->flags.data_is_ptr) continue;
+    if(ptr->data.ptr >= mem_start && ptr->data.ptr <= mem_end) continue;
+    if(
+      ptr->data.ptr < (void *) _console_font ||
+      ptr->data.ptr >= (void *) _console_font + sizeof _console_font
+    ) {
+      unsigned u;
+      for(u = 0; u < sh.prims && ptr->data.ptr != gfx_prim_name(u); u++);
+      if(u == sh.prims) {
+        gfxboot_log("snapshot: %s: unsupported pointer\n", gfx_obj_id2str(OBJ_ID(idx, ptr->gen)));
+        return 0;
+      }
+    }
+    relocs++;
+  }
+
+  sh.relocs = relocs;
+
+  unsigned snapshot_size = (unsigned) sizeof sh + sh.pool_used + relocs * (unsigned) sizeof (snapshot_reloc_t);
+
+  if(!buf || size < snapshot_size) return snapshot_size;
+
+  gfx_memcpy(buf, &sh, sizeof sh);
+  gfx_memcpy(buf + sizeof sh, mem_start, sh.pool_used);
+
+  olist_t *snapshot_ol = buf + sizeof sh + sh.olist_ofs;
+  snapshot_reloc_t *reloc = buf + sizeof sh + sh.pool_used;
+
+  for(idx = 0; idx < ol->max; idx++) {
+    obj_t *ptr = snapshot_ol->ptr + idx;
+    if(ptr->base_type == OTYPE_NONE || !ptr->flags.data_is_ptr) continue;
+    if(ptr->data.ptr >= mem_start && ptr->data.ptr <= mem_end) {
+      ptr->data.ptr = (void *) (ptr->data.ptr - mem_start);
+      continue;
+    }
+    snapshot_reloc_t r = { .idx = idx };
+    if(ptr->data.ptr >= (void *) _console_font && ptr->data.ptr < (void *) _console_font + sizeof _console_font) {
+      r.type = SNAPSHOT_RELOC_CONSOLE_FONT;
+      r.value = (uint32_t) (ptr->data.ptr - (void *) _console_font);
+    }
+    else {
+      r.type = SNAPSHOT_RELOC_PRIM_NAME;
+      while(ptr->data.ptr != gfx_prim_name(r.value)) r.value++;
+    }
+    // 0 is never a valid pool offset for object data
+    ptr->data.ptr = 0;
+    gfx_memcpy(reloc++, &r, sizeof r);
+  }
+
+  gfxboot_log("snapshot: %u bytes, %u relocations\n", snapshot_size, relocs);
+
+  return snapshot_size;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Load heap snapshot created by gfxboot_snapshot().
+//
+// The snapshot must have been created by the same gfxboot build with the
+// same screen size and the same main.gc and gfxboot.pack files.
+//
+// Note: the memory pool is used as buffer; call gfx_malloc_init() if this
+// function fails.
+//
+// return: 0 = failed, 1 = ok
+//
+static int gfx_snapshot_load(char *name)
+{
+  malloc_head_t *head = &gfxboot_data->vm.mem;
+  void *mem_start = head->first_chunk;
+  void *mem_end = mem_start + head->size;
+  snapshot_head_t sh;
+  uint8_t *buf = 0;
+  unsigned u, prims;
+
+  int len = gfxboot_sys_read_file(name, gfx_snapshot_alloc, &buf);
+
+  if(len <= 0 || !buf) return 0;
+
+  if((unsigned) len < sizeof sh) goto invalid;
+
+  gfx_memcpy(&sh, buf, sizeof sh);
+
+  for(prims = 0; gfx_prim_name(prims); prims++);
+
+  if(
+    sh.magic != SNAPSHOT_MAGIC ||
+    sh.layout != SNAPSHOT_LAYOUT ||
+    sh.prims != prims ||
+    sh.width != gfxboot_data->screen.real.width ||
+    sh.height != gfxboot_data->screen.real.height ||
+    sizeof sh + sh.pool_used + (uint64_t) sh.relocs * sizeof (snapshot_reloc_t) != (unsigned) len ||
+    sh.pool_used > head->size ||
+    (sh.pool_used < head->size && head->size - sh.pool_used < MALLOC_MIN_CHUNK) ||
+    sh.last_chunk < MALLOC_MIN_CHUNK ||
+    sh.last_chunk > sh.pool_used ||
+    (uint64_t) sh.olist_ofs + sizeof (olist_t) > sh.pool_used
+  ) goto invalid;
+
+  // the pool space in front of the snapshot is free, use it to read the files
+  if(
+    !gfx_snapshot_file_check("gfxboot.pack", &sh.pack, mem_start, (unsigned) (buf - (uint8_t *) mem_start)) ||
+    (sh.main_gc.size && !gfx_snapshot_file_check("main.gc", &sh.main_gc, mem_start, (unsigned) (buf - (uint8_t *) mem_start)))
+  ) {
+    gfxboot_log("snapshot(%s): program files changed\n", name);
+    goto invalid;
+  }
+
+  // move pool content into place; the relocation entries behind it stay intact
+  gfx_memcpy(mem_start, buf + sizeof sh, sh.pool_used);
+
+  uint8_t *reloc = buf + sizeof sh + sh.pool_used;
+
+  olist_t *ol = mem_start + sh.olist_ofs;
+
+  if((uint64_t) sh.olist_ofs + OBJ_OLIST_SIZE((uint64_t) ol->max) > sh.pool_used) goto invalid;
+
+  for(u = 0; u < ol->max; u++) {
+    obj_t *ptr = ol->ptr + u;
+    if(ptr->base_type == OTYPE_NONE || !ptr->flags.data_is_ptr) continue;
+    unsigned long ofs = (unsigned long) ptr->data.ptr;
+    if(ofs == 0) continue;
+    if(ofs == sh.pool_size) {
+      // size 0 objects point to end of malloc area
+      ptr->data.ptr = mem_end;
+    }
+    else if(ofs < sh.pool_used) {
+      ptr->data.ptr = mem_start + ofs;
+    }
+    else {
+      goto invalid;
+    }
+  }
+
+  for(u = 0; u < sh.relocs; u++) {
+    snapshot_reloc_t r;
+    gfx_memcpy(&r, reloc + u * sizeof r, sizeof r);
+    if(r.idx >= ol->max || ol->ptr[r.idx].data.ptr) goto invalid;
+    if(r.type == SNAPSHOT_RELOC_PRIM_NAME && r.value < prims) {
+      ol->ptr[r.idx].data.ptr = (void *) gfx_prim_name(r.value);
+    }
+    else if(r.type == SNAPSHOT_RELOC_CONSOLE_FONT && r.value < sizeof _console_font) {
+      ol->ptr[r.idx].data.ptr = _console_font + r.value;
+    }
+    else {
+      goto invalid;
+    }
+  }
+
+  // the pool might be larger than the one the snapshot was taken from
+  malloc_chunk_t *first_chunk = mem_start;
+
+  if(sh.pool_used < head->size) {
+    malloc_chunk_t *chunk = mem_start + sh.pool_used;
+    *chunk = (malloc_chunk_t) { .prev = sh.last_chunk, .next = head->size - sh.pool_used, .id = 0 };
+    first_chunk->prev = chunk->next;
+  }
+  else {
+    first_chunk->prev = sh.last_chunk;
+  }
+
+  gfxboot_data->vm.olist.ptr = ol;
+
+  if(gfx_malloc_relink() || gfx_malloc_check(mc_basic + mc_xref)) goto invalid;
+
+  gfxboot_data->vm.olist.id = sh.id.olist;
+  gfxboot_data->vm.gc_list = sh.id.gc_list;
+  gfxboot_data->screen.canvas_id = sh.id.screen_canvas;
+  gfxboot_data->console.canvas_id = sh.id.console_canvas;
+  gfxboot_data->canvas_id = sh.id.canvas;
+  gfxboot_data->compose.list_id = sh.id.compose;
+  gfxboot_data->system_id = sh.id.system;
+  gfxboot_data->pack_id = sh.id.pack;
+  gfxboot_data->vm.program.pstack = sh.id.pstack;
+  gfxboot_data->vm.program.dict = sh.id.dict;
+  gfxboot_data->vm.program.prims = sh.id.prims;
+  gfxboot_data->vm.program.context = sh.id.context;
+  gfxboot_data->vm.program.wait_for_context = sh.id.wait_for_context;
+  gfxboot_data->vm.program.code = sh.id.code;
+  gfxboot_data->vm.program.array_start_id = sh.id.array_start;
+  gfxboot_data->vm.program.hash_start_id = sh.id.hash_start;
+  gfxboot_data->vm.hash_stamp = sh.hash_stamp;
+  gfxboot_data->glyph_cache.gen = sh.glyph_gen;
+  gfxboot_data->vm.snapshot.main_gc = sh.main_gc;
+  gfxboot_data->vm.snapshot.pack = sh.pack;
+
+  gfxboot_log("snapshot(%s): %u bytes\n", name, len);
+
+  return 1;
+
+invalid:
+  gfxboot_data->vm.olist.ptr = 0;
+
+  gfxboot_log("snapshot(%s): invalid\n", name);
+
+  return 0;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Allocate buffer for gfx_snapshot_load() at the end of the (still empty)
+// memory pool.
+//
+// data: points to buffer pointer
+//
+static void *gfx_snapshot_alloc(void *data, unsigned size)
+{
+  malloc_head_t *head = &gfxboot_data->vm.mem;
+
+  // must not overwrite the first chunk header
+  if(size > head->size - MALLOC_MIN_CHUNK) return 0;
+
+  return *(uint8_t **) data = head->first_chunk + head->size - size;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get size and checksum of file content.
+//
+static snapshot_file_t gfx_snapshot_file(data_t *mem)
+{
+  return (snapshot_file_t) { .size = mem->size, .sum = gfx_obj_hash_key(mem) };
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Check that file matches size and checksum stored in snapshot.
+//
+// The file is read into the scratch buffer. A file that is too large for
+// it is treated as changed.
+//
+// return: 0 = changed, 1 = ok
+//
+static int gfx_snapshot_file_check(char *name, snapshot_file_t *file, uint8_t *scratch, unsigned scratch_size)
+{
+  snapshot_scratch_t sc = { .ptr = scratch, .max = scratch_size };
+
+  int len = gfxboot_sys_read_file(name, gfx_snapshot_scratch_alloc, &sc);
+
+  // no file (or an empty one)
+  if(sc.size == 0) return file->size == 0;
+
+  if(len <= 0 || (unsigned) len != file->size) return 0;
+
+  snapshot_file_t current = gfx_snapshot_file(&(data_t) { .ptr = scratch, .size = (unsigned) len });
+
+  return current.sum == file->sum;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Provide scratch buffer for gfx_snapshot_file_check().
+//
+// data: points to snapshot_scratch_t
+//
+static void *gfx_snapshot_scratch_alloc(void *data, unsigned size)
+{
+  snapshot_scratch_t *sc = data;
+
+  sc->size = size;
+
+  return size <= sc->max ? sc->ptr : 0;
 }
 
 
@@ -129,18 +512,17 @@ int gfxboot_process_key(unsigned key)
 
   if(gfxboot_data->vm.debug.console.input) {
     gfx_program_debug(key);
-
-    return action;
+  }
+  else if(key == 0x04) {	// '^D'
+    gfx_program_debug_on_off(1, 1);
   }
   else {
-    if(key == 0x04) {	// '^D'
-      gfx_program_debug_on_off(1, 1);
-      return action;
-    }
-
     action = gfx_program_process_key(key);
   }
 
+  // draw everything that has changed
+  gfx_screen_flush();
+
 #if 0
   switch(key) {
     case '0'...'9':
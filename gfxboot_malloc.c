@@ -3,6 +3,10 @@
 
 static int gfx_malloc_check_basic(void);
 static int gfx_malloc_check_xref(void);
+static unsigned gfx_malloc_class(uint32_t size);
+static malloc_free_t *gfx_malloc_free_ptr(uint32_t ofs);
+static void gfx_malloc_link(malloc_chunk_t *chunk);
+static void gfx_malloc_unlink(malloc_chunk_t *chunk);
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
@@ -18,12 +22,109 @@ int gfx_malloc_init()
   head->first_chunk = head->ptr;
   head->first_free = head->ptr;
 
+  gfx_memset(head->free_list, 0, sizeof head->free_list);
+
   *(malloc_chunk_t *) head->first_chunk = (malloc_chunk_t) { .prev = head->size, .next = head->size, .id = 0 };
 
+  gfx_malloc_link(head->first_chunk);
+
+  return 0;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Rebuild free chunk lists.
+//
+// Needed after the pool content has been replaced (cf. gfxboot_snapshot()).
+//
+// return: 0 = ok, 1 = chunk chain broken
+//
+int gfx_malloc_relink()
+{
+  malloc_head_t *head = &gfxboot_data->vm.mem;
+
+  void *mem_start = head->first_chunk;
+  void *mem_end = mem_start + head->size;
+  malloc_chunk_t *chunk;
+
+  gfx_memset(head->free_list, 0, sizeof head->free_list);
+  head->first_free = mem_end;
+
+  for(void *mem = mem_start; mem < mem_end; mem += chunk->next) {
+    chunk = mem;
+    if(chunk->next < MALLOC_MIN_CHUNK || chunk->next > mem_end - mem) return 1;
+    if(chunk->id == 0) {
+      if(head->first_free == mem_end) head->first_free = mem;
+      gfx_malloc_link(chunk);
+    }
+  }
+
   return 0;
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get size class for raw chunk size.
+//
+// There are 4 classes per power of two; chunk sizes are at least 16 bytes.
+//
+unsigned gfx_malloc_class(uint32_t size)
+{
+  unsigned bits = 31 - (unsigned) __builtin_clz(size);
+
+  return (bits - 4) * 4 + ((size >> (bits - 2)) & 3);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get free list links of chunk at offset ofs - 1.
+//
+malloc_free_t *gfx_malloc_free_ptr(uint32_t ofs)
+{
+  return (malloc_free_t *) ((malloc_chunk_t *) (gfxboot_data->vm.mem.first_chunk + ofs - 1))->data;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Add free chunk to its size class list.
+//
+void gfx_malloc_link(malloc_chunk_t *chunk)
+{
+  malloc_head_t *head = &gfxboot_data->vm.mem;
+
+  uint32_t ofs = (uint32_t) ((void *) chunk - head->first_chunk) + 1;
+  uint32_t *list = head->free_list + gfx_malloc_class(chunk->next);
+  malloc_free_t *f = (malloc_free_t *) chunk->data;
+
+  f->prev = 0;
+  f->next = *list;
+  if(f->next) gfx_malloc_free_ptr(f->next)->prev = ofs;
+  *list = ofs;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Remove free chunk from its size class list.
+//
+// Must be called before the chunk size changes.
+//
+void gfx_malloc_unlink(malloc_chunk_t *chunk)
+{
+  malloc_head_t *head = &gfxboot_data->vm.mem;
+
+  malloc_free_t *f = (malloc_free_t *) chunk->data;
+
+  if(f->prev) {
+    gfx_malloc_free_ptr(f->prev)->next = f->next;
+  }
+  else {
+    head->free_list[gfx_malloc_class(chunk->next)] = f->next;
+  }
+
+  if(f->next) gfx_malloc_free_ptr(f->next)->prev = f->prev;
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 void gfx_malloc_dump(dump_style_t style)
 {
@@ -93,39 +194,53 @@ void *gfx_malloc(uint32_t size, obj_id_t id)
 
   size += sizeof (malloc_chunk_t);	// include header size
   size = (size + 3) & ~3U;		// align to 4 byte
+  if(size < MALLOC_MIN_CHUNK) size = MALLOC_MIN_CHUNK;
 
-  unsigned first_free_seen = 0;
+  unsigned cls = gfx_malloc_class(size);
 
-  for(void *mem = head->first_free; mem >= mem_start && mem < mem_end; mem += chunk->next) {
-    chunk = (malloc_chunk_t *) mem;
-    if(chunk->id == 0) {
-      if(!first_free_seen) head->first_free = mem;
-      first_free_seen++;
-
-      if(chunk->next >= size) {
-        chunk->id = id;
-        gfx_memset(mem + sizeof (malloc_chunk_t), 0, size - sizeof (malloc_chunk_t));
-        // big enough to split off an empty chunk
-        if(chunk->next > size + sizeof (malloc_chunk_t)) {
-          void *mem_next = mem + chunk->next;
-          malloc_chunk_t *chunk_next = mem_next == mem_end ? mem_start : mem_next;
-          uint32_t n = chunk->next - size;
-          chunk->next = size;
-          chunk = (malloc_chunk_t *) (mem + size);
-          if(first_free_seen == 1) head->first_free = mem + size;
-          chunk->id = 0;
-          chunk->next = n;
-          chunk->prev = size;
-          chunk_next->prev = n;
-        }
+  // first fit in matching size class
+  for(uint32_t ofs = head->free_list[cls]; ofs; ofs = gfx_malloc_free_ptr(ofs)->next) {
+    chunk = mem_start + ofs - 1;
+    if(chunk->next >= size) goto found;
+  }
 
-        return mem + sizeof (malloc_chunk_t);
-      }
+  // any chunk in a larger size class will do
+  for(cls++; cls < MALLOC_CLASSES; cls++) {
+    if(head->free_list[cls]) {
+      chunk = mem_start + head->free_list[cls] - 1;
+      goto found;
     }
   }
 
   // out of memory
   return 0;
+
+found:
+  if(gfxboot_data->vm.debug.prim_stats.enabled) gfxboot_data->vm.debug.prim_stats.allocs++;
+
+  gfx_malloc_unlink(chunk);
+
+  void *mem = chunk;
+
+  chunk->id = id;
+  gfx_memset(mem + sizeof (malloc_chunk_t), 0, size - sizeof (malloc_chunk_t));
+
+  // big enough to split off an empty chunk
+  if(chunk->next >= size + MALLOC_MIN_CHUNK) {
+    void *mem_next = mem + chunk->next;
+    malloc_chunk_t *chunk_next = mem_next == mem_end ? mem_start : mem_next;
+    uint32_t n = chunk->next - size;
+    chunk->next = size;
+    chunk = (malloc_chunk_t *) (mem + size);
+    if(mem == head->first_free) head->first_free = mem + size;
+    chunk->id = 0;
+    chunk->next = n;
+    chunk->prev = size;
+    chunk_next->prev = n;
+    gfx_malloc_link(chunk);
+  }
+
+  return mem + sizeof (malloc_chunk_t);
 }
 
 
@@ -157,6 +272,7 @@ void gfx_free(void *ptr)
 
     // join with preceeding free chunk
     if(chunk_prev->id == 0) {
+      gfx_malloc_unlink(chunk_prev);
       chunk_prev->next += next;
       mem = mem_prev;
       chunk = mem;
@@ -170,6 +286,7 @@ void gfx_free(void *ptr)
   if(mem_next != mem_end) {
     // join with following free chunk
     if(chunk_next->id == 0) {
+      gfx_malloc_unlink(chunk_next);
       chunk->next += chunk_next->next;
       mem_next = mem + chunk->next != mem_end ? mem + chunk->next : mem_start;
       chunk_next = mem_next;
@@ -179,6 +296,8 @@ void gfx_free(void *ptr)
 
   chunk->id = 0;
 
+  gfx_malloc_link(chunk);
+
   if(mem < head->first_free) head->first_free = mem;
 
   if(gfxboot_data->vm.debug.trace.memcheck && gfx_malloc_check(mc_basic)) {
@@ -213,8 +332,7 @@ int gfx_malloc_check_basic()
 
   if(!mem_start) return 0;
 
-  unsigned free_chunk = 0, first_free_ok = 0;
-
+  unsigned free_chunk = 0, first_free_ok = 0, free_chunks = 0, free_listed = 0;
 
   for(idx = 0, mem = mem_prev = mem_start; mem >= mem_start && mem < mem_end; mem_prev = mem, mem = mem_next, idx++) {
     chunk = (malloc_chunk_t *) mem;
@@ -233,6 +351,16 @@ int gfx_malloc_check_basic()
 
     if(mem_next != mem_end && chunk->next != chunk_next->prev) break;
 
+    if(chunk->id == 0) {
+      // must be linked into the list of its size class
+      uint32_t ofs = (uint32_t) (mem - mem_start) + 1;
+      malloc_free_t *f = (malloc_free_t *) chunk->data;
+      if(chunk->next < MALLOC_MIN_CHUNK) break;
+      if(f->prev ? gfx_malloc_free_ptr(f->prev)->next != ofs : head->free_list[gfx_malloc_class(chunk->next)] != ofs) break;
+      if(f->next && gfx_malloc_free_ptr(f->next)->prev != ofs) break;
+      free_chunks++;
+    }
+
     if(chunk->id && gfxboot_data->vm.olist.ptr) {
       obj_t *obj_ptr = gfx_obj_ptr(chunk->id);
       if(!obj_ptr) goto error;
@@ -261,6 +389,21 @@ int gfx_malloc_check_basic()
 
   if(chunk->next != chunk_start->prev) goto error;
 
+  // free lists must not contain anything else
+  for(unsigned cls = 0; cls < MALLOC_CLASSES; cls++) {
+    for(uint32_t ofs = head->free_list[cls]; ofs; ofs = gfx_malloc_free_ptr(ofs)->next) {
+      if(ofs > head->size || ++free_listed > free_chunks) {
+        gfxboot_log("-- free list corrupt\n");
+        goto error;
+      }
+    }
+  }
+
+  if(free_listed != free_chunks) {
+    gfxboot_log("-- free list corrupt\n");
+    goto error;
+  }
+
   return 0;
 
 error:
@@ -423,13 +566,7 @@ void gfx_defrag(unsigned max)
       break;
     }
 
-    // is olist?
-    if(chunk->id == OBJ_ID(0, 1)) olist_adjusted = 1;
-
-    if(ptr->flags.data_is_ptr && !ptr->flags.nofree) {
-      ptr->data.ptr -= diff;
-    }
-
+    // only one referenced object per run; leave this chunk where it is
     if(ptr->flags.has_ref) {
       if(ref_id) {
         mem_defrag_end = mem;
@@ -438,8 +575,16 @@ void gfx_defrag(unsigned max)
       ref_id = chunk->id;
     }
 
+    // is olist?
+    if(chunk->id == OBJ_ID(0, 1)) olist_adjusted = 1;
+
+    if(ptr->flags.data_is_ptr && !ptr->flags.nofree) {
+      ptr->data.ptr -= diff;
+    }
+
+    // this chunk has been adjusted, so it must be moved as well
     if(cnt >= max) {
-      mem_defrag_end = mem;
+      mem_defrag_end = mem + chunk->next;
       break;
     }
   }
@@ -471,6 +616,9 @@ void gfx_defrag(unsigned max)
     malloc_chunk_t *chunk_end = mem_defrag_end != mem_end ? mem_defrag_end : mem_start;
     uint32_t prev = chunk_end->prev;
 
+    // free chunk is going to be overwritten
+    gfx_malloc_unlink(chunk);
+
     mem_defrag_end -= diff;
 
     // adjust pointer to first free block
@@ -491,12 +639,15 @@ void gfx_defrag(unsigned max)
 
     // join free end blocks
     if(mem_next != mem_end && chunk_next->id == 0) {
+      gfx_malloc_unlink(chunk_next);
       chunk->next += chunk_next->next;
       mem_next += chunk_next->next;
       if(mem_next == mem_end) mem_next = mem_start;
       chunk_next = mem_next;
       chunk_next->prev = chunk->next;
     }
+
+    gfx_malloc_link(chunk);
   }
 
   // adjust everything pointing to ref_id
@@ -96,9 +96,23 @@ obj_id_t gfx_obj_const_mem_nofree_new(const uint8_t *str, unsigned len, uint8_t
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Create read-only string object from 0-terminated string.
+//
+// The string is copied into the memory pool, so str may be a temporary
+// buffer and heap snapshots don't have to deal with it.
+//
 obj_id_t gfx_obj_asciiz_new(const char *str)
 {
-  return gfx_obj_const_mem_nofree_new((uint8_t *) str, gfx_strlen(str), t_string, 0);
+  unsigned len = gfx_strlen(str);
+  obj_id_t id = gfx_obj_mem_new(len, t_string);
+  obj_t *ptr = gfx_obj_ptr(id);
+
+  if(ptr) {
+    gfx_memcpy(ptr->data.ptr, str, len);
+    ptr->flags.ro = 1;
+  }
+
+  return id;
 }
 
 
@@ -1,4 +1,5 @@
 #include <gfxboot/gfxboot.h>
+#include <gfxboot/vocabulary.h>
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -7,8 +8,21 @@
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Create number object.
+//
+// Ints and bools that fit into 30 bits are encoded directly in the object
+// id and don't need an object list entry.
+//
 obj_id_t gfx_obj_num_new(int64_t num, uint8_t sub_type)
 {
+  if(sub_type == t_int && num >= OBJ_ID_IMM_MIN && num <= OBJ_ID_IMM_MAX) {
+    return OBJ_ID_IMM + ((uint32_t) num & (OBJ_ID_IMM_BOOL - 1));
+  }
+
+  if(sub_type == t_bool && (num == 0 || num == 1)) {
+    return OBJ_ID_IMM + OBJ_ID_IMM_BOOL + (uint32_t) num;
+  }
+
   obj_id_t id = gfx_obj_new(OTYPE_NUM);
   obj_t *ptr = gfx_obj_ptr(id);
 
@@ -22,24 +36,54 @@ obj_id_t gfx_obj_num_new(int64_t num, uint8_t sub_type)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-int64_t *gfx_obj_num_ptr(obj_id_t id)
+// Expand immediate value into object.
+//
+// Immediate values have no object list entry. Fill in *buf so code that
+// only inspects objects can treat them like regular numbers.
+//
+// Note: changes to *buf are not reflected in the value.
+//
+obj_t *gfx_obj_num_imm(obj_id_t id, obj_t *buf)
 {
-  obj_t *ptr = gfx_obj_ptr(id);
+  if(!OBJ_ID_IS_IMM(id)) return 0;
 
-  if(!ptr || ptr->base_type != OTYPE_NUM) return 0;
+  *buf = (obj_t) {
+    .data.value = OBJ_ID_IMM_VALUE(id),
+    .ref_cnt = -1u,
+    .base_type = OTYPE_NUM,
+    .sub_type = (id & OBJ_ID_IMM_BOOL) ? t_bool : t_int
+  };
 
-  return &ptr->data.value;
+  return buf;
 }
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-int64_t *gfx_obj_num_subtype_ptr(obj_id_t id, uint8_t subtype)
+// Get number value.
+//
+// If subtype is not t_nil, the number must have this subtype.
+//
+// Return 1 and store value in *val if id is a number, else return 0.
+//
+int gfx_obj_num_value(obj_id_t id, uint8_t subtype, int64_t *val)
 {
+  if(OBJ_ID_IS_IMM(id)) {
+    if(subtype != t_nil && subtype != ((id & OBJ_ID_IMM_BOOL) ? t_bool : t_int)) return 0;
+
+    *val = OBJ_ID_IMM_VALUE(id);
+
+    return 1;
+  }
+
   obj_t *ptr = gfx_obj_ptr(id);
 
-  if(!ptr || ptr->base_type != OTYPE_NUM || ptr->sub_type != subtype) return 0;
+  if(!ptr || ptr->base_type != OTYPE_NUM) return 0;
 
-  return &ptr->data.value;
+  if(subtype != t_nil && ptr->sub_type != subtype) return 0;
+
+  *val = ptr->data.value;
+
+  return 1;
 }
 
 
@@ -133,6 +133,12 @@ char *gfx_obj_id2str(obj_id_t id)
   unsigned idx = OBJ_ID2IDX(id);
   unsigned gen = OBJ_ID2GEN(id);
 
+  if(OBJ_ID_IS_IMM(id)) {
+    gfxboot_snprintf(buf, sizeof buf, "#imm.num.%s", type_name[(id & OBJ_ID_IMM_BOOL) ? t_bool : t_int]);
+
+    return buf;
+  }
+
   obj_t *ptr = gfx_obj_ptr_nocheck(id);
   if(ptr && id) {
     if(ptr->flags.ro) ro = ".ro";
@@ -171,9 +177,9 @@ char *gfx_obj_id2str(obj_id_t id)
 void gfx_obj_dump(obj_id_t id, dump_style_t style)
 {
   unsigned type;
-  obj_t *ptr;
+  obj_t *ptr, imm;
 
-  ptr = gfx_obj_ptr(id);
+  ptr = OBJ_ID_IS_IMM(id) ? gfx_obj_num_imm(id, &imm) : gfx_obj_ptr(id);
 
   if(!ptr) {
     if(style.dump) {
@@ -265,7 +271,7 @@ obj_id_t gfx_obj_new(unsigned type)
   for(u = 0, u2 = ol->next; u < size; u++, u2++) {
     if(u2 >= ol->max) u2 -= ol->max;
     if(ptr[u2].base_type == OTYPE_NONE) {
-      ptr[u2].gen++;
+      ptr[u2].gen = (ptr[u2].gen + 1) & OBJ_GEN_MAX;
       if(!ptr[u2].gen) ptr[u2].gen++;	// avoid generation count 0
       ptr[u2].base_type = type;
       ptr[u2].ref_cnt = 1;
@@ -364,6 +370,7 @@ obj_id_t gfx_obj_realloc(obj_id_t id, uint32_t size)
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 obj_id_t gfx_obj_ref_inc(obj_id_t id)
 {
+  // immediate values have no object and are not reference counted
   obj_t *ptr = gfx_obj_ptr(id);
 
   if(ptr) {
@@ -487,6 +494,9 @@ obj_t *gfx_obj_ptr(obj_id_t id)
 
   if(!id) return 0;
 
+  // immediate values have no object
+  if(OBJ_ID_IS_IMM(id)) return 0;
+
   ptr = gfx_obj_ptr_nocheck(id);
 
   if(!ptr) return 0;
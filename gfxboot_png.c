@@ -2,6 +2,10 @@
 
 #include "gfxboot.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #ifdef WITH_Z_LOG
 #include <stdio.h>
 #define Z_LOG(a...) fprintf(stderr, a)
@@ -19,12 +23,16 @@
 
 #define Z_MAX_CODE_BITS		15
 #define Z_MAX_SYMS		288
+#define Z_MAX_ROOT_BITS		9
 #define Z_ADLER32_MODULO	65521
 #define Z_WINDOW_SIZE		0x8000
 
 #define PNG_CHUNK_IHDR		0x49484452
 #define PNG_CHUNK_IDAT		0x49444154
 
+// row buffer size: filter byte + up to 4 bytes per pixel + room for 16 byte loads
+#define PNG_ROW_SIZE(width)	(4 * (width) + 32)
+
 typedef __UINT8_TYPE__ uint8_t;
 typedef __UINT16_TYPE__ uint16_t;
 typedef __UINT32_TYPE__ uint32_t;
@@ -38,26 +46,50 @@ typedef struct {
 typedef struct {
   png_chunk_t chunk;
   unsigned width, height, pixel_bytes;
-  unsigned x, y, pixel_byte, filter;
-  unsigned got_filter:1;
+  // current scanline: 'row_pos' of 'row_len' bytes (incl. filter byte) in 'row'
+  unsigned y, row_len, row_pos;
+  // raw scanlines: current and previous (unfiltered)
+  uint8_t *row, *prev_row;
 } png_data_t;
 
+// Huffman decoding tables
+//
+// Codes are looked up using the next 'bits' input bits (the primary table).
+// Codes longer than that are resolved via a secondary table the primary
+// entry links to.
+//
+// Table entries are either
+//   - a symbol: (code length << 9) + symbol, or
+//   - a link: Z_HUFF_LINK + (secondary table bits << 10) + secondary table offset
+//
+// An entry of 0 is an invalid code.
+//
+// Table sizes are the worst case for complete codes with the given primary
+// table size (cf. zlib's 'enough' utility); they must stay below 1024.
+#define Z_HUFF_LINK		0x8000
+#define Z_LIT_ROOT_BITS		9
+#define Z_LIT_TABLE_SIZE	852
+#define Z_DIST_ROOT_BITS	6
+#define Z_DIST_TABLE_SIZE	592
+#define Z_CLEN_ROOT_BITS	7
+#define Z_CLEN_TABLE_SIZE	128
+
 typedef struct {
-  struct {
-    // max_1: max value + 1
-    unsigned min, max_1, ofs;
-  } codes[Z_MAX_CODE_BITS + 1];
-  uint16_t syms[Z_MAX_SYMS];
+  unsigned bits, size;
+  uint16_t *table;
 } z_huff_table_t;
 
 typedef struct {
   struct {
     uint8_t *buf;
-    unsigned len, pos, bits, val;
+    unsigned len, pos;
+    // bit buffer, 'bits' valid bits in 'val', lowest bit first
+    unsigned bits;
+    uint64_t val;
   } input;
   struct {
     uint8_t *buf;
-    unsigned len, pos;
+    unsigned len;
   } output;
   struct {
     uint8_t *buf;
@@ -68,17 +100,22 @@ typedef struct {
   } adler32;
   unsigned bad;
   z_huff_table_t huff_lit, huff_dist, huff_clen;
+  uint16_t lit_table[Z_LIT_TABLE_SIZE];
+  uint16_t dist_table[Z_DIST_TABLE_SIZE];
+  uint16_t clen_table[Z_CLEN_TABLE_SIZE];
   png_data_t png;
 } z_inflate_state_t;
 
 
-void z_adler32_update(z_inflate_state_t *inflate_state, unsigned val);
-void z_out_byte(z_inflate_state_t *inflate_state, unsigned val);
+void z_adler32_update(z_inflate_state_t *inflate_state, uint8_t *buf, unsigned len);
 void z_put_byte(z_inflate_state_t *inflate_state, unsigned val);
 void z_copy_bytes(z_inflate_state_t *inflate_state, unsigned dist, unsigned len);
+int z_next_chunk(z_inflate_state_t *inflate_state);
+void z_fill_bits(z_inflate_state_t *inflate_state);
 unsigned z_get_byte(z_inflate_state_t *inflate_state);
 unsigned z_get_bits(z_inflate_state_t *inflate_state, unsigned bits);
 unsigned z_get_code(z_inflate_state_t *inflate_state, z_huff_table_t *huff);
+unsigned z_reverse_bits(unsigned code, unsigned bits);
 void z_init_huff_table(z_inflate_state_t *inflate_state, z_huff_table_t *huff, unsigned values, uint8_t code_bits[]);
 void z_setup_fixed_huff_table(z_inflate_state_t *inflate_state);
 void z_setup_dynamic_huff_table(z_inflate_state_t *inflate_state);
@@ -87,98 +124,51 @@ void z_inflate_uncompressed_block(z_inflate_state_t *inflate_state);
 void z_inflate(z_inflate_state_t *inflate_state);
 
 unsigned png_paeth(int a, int b, int c);
+void png_unfilter_row(unsigned filter, uint8_t *row, uint8_t *prev, unsigned len, unsigned bpp);
+void png_convert_row(uint8_t *dst, uint8_t *src, unsigned width, unsigned bpp);
+void png_row_done(z_inflate_state_t *inflate_state);
 uint32_t png_get_uint32(uint8_t *buf);
 png_chunk_t *png_get_chunk(z_inflate_state_t *inflate_state);
 void png_get_size(z_inflate_state_t *inflate_state);
 
 
-void z_adler32_update(z_inflate_state_t *inflate_state, unsigned val)
+// Update Adler-32 checksum with 'len' bytes from 'buf'.
+void z_adler32_update(z_inflate_state_t *inflate_state, uint8_t *buf, unsigned len)
 {
-  inflate_state->adler32.low += val;
-  if(inflate_state->adler32.low >= Z_ADLER32_MODULO) inflate_state->adler32.low -= Z_ADLER32_MODULO;
-  inflate_state->adler32.high += inflate_state->adler32.low;
-  if(inflate_state->adler32.high >= Z_ADLER32_MODULO) inflate_state->adler32.high -= Z_ADLER32_MODULO;
-}
-
-
-void z_out_byte(z_inflate_state_t *inflate_state, unsigned val)
-{
-  png_data_t *png = &inflate_state->png;
-
-  if(png->x == 0 && png->pixel_byte == 0 && !png->got_filter) {
-    png->got_filter = 1;
-    png->filter = val;
-
-    PNG_LOG("+++ filter[%u] = %u\n", png->y, png->filter);
-
-    return;
-  }
-
-  // take care of rgb ordering:
-  //   - png order: r, g, b, (a)
-  //   - our order: b, g, r, a
-  static const uint8_t order[4] = { 2, 0, 2, 0 };
-
-  unsigned pos = inflate_state->output.pos ^ order[inflate_state->output.pos & 3];
-
-  // a = left, b = up; c = left + up
-  // internal pixel size is always 4
-  unsigned a = png->x ? inflate_state->output.buf[pos - 4] : 0;
-  unsigned b = png->y ? inflate_state->output.buf[pos - 4 * png->width] : 0;
-  unsigned c = png->x && png->y ? inflate_state->output.buf[pos - 4 * png->width - 4] : 0;
-
-  switch(png->filter) {
-    case 1:
-      val += a;
-      break;
-
-    case 2:
-      val += b;
-      break;
-
-    case 3:
-      val += (a + b) >> 1;
-      break;
-
-    case 4:
-      val += png_paeth((int) a, (int) b, (int) c);
-      break;
-  }
-
-  if(inflate_state->output.pos < inflate_state->output.len) {
-    // watch out: pos is not inflate_state->output.pos
-    inflate_state->output.buf[pos] = val;
-    inflate_state->output.pos++;
-  }
-  else {
-    inflate_state->bad = __LINE__;
-  }
-
-  if(++png->pixel_byte == png->pixel_bytes) {
-    png->pixel_byte = 0;
-    png->x++;
-    if(png->pixel_bytes == 3) {
-      // skip alpha
-      inflate_state->output.pos++;
-    }
-    if(png->x == png->width) {
-      png->x = 0;
-      png->y++;
+  unsigned low = inflate_state->adler32.low;
+  unsigned high = inflate_state->adler32.high;
+
+  while(len) {
+    // 5552: max bytes before 'high' can overflow
+    unsigned n = len < 5552 ? len : 5552;
+    len -= n;
+    while(n--) {
+      low += *buf++;
+      high += low;
     }
+    low %= Z_ADLER32_MODULO;
+    high %= Z_ADLER32_MODULO;
   }
 
-  png->got_filter = 0;
+  inflate_state->adler32.low = low;
+  inflate_state->adler32.high = high;
 }
 
 
+// Store inflated byte.
+//
+// Bytes go into the sliding window and the current scanline; complete
+// scanlines are handed to png_row_done().
 void z_put_byte(z_inflate_state_t *inflate_state, unsigned val)
 {
+  png_data_t *png = &inflate_state->png;
+
   inflate_state->window.buf[inflate_state->window.pos] = val;
   inflate_state->window.pos = (inflate_state->window.pos + 1) & (Z_WINDOW_SIZE - 1);
 
-  z_adler32_update(inflate_state, val);
+  png->row[png->row_pos++] = val;
 
-  z_out_byte(inflate_state, val);
+  if(png->row_pos == png->row_len) png_row_done(inflate_state);
 }
 
 
@@ -192,67 +182,146 @@ void z_copy_bytes(z_inflate_state_t *inflate_state, unsigned dist, unsigned len)
 }
 
 
-unsigned z_get_byte(z_inflate_state_t *inflate_state)
+// Advance to the next IDAT chunk with data.
+//
+// Return 0 if there is none. Running out of input is not an error here -
+// the bit buffer reads ahead and only fails when it runs short of bits
+// that are actually needed.
+int z_next_chunk(z_inflate_state_t *inflate_state)
 {
-  inflate_state->input.bits = 0;
+  while(inflate_state->input.len - inflate_state->input.pos >= 12) {
+    png_chunk_t *chunk = png_get_chunk(inflate_state);
+    if(!chunk) return 0;
+    if(chunk->type == PNG_CHUNK_IDAT && chunk->len) return 1;
+  }
+
+  return 0;
+}
+
 
+// Refill bit buffer.
+//
+// Read as many whole bytes as fit into the bit buffer (or as are left).
+// IDAT chunk boundaries are crossed as needed.
+void z_fill_bits(z_inflate_state_t *inflate_state)
+{
   png_chunk_t *chunk = &inflate_state->png.chunk;
 
-  if(chunk->pos >= chunk->len) {
-    while((chunk = png_get_chunk(inflate_state)) || chunk->pos >= chunk->len) {
-      if(chunk->type == PNG_CHUNK_IDAT) {
-        break;
-      }
+  while(inflate_state->input.bits <= 56) {
+    if(chunk->pos >= chunk->len && !z_next_chunk(inflate_state)) break;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if(chunk->len - chunk->pos >= 8) {
+      uint64_t val;
+      unsigned bytes = (63 - inflate_state->input.bits) >> 3;
+
+      __builtin_memcpy(&val, chunk->buf + chunk->pos, sizeof val);
+      inflate_state->input.val |= val << inflate_state->input.bits;
+      inflate_state->input.bits += bytes << 3;
+      chunk->pos += bytes;
+
+      break;
     }
-    if(!chunk) inflate_state->bad = __LINE__;
+#endif
+
+    inflate_state->input.val |= (uint64_t) chunk->buf[chunk->pos++] << inflate_state->input.bits;
+    inflate_state->input.bits += 8;
   }
+}
+
+
+// Get next byte-aligned input byte.
+//
+// Any bits left from a partially consumed byte are dropped.
+unsigned z_get_byte(z_inflate_state_t *inflate_state)
+{
+  z_get_bits(inflate_state, inflate_state->input.bits & 7);
 
-  return inflate_state->bad ? 0 : chunk->buf[chunk->pos++];
+  return z_get_bits(inflate_state, 8);
 }
 
 
+// Get 'bits' input bits (bits <= 32).
 unsigned z_get_bits(z_inflate_state_t *inflate_state, unsigned bits)
 {
-  unsigned val = 0;
+  if(!bits) return 0;
 
-  for(unsigned bit = bits; bit; bit--) {
-    if(!inflate_state->input.bits) {
-      inflate_state->input.val = z_get_byte(inflate_state);
-      inflate_state->input.bits = 8;
+  if(inflate_state->input.bits < bits) {
+    z_fill_bits(inflate_state);
+    if(inflate_state->input.bits < bits) {
+      inflate_state->bad = __LINE__;
+      return 0;
     }
-    val += (inflate_state->input.val & 1) << (bits - bit);
-    inflate_state->input.val >>= 1;
-    inflate_state->input.bits--;
   }
 
+  unsigned val = (unsigned) (inflate_state->input.val & ((1ull << bits) - 1));
+
+  inflate_state->input.val >>= bits;
+  inflate_state->input.bits -= bits;
+
   return val;
 }
 
 
+// Decode next symbol using Huffman table 'huff'.
 unsigned z_get_code(z_inflate_state_t *inflate_state, z_huff_table_t *huff)
 {
-  unsigned code = 0;
+  if(inflate_state->input.bits < Z_MAX_CODE_BITS) z_fill_bits(inflate_state);
 
-  for(unsigned bits = 1; bits <= Z_MAX_CODE_BITS; bits++) {
-     code = (code << 1) + z_get_bits(inflate_state, 1);
-     // Z_LOG("+++ bits = %u, code = 0b%b\n", bits, code);
-     if(code >= huff->codes[bits].min && code < huff->codes[bits].max_1) {
-       return huff->syms[huff->codes[bits].ofs + code - huff->codes[bits].min];
-     }
+  uint64_t val = inflate_state->input.val;
+  unsigned entry = huff->table[val & ((1u << huff->bits) - 1)];
+  unsigned len = 0;
+
+  if(entry & Z_HUFF_LINK) {
+    len = huff->bits;
+    entry = huff->table[(entry & 0x3ff) + ((val >> len) & ((1u << ((entry >> 10) & 0xf)) - 1))];
   }
 
-  inflate_state->bad = __LINE__;
+  if(!entry || (len += entry >> 9) > inflate_state->input.bits) {
+    inflate_state->bad = __LINE__;
+    return 0;
+  }
 
-  return 0;
+  inflate_state->input.val >>= len;
+  inflate_state->input.bits -= len;
+
+  return entry & 0x1ff;
+}
+
+
+// Reverse the lowest 'bits' bits of 'code'.
+//
+// Huffman codes are stored most significant bit first but the input is
+// read lowest bit first.
+unsigned z_reverse_bits(unsigned code, unsigned bits)
+{
+  unsigned val = 0;
+
+  while(bits--) {
+    val = (val << 1) + (code & 1);
+    code >>= 1;
+  }
+
+  return val;
 }
 
 
+// Build Huffman decoding table.
+//
+// code_bits[] holds the code length for each of the 'values' symbols.
+// huff->bits, huff->size, and huff->table must have been set up.
 void z_init_huff_table(z_inflate_state_t *inflate_state, z_huff_table_t *huff, unsigned values, uint8_t code_bits[])
 {
   unsigned count[Z_MAX_CODE_BITS + 1] = { };
-  unsigned pos[Z_MAX_CODE_BITS + 1] = { };
+  unsigned next_code[Z_MAX_CODE_BITS + 1] = { };
+  uint8_t sub_bits[1 << Z_MAX_ROOT_BITS] = { };
+  unsigned root_bits = huff->bits;
+  unsigned root_size = 1u << root_bits;
 
-  *huff = (z_huff_table_t) { };
+  if(values > Z_MAX_SYMS) {
+    inflate_state->bad = __LINE__;
+    return;
+  }
 
   for(unsigned u = 0; u < values; u++) {
     unsigned bits = code_bits[u];
@@ -263,57 +332,78 @@ void z_init_huff_table(z_inflate_state_t *inflate_state, z_huff_table_t *huff, u
     if(bits) count[bits]++;
   }
 
+  // reject over-subscribed codes; incomplete codes are ok
+  int left = 1;
+  for(unsigned bits = 1; bits <= Z_MAX_CODE_BITS; bits++) {
+    left = (left << 1) - (int) count[bits];
+    if(left < 0) {
+      inflate_state->bad = __LINE__;
+      return;
+    }
+  }
+
   unsigned code = 0;
-  unsigned ofs = 0;
   for(unsigned bits = 1; bits <= Z_MAX_CODE_BITS; bits++) {
     code = (code + count[bits - 1]) << 1;
-    if(count[bits]) {
-      huff->codes[bits].ofs = pos[bits] = ofs;
-      huff->codes[bits].min = code;
-      huff->codes[bits].max_1 = code + count[bits];
-    }
-    ofs += count[bits];
+    next_code[bits] = code;
   }
 
-  for(unsigned u = 0; u < values; u++ ) {
+  // size secondary tables: enough bits for the longest code sharing a prefix
+  for(unsigned u = 0; u < values; u++) {
     unsigned bits = code_bits[u];
     if(!bits) continue;
-    unsigned idx = pos[bits]++;
-    if(idx >= Z_MAX_SYMS) {
+    unsigned prefix = z_reverse_bits(next_code[bits]++, bits) & (root_size - 1);
+    if(bits > root_bits && bits - root_bits > sub_bits[prefix]) sub_bits[prefix] = (uint8_t) (bits - root_bits);
+  }
+
+  gfx_memset(huff->table, 0, root_size * sizeof *huff->table);
+
+  unsigned used = root_size;
+  for(unsigned u = 0; u < root_size; u++) {
+    if(!sub_bits[u]) continue;
+    unsigned size = 1u << sub_bits[u];
+    if(used + size > huff->size) {
       inflate_state->bad = __LINE__;
       return;
     }
-    huff->syms[idx] = u;
+    huff->table[u] = (uint16_t) (Z_HUFF_LINK + ((unsigned) sub_bits[u] << 10) + used);
+    gfx_memset(huff->table + used, 0, size * sizeof *huff->table);
+    used += size;
   }
 
-#ifdef WITH_Z_LOG
-  Z_LOG("+++ Huffman table +++\n");
-
-  for(unsigned u = 0; u <= Z_MAX_CODE_BITS; u++) {
-    if(count[u]) Z_LOG("+++ bits[%2u] = %3u\n", u, count[u]);
+  // fill in symbols, replicating each entry for all unused trailing bits
+  for(unsigned bits = 1; bits <= Z_MAX_CODE_BITS; bits++) {
+    next_code[bits] -= count[bits];
   }
 
-  for(unsigned u = 0; u <= Z_MAX_CODE_BITS; u++) {
-    if(huff->codes[u].max_1) {
-      Z_LOG(
-        "+++ tbl.bits[%2u]: ofs %3u, min %10b, max %10b\n",
-        u, huff->codes[u].ofs, huff->codes[u].min, huff->codes[u].max_1 - 1
-      );
+  for(unsigned u = 0; u < values; u++) {
+    unsigned bits = code_bits[u];
+    if(!bits) continue;
+    unsigned rev = z_reverse_bits(next_code[bits]++, bits);
+    if(bits <= root_bits) {
+      for(unsigned idx = rev; idx < root_size; idx += 1u << bits) {
+        huff->table[idx] = (uint16_t) ((bits << 9) + u);
+      }
+    }
+    else {
+      unsigned link = huff->table[rev & (root_size - 1)];
+      uint16_t *sub_table = huff->table + (link & 0x3ff);
+      unsigned sub_size = 1u << ((link >> 10) & 0xf);
+      bits -= root_bits;
+      for(unsigned idx = rev >> root_bits; idx < sub_size; idx += 1u << bits) {
+        sub_table[idx] = (uint16_t) ((bits << 9) + u);
+      }
     }
   }
 
-  unsigned lines = values < 32 ? values : 32;
+#ifdef WITH_Z_LOG
+  Z_LOG("+++ Huffman table +++\n");
 
-  for(unsigned line = 0; line < lines; line++) {
-    Z_LOG("+++ ");
-    for(unsigned col = 0; col < 9; col++) {
-      unsigned u = col * lines + line;
-      if(u < values) {
-        Z_LOG("  [%3u] = %3u", u, huff->syms[u]);
-      }
-    }
-    Z_LOG("\n");
+  for(unsigned u = 0; u <= Z_MAX_CODE_BITS; u++) {
+    if(count[u]) Z_LOG("+++ bits[%2u] = %3u\n", u, count[u]);
   }
+
+  Z_LOG("+++ table: root bits %u, entries %u/%u\n", root_bits, used, huff->size);
 #endif
 }
 
@@ -406,11 +496,11 @@ void z_setup_dynamic_huff_table(z_inflate_state_t *inflate_state)
     Z_LOG("+++ [%3u] - repeat = %3u, bits = %2u\n", u, repeat, bits);
 
     while(repeat--) {
-      all_bits[u++] = bits;
-      if(u > all_len) {
+      if(u >= all_len) {
         inflate_state->bad = __LINE__;
         return;
       }
+      all_bits[u++] = bits;
     }
   }
 
@@ -527,6 +617,10 @@ void z_inflate(z_inflate_state_t *inflate_state)
 
   inflate_state->adler32.low = 1;
 
+  inflate_state->huff_lit = (z_huff_table_t) { .bits = Z_LIT_ROOT_BITS, .size = Z_LIT_TABLE_SIZE, .table = inflate_state->lit_table };
+  inflate_state->huff_dist = (z_huff_table_t) { .bits = Z_DIST_ROOT_BITS, .size = Z_DIST_TABLE_SIZE, .table = inflate_state->dist_table };
+  inflate_state->huff_clen = (z_huff_table_t) { .bits = Z_CLEN_ROOT_BITS, .size = Z_CLEN_TABLE_SIZE, .table = inflate_state->clen_table };
+
   while(!inflate_state->bad) {
     unsigned bfinal = z_get_bits(inflate_state, 1);
     unsigned btype = z_get_bits(inflate_state, 2);
@@ -552,6 +646,18 @@ void z_inflate(z_inflate_state_t *inflate_state)
     if(bfinal) break;
   }
 
+  // incomplete last scanline
+  if(!inflate_state->bad && inflate_state->png.row_pos) {
+    if(inflate_state->png.y >= inflate_state->png.height) {
+      inflate_state->bad = __LINE__;
+    }
+    else {
+      png_data_t *png = &inflate_state->png;
+      gfx_memset(png->row + png->row_pos, 0, png->row_len - png->row_pos);
+      png_row_done(inflate_state);
+    }
+  }
+
   if(!inflate_state->bad) {
     unsigned adler32_stored = 0;
     for(unsigned u = 0; u < 4; u++) {
@@ -569,13 +675,6 @@ void z_inflate(z_inflate_state_t *inflate_state)
     }
   }
 
-  if(!inflate_state->bad && inflate_state->png.pixel_bytes == 4) {
-    // invert alpha values (so that 0 = fully opaque)
-    for(unsigned u = 3; u < inflate_state->output.pos; u += 4) {
-      inflate_state->output.buf[u] = 255 - inflate_state->output.buf[u];
-    }
-  }
-
   return;
 }
 
@@ -597,6 +696,204 @@ unsigned png_paeth(int a, int b, int c)
 }
 
 
+// Undo PNG filter for one scanline.
+//
+// row: current scanline (without filter byte), prev: previous (already
+// unfiltered) scanline, len: bytes, bpp: bytes per pixel (3 or 4).
+//
+// Both buffers must be readable up to 16 bytes past 'len'.
+void png_unfilter_row(unsigned filter, uint8_t *row, uint8_t *prev, unsigned len, unsigned bpp)
+{
+  unsigned u = 0;
+
+#if defined(__SSE2__)
+  // Sub, Avg, and Paeth depend on the pixel to the left: do one pixel at a time
+  // but all color channels in parallel. Up has no dependency: 16 bytes at a time.
+
+  // fixed size copies; the 4 byte load may read past a 3 byte pixel
+  #define PNG_LOAD(p) ({ int tmp; __builtin_memcpy(&tmp, p, 4); _mm_cvtsi32_si128(bpp == 4 ? tmp : tmp & 0xffffff); })
+  #define PNG_STORE(p, x) do { \
+    int tmp = _mm_cvtsi128_si32(x); \
+    if(bpp == 4) __builtin_memcpy(p, &tmp, 4); else __builtin_memcpy(p, &tmp, 3); \
+  } while(0)
+
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a, b, c, x;
+
+  switch(filter) {
+    case 1:
+      a = zero;
+      for(; u + bpp <= len; u += bpp) {
+        a = _mm_add_epi8(a, PNG_LOAD(row + u));
+        PNG_STORE(row + u, a);
+      }
+      break;
+
+    case 2:
+      for(; u + 16 <= len; u += 16) {
+        x = _mm_add_epi8(_mm_loadu_si128((__m128i *) (row + u)), _mm_loadu_si128((__m128i *) (prev + u)));
+        _mm_storeu_si128((__m128i *) (row + u), x);
+      }
+      break;
+
+    case 3:
+      a = zero;
+      for(; u + bpp <= len; u += bpp) {
+        b = PNG_LOAD(prev + u);
+        // (a + b) >> 1 == avg(a, b) - ((a ^ b) & 1)
+        x = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        a = _mm_add_epi8(PNG_LOAD(row + u), x);
+        PNG_STORE(row + u, a);
+      }
+      break;
+
+    case 4:
+      // 16 bit channels
+      a = c = zero;
+      for(; u + bpp <= len; u += bpp) {
+        b = _mm_unpacklo_epi8(PNG_LOAD(prev + u), zero);
+
+        // pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+        pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+        // same tie breaking as png_paeth()
+        __m128i use_c = _mm_cmplt_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i use_b = _mm_cmplt_epi16(pb, pa);
+        x = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, a));
+        x = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, x));
+
+        x = _mm_add_epi8(PNG_LOAD(row + u), _mm_packus_epi16(x, zero));
+        PNG_STORE(row + u, x);
+
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+      }
+      break;
+  }
+
+  #undef PNG_LOAD
+  #undef PNG_STORE
+#endif
+
+  // scalar version (and remaining bytes)
+  switch(filter) {
+    case 1:
+      for(u = u < bpp ? bpp : u; u < len; u++) {
+        row[u] += row[u - bpp];
+      }
+      break;
+
+    case 2:
+      for(; u < len; u++) {
+        row[u] += prev[u];
+      }
+      break;
+
+    case 3:
+      for(; u < bpp && u < len; u++) {
+        row[u] += prev[u] >> 1;
+      }
+      for(; u < len; u++) {
+        row[u] += (row[u - bpp] + prev[u]) >> 1;
+      }
+      break;
+
+    case 4:
+      for(; u < bpp && u < len; u++) {
+        row[u] += prev[u];
+      }
+      for(; u < len; u++) {
+        row[u] += png_paeth(row[u - bpp], prev[u], prev[u - bpp]);
+      }
+      break;
+  }
+}
+
+
+// Convert one unfiltered scanline to canvas pixels.
+//
+//   - png order: r, g, b, (a)
+//   - our order: b, g, r, a
+//
+// Alpha values are inverted (so that 0 = fully opaque).
+void png_convert_row(uint8_t *dst, uint8_t *src, unsigned width, unsigned bpp)
+{
+  unsigned u = 0;
+
+  if(bpp == 4) {
+#if defined(__SSE2__)
+    const __m128i ga_mask = _mm_set1_epi32((int) 0xff00ff00);
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128i alpha_mask = _mm_set1_epi32((int) 0xff000000);
+
+    for(; u + 4 <= width; u += 4) {
+      __m128i x = _mm_loadu_si128((__m128i *) (src + 4 * u));
+      __m128i y = _mm_xor_si128(_mm_and_si128(x, ga_mask), alpha_mask);
+      y = _mm_or_si128(y, _mm_slli_epi32(_mm_and_si128(x, byte_mask), 16));
+      y = _mm_or_si128(y, _mm_and_si128(_mm_srli_epi32(x, 16), byte_mask));
+      _mm_storeu_si128((__m128i *) (dst + 4 * u), y);
+    }
+#endif
+
+    for(src += 4 * u, dst += 4 * u; u < width; u++, src += 4, dst += 4) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      dst[3] = 255 - src[3];
+    }
+  }
+  else {
+    for(; u < width; u++, src += 3, dst += 4) {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+      dst[3] = 0;
+    }
+  }
+}
+
+
+// Process complete scanline.
+//
+// The raw scanline (with filter byte) is in png->row; it is added to the
+// checksum, unfiltered, and converted into the output buffer.
+void png_row_done(z_inflate_state_t *inflate_state)
+{
+  png_data_t *png = &inflate_state->png;
+
+  z_adler32_update(inflate_state, png->row, png->row_pos);
+
+  png->row_pos = 0;
+
+  if(png->y >= png->height) {
+    inflate_state->bad = __LINE__;
+    return;
+  }
+
+  PNG_LOG("+++ filter[%u] = %u\n", png->y, png->row[0]);
+
+  if(png->row[0] > 4) {
+    inflate_state->bad = __LINE__;
+    return;
+  }
+
+  png_unfilter_row(png->row[0], png->row + 1, png->prev_row + 1, png->row_len - 1, png->pixel_bytes);
+
+  png_convert_row(inflate_state->output.buf + png->y * png->width * 4, png->row + 1, png->width, png->pixel_bytes);
+
+  uint8_t *tmp = png->prev_row;
+  png->prev_row = png->row;
+  png->row = tmp;
+
+  png->y++;
+}
+
+
 uint32_t png_get_uint32(uint8_t *buf)
 {
   return ((unsigned) buf[0] << 24) + (buf[1] << 16) + (buf[2] << 8) + buf[3];
@@ -716,7 +1013,17 @@ unsigned gfx_png_getsize(uint8_t *buf, unsigned len)
 }
 
 
-unsigned gfx_png_decode(uint8_t *in_buf, unsigned in_len, uint8_t *out_buf, unsigned out_len, uint8_t *window_buf)
+// Size of the work buffer gfx_png_decode() needs for an image of the given width.
+unsigned gfx_png_bufsize(unsigned width)
+{
+  return Z_WINDOW_SIZE + 2 * PNG_ROW_SIZE(width);
+}
+
+
+// Decode png image into out_buf (4 bytes per pixel).
+//
+// work_buf must be gfx_png_bufsize() bytes.
+unsigned gfx_png_decode(uint8_t *in_buf, unsigned in_len, uint8_t *out_buf, unsigned out_len, uint8_t *work_buf)
 {
   z_inflate_state_t *inflate_state = &(z_inflate_state_t) { };
 
@@ -726,17 +1033,26 @@ unsigned gfx_png_decode(uint8_t *in_buf, unsigned in_len, uint8_t *out_buf, unsi
   inflate_state->output.len = out_len;
   inflate_state->output.buf = out_buf;
 
-  inflate_state->window.buf = window_buf;
+  inflate_state->window.buf = work_buf;
 
   png_get_size(inflate_state);
 
+  png_data_t *png = &inflate_state->png;
+
   if(!(
-    inflate_state->png.width && inflate_state->png.height &&
-    inflate_state->png.width * inflate_state->png.height * 4 == out_len
+    png->width && png->height &&
+    png->width * png->height * 4 == out_len
   )) {
     return 1;
   }
 
+  png->row_len = png->width * png->pixel_bytes + 1;
+  png->row = work_buf + Z_WINDOW_SIZE;
+  png->prev_row = png->row + PNG_ROW_SIZE(png->width);
+
+  // the scanline before the first is all zeros
+  gfx_memset(png->prev_row, 0, PNG_ROW_SIZE(png->width));
+
   z_inflate(inflate_state);
 
   return inflate_state->bad ? 1 : 0;
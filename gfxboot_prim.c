@@ -2,10 +2,9 @@
 
 #define WITH_PRIM_NAMES 1
 #define WITH_PRIM_HEADERS 1
+#define WITH_PRIM_HASH 1
 #include <gfxboot/vocabulary.h>
 
-static obj_id_t prim_array_start_id = 0;
-static obj_id_t prim_hash_start_id = 0;
 
 typedef enum {
   op_sub, op_mul, op_div, op_mod, op_and, op_or, op_xor, op_min, op_max, op_shl, op_shr,
@@ -34,6 +33,7 @@ static void gfx_prim__add(unsigned direct);
 arg_t *gfx_arg_1(uint8_t type)
 {
   static arg_t argv[1];
+  static obj_t imm[1];
   unsigned is_nil = type & IS_NIL;
   unsigned is_rw = type & IS_RW;
   type &= TYPE_MASK;
@@ -49,7 +49,8 @@ arg_t *gfx_arg_1(uint8_t type)
   }
 
   obj_id_t id = argv[0].id = pstack->ptr[pstack->size - 1];
-  obj_t *ptr = argv[0].ptr = gfx_obj_ptr(id);
+  // immediate values are expanded into a private copy
+  obj_t *ptr = argv[0].ptr = OBJ_ID_IS_IMM(id) ? gfx_obj_num_imm(id, imm) : gfx_obj_ptr(id);
 
   if(
     (ptr && (type == ptr->base_type || type == OTYPE_ANY)) ||
@@ -75,6 +76,7 @@ arg_t *gfx_arg_n(unsigned argc, uint8_t arg_types[])
 {
   unsigned i;
   static arg_t argv[8];
+  static obj_t imm[8];
 
 #if 0
   if(argc >= sizeof argv / sizeof *argv) {
@@ -99,7 +101,8 @@ arg_t *gfx_arg_n(unsigned argc, uint8_t arg_types[])
 
   for(i = 0; i < argc; i++) {
     obj_id_t id = argv[i].id = stack[i];
-    obj_t *ptr = argv[i].ptr = gfx_obj_ptr(id);
+    // immediate values are expanded into a private copy
+    obj_t *ptr = argv[i].ptr = OBJ_ID_IS_IMM(id) ? gfx_obj_num_imm(id, imm + i) : gfx_obj_ptr(id);
 
     uint8_t type = arg_types[i];
     unsigned is_nil = type & IS_NIL;
@@ -128,56 +131,183 @@ arg_t *gfx_arg_n(unsigned argc, uint8_t arg_types[])
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Set up global dictionary.
+//
+// Primitives are not stored in the global dictionary; they are looked up
+// as last resort, see gfx_lookup_dict_cached().
+//
 // return: 0 = failed, 1 = ok
 //
 int gfx_setup_dict()
 {
-  unsigned u;
-  obj_id_t prim_id;
-
   gfx_obj_ref_dec(gfxboot_data->vm.program.dict);
   gfxboot_data->vm.program.dict = gfx_obj_hash_new(0);
   if(!gfxboot_data->vm.program.dict) return 0;
 
-  for(u = 0; u < sizeof prim_names / sizeof *prim_names ; u++) {
-    gfx_obj_hash_set(
-      gfxboot_data->vm.program.dict,
-      gfx_obj_const_mem_nofree_new((const uint8_t *) prim_names[u], gfx_strlen(prim_names[u]), t_ref, 0),
-      prim_id = gfx_obj_num_new(u, t_prim),
-      0
-    );
+  gfx_obj_ref_dec(gfxboot_data->vm.program.prims);
+  gfxboot_data->vm.program.prims = gfx_obj_array_new(sizeof prim_names / sizeof *prim_names);
+  if(!gfxboot_data->vm.program.prims) return 0;
 
-    switch(u) {
-      case prim_idx_array_start:
-        prim_array_start_id = prim_id;
-        break;
-      case prim_idx_hash_start:
-        prim_hash_start_id = prim_id;
-        break;
-    }
+  for(unsigned u = 0; u < sizeof prim_names / sizeof *prim_names; u++) {
+    gfx_obj_array_push(gfxboot_data->vm.program.prims, gfx_obj_num_new(u, t_prim), 0);
   }
 
-  if(!prim_array_start_id || !prim_hash_start_id) return 0;
+  gfxboot_data->vm.program.array_start_id = gfx_prim_id(prim_idx_array_start);
+  gfxboot_data->vm.program.hash_start_id = gfx_prim_id(prim_idx_hash_start);
+
+  if(!gfxboot_data->vm.program.array_start_id || !gfxboot_data->vm.program.hash_start_id) return 0;
 
   return 1;
 }
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Look up primitive by name.
+//
+// This uses the perfect hash generated by mk_vocabulary.
+//
+// Return primitive index + 1, or 0 if there's no such primitive.
+//
+unsigned gfx_prim_lookup(data_t *key)
+{
+  uint32_t h = gfx_obj_hash_key(key);
+  unsigned slot = ((h ^ prim_hash_disp[h & (PRIM_HASH_BUCKETS - 1)]) * PRIM_HASH_MUL) >> (32 - PRIM_HASH_BITS);
+  unsigned idx = prim_hash_table[slot];
+
+  if(!idx) return 0;
+
+  const char *name = prim_names[idx - 1];
+
+  if(gfx_strlen(name) != key->size || gfx_memcmp(name, key->ptr, key->size)) return 0;
+
+  return idx;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get object for primitive idx.
+//
+// Return 0 if there's no such primitive.
+//
+obj_id_t gfx_prim_id(unsigned idx)
+{
+  array_t *a = gfx_obj_array_ptr(gfxboot_data->vm.program.prims);
+
+  return a && idx < a->size ? a->ptr[idx] : 0;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Get name of primitive idx.
+//
+// Return 0 if there's no such primitive.
+//
+const char *gfx_prim_name(unsigned idx)
+{
+  return idx < sizeof prim_names / sizeof *prim_names ? prim_names[idx] : 0;
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Run primitive.
+//
+// If vm.debug.prim_stats.enabled is set, calls, cpu cycles, and memory
+// allocations are accumulated per primitive in vm.debug.prim_stats.id.
 //
 error_id_t gfx_run_prim(unsigned prim)
 {
-  if(prim > sizeof gfx_prim_list / sizeof *gfx_prim_list) {
+  unsigned prims = sizeof gfx_prim_list / sizeof *gfx_prim_list;
+
+  if(prim >= prims) {
     GFX_ERROR(err_invalid_code);
     return gfxboot_data->vm.error.id;
   }
 
+  if(!gfxboot_data->vm.debug.prim_stats.enabled) {
+    gfx_prim_list[prim]();
+
+    return gfxboot_data->vm.error.id;
+  }
+
+  if(!gfxboot_data->vm.debug.prim_stats.id) {
+    gfxboot_data->vm.debug.prim_stats.id = gfx_obj_mem_new(prims * sizeof (prim_stats_t), 0);
+  }
+
+  uint64_t allocs = gfxboot_data->vm.debug.prim_stats.allocs;
+  uint64_t tsc_start = gfx_tsc();
+
   gfx_prim_list[prim]();
 
+  uint64_t cycles = gfx_tsc() - tsc_start;
+
+  // the primitive may have changed the object list, so get the pointer only now
+  data_t *mem = gfx_obj_mem_ptr(gfxboot_data->vm.debug.prim_stats.id);
+
+  if(mem && mem->size == prims * sizeof (prim_stats_t)) {
+    prim_stats_t *stats = (prim_stats_t *) mem->ptr + prim;
+    stats->calls++;
+    stats->cycles += cycles;
+    stats->allocs += gfxboot_data->vm.debug.prim_stats.allocs - allocs;
+  }
+
   return gfxboot_data->vm.error.id;
 }
 
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Show primitive statistics, most expensive primitive first.
+//
+void gfx_prim_stats_dump()
+{
+  unsigned u, v, len = 0;
+  unsigned idx[sizeof prim_names / sizeof *prim_names];
+  prim_stats_t total = { };
+
+  data_t *mem = gfx_obj_mem_ptr(gfxboot_data->vm.debug.prim_stats.id);
+
+  if(!mem || mem->size != sizeof idx / sizeof *idx * sizeof (prim_stats_t)) {
+    gfxboot_log("no primitive statistics\n");
+    return;
+  }
+
+  prim_stats_t *stats = mem->ptr;
+
+  for(u = 0; u < sizeof idx / sizeof *idx; u++) {
+    if(!stats[u].calls) continue;
+    idx[len++] = u;
+    total.calls += stats[u].calls;
+    total.allocs += stats[u].allocs;
+  }
+
+  gfxboot_log(
+    "primitives: calls = %llu, allocs = %llu\n",
+    (unsigned long long) total.calls, (unsigned long long) total.allocs
+  );
+  gfxboot_log("%12s %14s %11s %10s  %s\n", "calls", "cycles", "cycles/call", "allocs", "name");
+
+  // selection sort, most cycles first
+  for(u = 0; u < len; u++) {
+    unsigned max = u;
+    for(v = u + 1; v < len; v++) {
+      if(stats[idx[v]].cycles > stats[idx[max]].cycles) max = v;
+    }
+    unsigned tmp = idx[max];
+    idx[max] = idx[u];
+    idx[u] = tmp;
+
+    prim_stats_t *s = stats + tmp;
+    gfxboot_log(
+      "%12llu %14llu %11llu %10llu  %s\n",
+      (unsigned long long) s->calls,
+      (unsigned long long) s->cycles,
+      (unsigned long long) (s->cycles / s->calls),
+      (unsigned long long) s->allocs,
+      prim_names[tmp]
+    );
+  }
+}
+
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // start code block
 //
@@ -236,12 +366,12 @@ void gfx_prim_code_end()
       break;
 
     case t_ctx_loop:
-      context->ip = 0;
+      gfx_obj_context_rewind(context);
       break;
 
     case t_ctx_repeat:
       if(--context->index) {
-        context->ip = 0;
+        gfx_obj_context_rewind(context);
       }
       else {
         OBJ_ID_ASSIGN(gfxboot_data->vm.program.context, parent_id);
@@ -254,7 +384,7 @@ void gfx_prim_code_end()
         (context->inc > 0 && context->index <= context->max) ||
         (context->inc < 0 && context->index >= context->max)
       ) {
-        context->ip = 0;
+        gfx_obj_context_rewind(context);
         gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfx_obj_num_new(context->index, t_int), 0);
       }
       else {
@@ -270,7 +400,7 @@ void gfx_prim_code_end()
       context->index = idx;
 
       if(items) {
-        context->ip = 0;
+        gfx_obj_context_rewind(context);
         // note: reference counting for val1 and val2 has been done inside gfx_obj_iterate()
         gfx_obj_array_push(gfxboot_data->vm.program.pstack, val1, 0);
         if(items > 1) gfx_obj_array_push(gfxboot_data->vm.program.pstack, val2, 0);
@@ -304,7 +434,7 @@ void gfx_prim_code_end()
 //
 void gfx_prim_array_start()
 {
-  gfx_obj_array_push(gfxboot_data->vm.program.pstack, prim_array_start_id, 1);
+  gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfxboot_data->vm.program.array_start_id, 1);
 }
 
 
@@ -336,7 +466,7 @@ void gfx_prim_array_end()
   unsigned start_idx = -1u;
 
   while(idx-- > 0) {
-    if(a->ptr[idx] == prim_array_start_id) {
+    if(a->ptr[idx] == gfxboot_data->vm.program.array_start_id) {
       start_idx = idx;
       break;
     }
@@ -362,7 +492,7 @@ void gfx_prim_array_end()
   a->size = start_idx + 1;
   a->ptr[start_idx] = array_id;
 
-  gfx_obj_ref_dec(prim_array_start_id);
+  gfx_obj_ref_dec(gfxboot_data->vm.program.array_start_id);
 }
 
 
@@ -383,7 +513,7 @@ void gfx_prim_array_end()
 //
 void gfx_prim_hash_start()
 {
-  gfx_obj_array_push(gfxboot_data->vm.program.pstack, prim_hash_start_id, 1);
+  gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfxboot_data->vm.program.hash_start_id, 1);
 }
 
 
@@ -416,7 +546,7 @@ void gfx_prim_hash_end()
   unsigned start_idx = -1u;
 
   while(idx-- > 0) {
-    if(a->ptr[idx] == prim_hash_start_id) {
+    if(a->ptr[idx] == gfxboot_data->vm.program.hash_start_id) {
       start_idx = idx;
       break;
     }
@@ -451,7 +581,7 @@ void gfx_prim_hash_end()
   a->size = start_idx + 1;
   a->ptr[start_idx] = hash_id;
 
-  gfx_obj_ref_dec(prim_hash_start_id);
+  gfx_obj_ref_dec(gfxboot_data->vm.program.hash_start_id);
 }
 
 
@@ -481,7 +611,7 @@ void gfx_prim_def_at(unsigned where)
   obj_id_t dict_id = 0;
 
   if(where == 0) {
-    obj_id_pair_t pair = gfx_lookup_dict(OBJ_DATA_FROM_PTR(ptr1));
+    obj_id_pair_t pair = gfx_lookup_dict_cached(OBJ_DATA_FROM_PTR(ptr1), gfx_program_sym(ptr1), 0);
     if(pair.id1) {
       dict_id = pair.id1;
     }
@@ -508,18 +638,7 @@ void gfx_prim_def_at(unsigned where)
       }
     }
 
-    if(!context->dict_id) {
-      // careful: gfx_obj_hash_new() may invalidate context pointer
-      obj_id_t tmp_id = gfx_obj_hash_new(0);
-      context = gfx_obj_context_ptr(context_id);
-      if(!context) {
-        GFX_ERROR(err_internal);
-        return;
-      }
-      context->dict_id = tmp_id;
-    }
-
-    dict_id = context->dict_id;
+    dict_id = gfx_obj_context_dict(context_id, 1);
 
     if(!dict_id) {
       GFX_ERROR(err_internal);
@@ -823,14 +942,14 @@ void gfx_prim_repeat()
   obj_id_t id1 = pstack->ptr[pstack->size - 2];
   obj_id_t id2 = pstack->ptr[pstack->size - 1];
 
-  int64_t *count = gfx_obj_num_subtype_ptr(id1, t_int);
+  int64_t count;
 
-  if(!count || !gfx_is_code(id2)) {
+  if(!gfx_obj_num_value(id1, t_int, &count) || !gfx_is_code(id2)) {
     GFX_ERROR(err_invalid_code);
     return;
   }
 
-  if(*count > 0) {
+  if(count > 0) {
     obj_id_t context_id = gfx_obj_context_new(t_ctx_repeat);
     context_t *context = gfx_obj_context_ptr(context_id);
 
@@ -840,7 +959,7 @@ void gfx_prim_repeat()
     }
 
     context->code_id = gfx_obj_ref_inc(id2);
-    context->index = *count;
+    context->index = count;
 
     context->parent_id = gfxboot_data->vm.program.context;
     gfxboot_data->vm.program.context = context_id;
@@ -891,11 +1010,14 @@ void gfx_prim_for()
   obj_id_t id3 = pstack->ptr[pstack->size - 2];
   obj_id_t id4 = pstack->ptr[pstack->size - 1];
 
-  int64_t *start = gfx_obj_num_subtype_ptr(id1, t_int);
-  int64_t *inc = gfx_obj_num_subtype_ptr(id2, t_int);
-  int64_t *max = gfx_obj_num_subtype_ptr(id3, t_int);
+  int64_t start, inc, max;
 
-  if(!start || !inc || !max || !gfx_is_code(id4)) {
+  if(
+    !gfx_obj_num_value(id1, t_int, &start) ||
+    !gfx_obj_num_value(id2, t_int, &inc) ||
+    !gfx_obj_num_value(id3, t_int, &max) ||
+    !gfx_is_code(id4)
+  ) {
     GFX_ERROR(err_invalid_arguments);
     return;
   }
@@ -903,8 +1025,8 @@ void gfx_prim_for()
   int pop_count = 4;
 
   if(
-    (*inc > 0 && *start <= *max) ||
-    (*inc < 0 && *start >= *max)
+    (inc > 0 && start <= max) ||
+    (inc < 0 && start >= max)
   ) {
     obj_id_t context_id = gfx_obj_context_new(t_ctx_for);
     context_t *context = gfx_obj_context_ptr(context_id);
@@ -915,9 +1037,9 @@ void gfx_prim_for()
     }
 
     context->code_id = gfx_obj_ref_inc(id4);
-    context->index = *start;
-    context->inc = *inc;
-    context->max = *max;
+    context->index = start;
+    context->inc = inc;
+    context->max = max;
 
     context->parent_id = gfxboot_data->vm.program.context;
     gfxboot_data->vm.program.context = context_id;
@@ -993,6 +1115,10 @@ void gfx_prim_forall()
     context->index = idx;
     context->iterate_id = gfx_obj_ref_inc(id1);
 
+    // keep hash entries in place while the loop runs, see gfx_obj_context_gc()
+    hash_t *hash = gfx_obj_hash_ptr(id1);
+    if(hash) hash->iterating++;
+
     context->parent_id = gfxboot_data->vm.program.context;
     gfxboot_data->vm.program.context = context_id;
 
@@ -1120,7 +1246,8 @@ void gfx_prim_string()
 
   obj_id_t id1 = pstack->ptr[pstack->size - 1];
 
-  obj_t *ptr1 = gfx_obj_ptr(id1);
+  obj_t imm1;
+  obj_t *ptr1 = OBJ_ID_IS_IMM(id1) ? gfx_obj_num_imm(id1, &imm1) : gfx_obj_ptr(id1);
   if(!ptr1) {
     GFX_ERROR(err_invalid_arguments);
     return;
@@ -1212,12 +1339,12 @@ void gfx_prim_get()
   switch(ptr1->base_type) {
     case OTYPE_ARRAY:
       {
-        int64_t *idx = gfx_obj_num_ptr(id2);
-        if(!idx) {
+        int64_t idx;
+        if(!gfx_obj_num_value(id2, t_nil, &idx)) {
           GFX_ERROR(err_invalid_range);
           return;
         }
-        val = gfx_obj_array_get(id1, *idx);
+        val = gfx_obj_array_get(id1, idx);
         gfx_obj_ref_inc(val);
       }
       break;
@@ -1229,19 +1356,19 @@ void gfx_prim_get()
           GFX_ERROR(err_invalid_hash_key);
           return;
         }
-        val = gfx_obj_hash_get(id1, key).id2;
+        val = gfx_obj_hash_get_cached(id1, key, gfx_program_sym(gfx_obj_ptr(id2)), 0, 0).id2;
         gfx_obj_ref_inc(val);
       }
       break;
 
     case OTYPE_MEM:
       {
-        int64_t *idx = gfx_obj_num_ptr(id2);
-        if(!idx) {
+        int64_t idx;
+        if(!gfx_obj_num_value(id2, t_nil, &idx)) {
           GFX_ERROR(err_invalid_range);
           return;
         }
-        int i = gfx_obj_mem_get(id1, *idx);
+        int i = gfx_obj_mem_get(id1, idx);
         if(i != -1) {
           val = gfx_obj_num_new(i, t_int);
         }
@@ -1262,14 +1389,15 @@ void gfx_prim_get()
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-void gfx_prim_get_x(data_t *key)
+void gfx_prim_get_x(data_t *key, uint32_t sym, hash_cache_t *cache)
 {
   arg_t *argv;
+  unsigned pos = 0;
 
   argv = gfx_arg_1(OTYPE_HASH);
 
   if(argv) {
-    obj_id_pair_t pair = gfx_obj_hash_get(argv[0].id, key);
+    obj_id_pair_t pair = gfx_obj_hash_get_cached(argv[0].id, key, sym, cache, &pos);
     if(!pair.id1) {
       GFX_ERROR(err_invalid_arguments);
       return;
@@ -1280,14 +1408,14 @@ void gfx_prim_get_x(data_t *key)
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-void gfx_prim_put_x(obj_id_t key)
+void gfx_prim_put_x(obj_id_t key, hash_cache_t *cache)
 {
   arg_t *argv;
 
   argv = gfx_arg_n(2, (uint8_t [2]) { OTYPE_HASH | IS_RW, OTYPE_ANY | IS_NIL });
 
   if(argv) {
-    if(!gfx_obj_hash_set(argv[0].id, key, argv[1].id, 1)) {
+    if(!gfx_obj_hash_set_cached(argv[0].id, key, argv[1].id, 1, cache)) {
       GFX_ERROR(err_invalid_hash_key);
       return;
     }
@@ -1519,12 +1647,12 @@ void gfx_prim_delete()
   switch(ptr1->base_type) {
     case OTYPE_ARRAY:
       {
-        int64_t *idx = gfx_obj_num_ptr(id2);
-        if(!idx) {
+        int64_t idx;
+        if(!gfx_obj_num_value(id2, t_nil, &idx)) {
           GFX_ERROR(err_invalid_range);
           return;
         }
-        gfx_obj_array_del(id1, *idx, 1);
+        gfx_obj_array_del(id1, idx, 1);
       }
       break;
 
@@ -1541,12 +1669,12 @@ void gfx_prim_delete()
 
     case OTYPE_MEM:
       {
-        int64_t *idx = gfx_obj_num_ptr(id2);
-        if(!idx) {
+        int64_t idx;
+        if(!gfx_obj_num_value(id2, t_nil, &idx)) {
           GFX_ERROR(err_invalid_range);
           return;
         }
-        gfx_obj_mem_del(id1, *idx);
+        gfx_obj_mem_del(id1, idx);
       }
       break;
 
@@ -1811,16 +1939,15 @@ void gfx_prim_roll()
   obj_id_t id1 = pstack->ptr[pstack->size - 2];
   obj_id_t id2 = pstack->ptr[pstack->size - 1];
 
-  int64_t *xlen = gfx_obj_num_ptr(id1);
-  int64_t *xofs = gfx_obj_num_ptr(id2);
+  int64_t xlen, xofs;
 
-  if(!xlen || *xlen < 0 || !xofs) {
+  if(!gfx_obj_num_value(id1, t_nil, &xlen) || xlen < 0 || !gfx_obj_num_value(id2, t_nil, &xofs)) {
     GFX_ERROR(err_invalid_arguments);
     return;
   }
 
-  int len = *xlen;
-  int ofs = *xofs;
+  int len = xlen;
+  int ofs = xofs;
 
   if((unsigned) len + 2 > pstack->size) {
     GFX_ERROR(err_stack_underflow);
@@ -1990,19 +2117,19 @@ void gfx_prim_index()
   }
 
   obj_id_t id1 = pstack->ptr[pstack->size - 1];
-  int64_t *idx = gfx_obj_num_ptr(id1);
+  int64_t idx;
 
-  if(!idx || *idx < 0) {
+  if(!gfx_obj_num_value(id1, t_nil, &idx) || idx < 0) {
     GFX_ERROR(err_invalid_range);
     return;
   }
 
-  if(*idx + 2 > pstack->size) {
+  if(idx + 2 > pstack->size) {
     GFX_ERROR(err_stack_underflow);
     return;
   }
 
-  obj_id_t id2 = pstack->ptr[pstack->size - 2 - *idx];
+  obj_id_t id2 = pstack->ptr[pstack->size - 2 - idx];
 
   gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
 
@@ -2013,11 +2140,11 @@ void gfx_prim_index()
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 void gfx_exec_id(obj_id_t dict_id, obj_id_t id, int on_stack)
 {
-  int64_t *val;
+  int64_t val;
 
-  if((val = gfx_obj_num_subtype_ptr(id, t_prim))) {
+  if(gfx_obj_num_value(id, t_prim, &val)) {
     if(on_stack) gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
-    gfx_run_prim(*val);
+    gfx_run_prim(val);
   }
   else if(gfx_obj_mem_subtype_ptr(id, t_code)) {
     obj_id_t context_id = gfx_obj_context_new(t_ctx_func);
@@ -2031,15 +2158,8 @@ void gfx_exec_id(obj_id_t dict_id, obj_id_t id, int on_stack)
     context->parent_id = gfxboot_data->vm.program.context;
     gfxboot_data->vm.program.context = context_id;
 
-    if(dict_id) {
-      context->dict_id = gfx_obj_hash_new(0);
-      hash_t *hash = gfx_obj_hash_ptr(context->dict_id);
-      if(!hash) {
-        GFX_ERROR(err_no_memory);
-        return;
-      }
-      hash->parent_id = gfx_obj_ref_inc(dict_id);
-    }
+    // the local dictionary is created on demand, see gfx_obj_context_dict()
+    context->self_id = gfx_obj_ref_inc(dict_id);
 
     if(on_stack) gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
   }
@@ -2086,7 +2206,7 @@ void gfx_prim_exec()
     code.ptr->base_type == OTYPE_MEM &&
     (code.ptr->sub_type == t_word || code.ptr->sub_type == t_ref)
   ) {
-    code.id = gfx_lookup_dict(OBJ_DATA_FROM_PTR(code.ptr)).id2;
+    code.id = gfx_lookup_dict_cached(OBJ_DATA_FROM_PTR(code.ptr), gfx_program_sym(code.ptr), 0).id2;
   }
 
   gfx_exec_id(0, code.id, 1);
@@ -2171,6 +2291,7 @@ void gfx_prim__add(unsigned direct)
 
   obj_id_t direct_dict = 0;
   obj_id_t direct_key = op1.id;
+  obj_t direct_imm;
 
   if(direct) {
     if(op1.ptr->sub_type != t_ref) {
@@ -2178,7 +2299,7 @@ void gfx_prim__add(unsigned direct)
       return;
     }
 
-    obj_id_pair_t pair = gfx_lookup_dict(OBJ_DATA_FROM_PTR(op1.ptr));
+    obj_id_pair_t pair = gfx_lookup_dict_cached(OBJ_DATA_FROM_PTR(op1.ptr), gfx_program_sym(op1.ptr), 0);
 
     if(!pair.id1) {
       GFX_ERROR(err_invalid_hash_key);
@@ -2188,7 +2309,7 @@ void gfx_prim__add(unsigned direct)
     direct_dict = pair.id1;
     op1.id = pair.id2;
 
-    arg_update(&op1);
+    op1.ptr = OBJ_ID_IS_IMM(op1.id) ? gfx_obj_num_imm(op1.id, &direct_imm) : gfx_obj_ptr(op1.id);
 
     if(!op1.ptr) {
       GFX_ERROR(err_invalid_arguments);
@@ -2959,6 +3080,8 @@ void gfx_prim_cmp()
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 int is_true(obj_id_t id)
 {
+  if(OBJ_ID_IS_IMM(id)) return OBJ_ID_IMM_VALUE(id) ? 1 : 0;
+
   obj_t *ptr = gfx_obj_ptr(id);
   int val = 0;
 
@@ -3105,6 +3228,7 @@ void binary_op_on_stack(op_t op, unsigned direct)
 
   obj_id_t direct_dict = 0;
   obj_id_t direct_key = op1.id;
+  obj_t direct_imm;
 
   if(direct) {
     if(op1.ptr->sub_type != t_ref) {
@@ -3112,7 +3236,7 @@ void binary_op_on_stack(op_t op, unsigned direct)
       return;
     }
 
-    obj_id_pair_t pair = gfx_lookup_dict(OBJ_DATA_FROM_PTR(op1.ptr));
+    obj_id_pair_t pair = gfx_lookup_dict_cached(OBJ_DATA_FROM_PTR(op1.ptr), gfx_program_sym(op1.ptr), 0);
 
     if(!pair.id1) {
       GFX_ERROR(err_invalid_hash_key);
@@ -3122,7 +3246,7 @@ void binary_op_on_stack(op_t op, unsigned direct)
     direct_dict = pair.id1;
     op1.id = pair.id2;
 
-    arg_update(&op1);
+    op1.ptr = OBJ_ID_IS_IMM(op1.id) ? gfx_obj_num_imm(op1.id, &direct_imm) : gfx_obj_ptr(op1.id);
 
     if(!op1.ptr || op1.ptr->base_type != OTYPE_NUM) {
       GFX_ERROR(err_invalid_arguments);
@@ -3166,7 +3290,8 @@ void unary_op_on_stack(op_t op)
   }
 
   obj_id_t id = pstack->ptr[pstack->size - 1];
-  obj_t *ptr = gfx_obj_ptr(id);
+  obj_t imm;
+  obj_t *ptr = OBJ_ID_IS_IMM(id) ? gfx_obj_num_imm(id, &imm) : gfx_obj_ptr(id);
 
   if(!ptr || ptr->base_type != OTYPE_NUM) {
     GFX_ERROR(err_invalid_arguments);
@@ -3203,8 +3328,9 @@ void binary_cmp_on_stack(cmp_op_t op)
   obj_id_t id1 = pstack->ptr[pstack->size - 2];
   obj_id_t id2 = pstack->ptr[pstack->size - 1];
 
-  obj_t *ptr1 = gfx_obj_ptr(id1);
-  obj_t *ptr2 = gfx_obj_ptr(id2);
+  obj_t imm1, imm2;
+  obj_t *ptr1 = OBJ_ID_IS_IMM(id1) ? gfx_obj_num_imm(id1, &imm1) : gfx_obj_ptr(id1);
+  obj_t *ptr2 = OBJ_ID_IS_IMM(id2) ? gfx_obj_num_imm(id2, &imm2) : gfx_obj_ptr(id2);
 
   int result = 0;
 
@@ -3440,6 +3566,7 @@ void gfx_prim_setparent()
       hash_t *hash = OBJ_HASH_FROM_PTR(ptr1);
       old_parent_id = hash->parent_id;
       hash->parent_id = gfx_obj_ref_inc(id2);
+      gfx_obj_hash_touch(hash);
       break;
 
     case OTYPE_FONT:
@@ -3450,6 +3577,8 @@ void gfx_prim_setparent()
       font_t *font = OBJ_FONT_FROM_PTR(ptr1);
       old_parent_id = font->parent_id;
       font->parent_id = gfx_obj_ref_inc(id2);
+      // cached glyphs may come from the old parent
+      gfxboot_data->glyph_cache.gen++;
       break;
 
     case OTYPE_CONTEXT:
@@ -3489,8 +3618,9 @@ void gfx_prim_setparent()
 // A dictionary will only be created on demand - that is, the first time a
 // word is defined in the current context.
 //
-// When a program is started the global context is created containing a
-// dictionary with all primitive words.
+// When a program is started the global context is created with an empty
+// dictionary. Primitive words are not part of it; they are looked up after
+// all dictionaries, so a word defined with the same name takes precedence.
 //
 // example:
 //
@@ -3515,7 +3645,7 @@ void gfx_prim_getdict()
     return;
   }
 
-  gfx_obj_array_push(gfxboot_data->vm.program.pstack, context->dict_id, 1);
+  gfx_obj_array_push(gfxboot_data->vm.program.pstack, gfx_obj_context_dict(gfxboot_data->vm.program.context, 0), 1);
 }
 
 
@@ -3562,6 +3692,7 @@ void gfx_prim_setdict()
   }
 
   OBJ_ID_ASSIGN(context->dict_id, id1);
+  OBJ_ID_ASSIGN(context->self_id, 0);
 
   gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
 }
@@ -3589,6 +3720,9 @@ void gfx_prim_freeze()
 
   if(!argv) return;
 
+  // immediate values have no object to flag - and can't be modified anyway
+  if(OBJ_ID_IS_IMM(argv[0].id)) return;
+
   if(argv[0].ptr) argv[0].ptr->flags.ro = 1;
 }
 
@@ -4393,6 +4527,7 @@ void gfx_prim_run()
   OBJ_ID_ASSIGN(context->code_id, argv[0].id);
 
   context->ip = context->current_ip = 0;
+  context->slot = 0;
 
   gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
 }
@@ -4410,6 +4545,10 @@ void gfx_prim_run()
 // 
 // Read entire file and return its content. If the file could not be read, return nil.
 //
+// If an asset pack has been loaded at startup and contains the file, the
+// content is taken from the pack. As it points directly into the pack, it
+// is read-only - use `"" add` to get a writable copy.
+//
 // example:
 //
 // "foo" readfile
@@ -4447,24 +4586,47 @@ void gfx_prim_readfile()
 //
 // ( string_1 -- canvas_1 )
 // ( string_1 -- nil )
+// ( string_1 int_1 int_2 -- canvas_1 )
+// ( string_1 int_1 int_2 -- nil )
 // string_1: image file data
+// int_1, int_2: target width and height
 //
 // Unpacks image and returns a canvas object with the image or nil if the
 // data does not contain image data.
 //
+// With a target size, JPEG images are unpacked at 1/2, 1/4, or 1/8 of
+// their size if the result still covers int_1 x int_2. This is a lot
+// faster than unpacking the full image. PNG images are always unpacked at
+// full size.
+//
 // example:
 //
 // "foo.jpg" readfile unpackimage
 //
+// # unpack large background image for a 800x600 screen
+// "back.jpg" readfile 800 600 unpackimage
+//
 void gfx_prim_unpackimage()
 {
-  arg_t *argv = gfx_arg_1(OTYPE_MEM);
+  int width = 0, height = 0;
+  unsigned argc = 3;
+
+  arg_t *argv = gfx_arg_n(3, (uint8_t [3]) { OTYPE_MEM, OTYPE_NUM, OTYPE_NUM });
+
+  if(argv) {
+    width = (int) OBJ_VALUE_FROM_PTR(argv[1].ptr);
+    height = (int) OBJ_VALUE_FROM_PTR(argv[2].ptr);
+  }
+  else {
+    argc = 1;
+    argv = gfx_arg_1(OTYPE_MEM);
+  }
 
   if(!argv) return;
 
-  obj_id_t image_id = gfx_image_open(argv[0].id);
+  obj_id_t image_id = gfx_image_open(argv[0].id, width, height);
 
-  gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
+  gfx_obj_array_pop_n(argc, gfxboot_data->vm.program.pstack, 1);
 
   gfx_obj_array_push(gfxboot_data->vm.program.pstack, image_id, 0);
 }
@@ -4858,19 +5020,19 @@ void gfx_prim_encodeutf8()
   uint8_t *data = (uint8_t *) mem->ptr;
 
   for(int i = 0; i < (int) array_size; i++) {
-    int64_t *val = gfx_obj_num_ptr(gfx_obj_array_get(array_id, i));
+    int64_t val;
 
-    if(!val) {
+    if(!gfx_obj_num_value(gfx_obj_array_get(array_id, i), t_nil, &val)) {
       gfx_obj_ref_dec(mem_id);
       GFX_ERROR(err_invalid_data);
       return;
     }
 
-    if(*val <= 0) {
-      *data++ = -*val;
+    if(val <= 0) {
+      *data++ = -val;
     }
     else {
-      uint8_t *str = (uint8_t *) gfx_utf8_enc(*val);
+      uint8_t *str = (uint8_t *) gfx_utf8_enc(val);
       while(*str) *data++ = *str++;
     }
   }
@@ -4983,21 +5145,22 @@ void gfx_prim_format()
         }
         else {
           uint8_t buf[32];	// large enough for 64 bit numbers
-          uint64_t *num = gfx_obj_num_ptr(gfx_obj_array_get(values.id, arg_pos));
+          int64_t num;
+          int is_num = gfx_obj_num_value(gfx_obj_array_get(values.id, arg_pos), t_nil, &num);
 
           if(format_spec.precision) {
-            if(num) format_spec.zero = 1;	// not for nil
+            if(is_num) format_spec.zero = 1;	// not for nil
             if(format_spec.precision > format_spec.width) format_spec.width = format_spec.precision;
           }
 
-          if(num) {
+          if(is_num) {
             char f[8] = { '%' };
             char *fp = f + 1;
             if(format_spec.sign) *fp++ = (char) format_spec.sign;
             *fp++ = 'l';
             *fp++ = 'l';
             *fp++ = (char) f_val;
-            gfxboot_snprintf(buf, sizeof buf, f, (long long) *num);
+            gfxboot_snprintf(buf, sizeof buf, f, (long long) num);
             data_ptr = buf;
           }
           else {
@@ -5128,6 +5291,7 @@ void gfx_prim_updatescreen()
 
   area_t area = { .x = val1, .y = val2, .width = val3, .height = val4 };
 
+  gfx_screen_flush();
   gfx_screen_compose(area);
 
   gfx_obj_array_pop_n(4, gfxboot_data->vm.program.pstack, 1);
@@ -5253,6 +5417,7 @@ void gfx_prim_class()
     class_hash.ptr->flags.hash_is_class = 1;
 
     OBJ_ID_ASSIGN(OBJ_HASH_FROM_PTR(class_hash.ptr)->parent_id, parent.id);
+    gfx_obj_hash_touch(OBJ_HASH_FROM_PTR(class_hash.ptr));
   }
 
   gfx_obj_array_pop(gfxboot_data->vm.program.pstack, 1);
@@ -5314,6 +5479,7 @@ void gfx_prim_new()
     dict.ptr->flags.sticky = 1;
     dict.ptr->flags.hash_is_class = 1;
     OBJ_ID_ASSIGN(OBJ_HASH_FROM_PTR(dict.ptr)->parent_id, class_hash.id);
+    gfx_obj_hash_touch(OBJ_HASH_FROM_PTR(dict.ptr));
   }
 
   gfx_obj_array_pop_n(2, gfxboot_data->vm.program.pstack, 1);
@@ -5362,14 +5528,44 @@ void gfx_prim_self()
 
   do {
     hash_t *dict = gfx_obj_hash_ptr(context->dict_id);
-    if(!dict) continue;
+    obj_id_t parent_id = dict ? dict->parent_id : context->self_id;
 
-    obj_t *ptr = gfx_obj_ptr(dict->parent_id);
+    obj_t *ptr = gfx_obj_ptr(parent_id);
     if(ptr && ptr->base_type == OTYPE_HASH && ptr->flags.hash_is_class) {
-      self_id = dict->parent_id;
+      self_id = parent_id;
       break;
     }
   } while((context = gfx_obj_context_ptr(context->parent_id)));
 
   gfx_obj_array_push(gfxboot_data->vm.program.pstack, self_id, 1);
 }
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// mark point for heap snapshot
+//
+// group: def
+//
+// ( -- )
+//
+// When creating a heap snapshot (`gfxboot-x11 --snapshot`), stop program
+// execution here and save the complete VM state. Booting from the snapshot
+// continues right after this point. Otherwise, do nothing.
+//
+// Use this to skip setup code that produces the same result on every boot.
+// Note that screen size and available files must not change between creating
+// and using a snapshot.
+//
+// example:
+//
+// /colors [ 0xff0000 0x00ff00 0x0000ff ] def   # expensive setup
+// snapshot
+// colors 0 get setcolor
+//
+void gfx_prim_snapshot()
+{
+  if(gfxboot_data->vm.snapshot.create) {
+    gfxboot_data->vm.snapshot.ready = 1;
+    gfxboot_data->vm.program.stop = 1;
+  }
+}